@@ -7,6 +7,7 @@
 #include <cstdint>
 #include <algorithm>
 #include "bst.h"
+#include "frozen_bst.h"
 
 struct KeyError { };
 
@@ -16,28 +17,33 @@ struct KeyError { };
 * add additional data members or helper functions.
 */
 template <typename Key, typename Value>
-class AVLNode : public Node<Key, Value>
+class AVLNode : public TypedNode<Key, Value, AVLNode<Key, Value> >
 {
 public:
     // Constructor/destructor.
     AVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent);
-    virtual ~AVLNode();
+    template<typename... ItemArgs>
+    AVLNode(in_place_item_t tag, AVLNode<Key, Value>* parent, ItemArgs&&... item_args);
+    ~AVLNode();
 
     // Getter/setter for the node's height.
     int8_t getBalance () const;
     void setBalance (int8_t balance);
     void updateBalance(int8_t diff);
 
-    // Getters for parent, left, and right. These need to be redefined since they
-    // return pointers to AVLNodes - not plain Nodes. See the Node class in bst.h
+    // Number of nodes in the subtree rooted here, only kept up to date
+    // by ranked trees (see RankedAVLTree below).
+    uint32_t getSubtreeSize() const { return subtree_size_; }
+    void setSubtreeSize(uint32_t size) { subtree_size_ = size; }
+
+    // Getters for parent, left, and right come from TypedNode and return
+    // pointers to AVLNodes - not plain Nodes. See the TypedNode class in bst.h
     // for more information.
-    virtual AVLNode<Key, Value>* getParent() const override;
-    virtual AVLNode<Key, Value>* getLeft() const override;
-    virtual AVLNode<Key, Value>* getRight() const override;
 
 protected:
     int8_t balance_;    // effectively a signed char
 //    int height_;
+    uint32_t subtree_size_;
 
 };
 
@@ -52,7 +58,19 @@ protected:
 */
 template<class Key, class Value>
 AVLNode<Key, Value>::AVLNode(const Key& key, const Value& value, AVLNode<Key, Value> *parent) :
-        Node<Key, Value>(key, value, parent), balance_(0)
+        TypedNode<Key, Value, AVLNode<Key, Value> >(key, value, parent), balance_(0), subtree_size_(1)
+{
+
+}
+
+/**
+* A constructor that builds the item in place, see the Node one.
+*/
+template<class Key, class Value>
+template<typename... ItemArgs>
+AVLNode<Key, Value>::AVLNode(in_place_item_t tag, AVLNode<Key, Value>* parent, ItemArgs&&... item_args) :
+        TypedNode<Key, Value, AVLNode<Key, Value> >(tag, parent, std::forward<ItemArgs>(item_args)...), balance_(0),
+        subtree_size_(1)
 {
 
 }
@@ -94,35 +112,6 @@ void AVLNode<Key, Value>::updateBalance(int8_t diff)
     balance_ += diff;
 }
 
-/**
-* An overridden function for getting the parent since a static_cast is necessary to make sure
-* that our node is a AVLNode.
-*/
-template<class Key, class Value>
-AVLNode<Key, Value> *AVLNode<Key, Value>::getParent() const
-{
-    return static_cast<AVLNode<Key, Value>*>(this->parent_);
-}
-
-/**
-* Overridden for the same reasons as above.
-*/
-template<class Key, class Value>
-AVLNode<Key, Value> *AVLNode<Key, Value>::getLeft() const
-{
-    return static_cast<AVLNode<Key, Value>*>(this->left_);
-}
-
-/**
-* Overridden for the same reasons as above.
-*/
-template<class Key, class Value>
-AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
-{
-    return static_cast<AVLNode<Key, Value>*>(this->right_);
-}
-
-
 /*
   -----------------------------------------------
   End implementations for the AVLNode class.
@@ -130,42 +119,281 @@ AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
 */
 
 
-template <class Key, class Value>
-class AVLTree : public BinarySearchTree<Key, Value>
+/**
+* An AVL tree. With Ranked set every node also keeps the size of its
+* subtree up to date, which gives rank() and select() in O(log n) at the
+* cost of walking all the way to the root on every insert and remove
+* (unranked trees stop as soon as the heights settle).
+*/
+template <class Key, class Value,
+          class Compare = std::less<Key>,
+          class Alloc = NodePool<std::pair<const Key, Value> >,
+          bool Ranked = false>
+class AVLTree : public BinarySearchTree<Key, Value, Compare, Alloc>
 {
 public:
+    AVLTree();
+    explicit AVLTree(const Compare& comp);
+    template<typename ForwardIt>
+    AVLTree(ForwardIt first, ForwardIt last, const Compare& comp = Compare());
+    virtual ~AVLTree();
     virtual void insert (const std::pair<const Key, Value> &new_item); // TODO
+    virtual void insert (std::pair<const Key, Value>&& new_item);
     virtual void remove(const Key& key);  // TODO
+
+    typedef typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator iterator;
+    typedef typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator const_iterator;
+
+    // same as the BinarySearchTree ones, building AVLNodes and rebalancing
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args);
+
+    // order statistics, only for ranked trees
+    std::size_t rank(const Key& key) const;
+    iterator select(std::size_t k);
+    const_iterator select(std::size_t k) const;
+
+    // immutable copy for read-mostly phases, see FrozenTree
+    FrozenTree<Key, Value, Compare> freeze() const;
+
+    // snapshot files, for trivially copyable keys and values. save writes
+    // freeze()'s layout, load replaces the contents with a saved tree's in
+    // O(n) with no rotations. To query a file without building a tree at
+    // all, use FrozenTree::open.
+    void save(const std::string& path) const;
+    void load(const std::string& path, bool verify = true);
+
+    // set operations with another tree, the result replaces this tree's
+    // contents. They split and join whole subtrees instead of inserting
+    // one key at a time, recursing on the two halves on up to threads
+    // threads, 0 for one per core. unite keeps other's value for keys in both.
+    // intersect and subtract with a much smaller other go key by key instead.
+    void unite(const AVLTree& other, unsigned threads = 0);
+    void intersect(const AVLTree& other, unsigned threads = 0);
+    void subtract(const AVLTree& other, unsigned threads = 0);
 protected:
     virtual void nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2);
 
+    // AVL trees allocate AVLNodes from their own rebound allocator
+    virtual AVLNode<Key, Value>* createNode(const Key& key, const Value& value, Node<Key, Value>* parent);
+    virtual AVLNode<Key, Value>* createNodeFrom(std::pair<Key, Value>&& item, Node<Key, Value>* parent);
+    virtual void insertFixup(Node<Key, Value>* parent);
+    template<typename... ItemArgs>
+    AVLNode<Key, Value>* constructNode(Node<Key, Value>* parent, ItemArgs&&... item_args);
+    template<typename K, typename... Args>
+    std::pair<iterator, bool> try_emplace_helper(K&& key, Args&&... args);
+    virtual void destroyNode(Node<Key, Value>* node);
+    virtual void destroyAllNodes();
+    virtual void setBuiltHeights(Node<Key, Value>* node, int left_height, int right_height);
+    virtual std::string checkNode(const Node<Key, Value>* node, int left_height, int right_height) const;
+
     // Add helper functions here
-    void balance_avl(AVLNode<Key, Value>* node);
+    AVLNode<Key, Value>* balance_avl(AVLNode<Key, Value>* node);
     void update_avl(AVLNode<Key, Value>* node);
-    void rotate_right(AVLNode<Key, Value>* node);
-    void rotate_left(AVLNode<Key, Value>* node);
+    AVLNode<Key, Value>* rotate_right(AVLNode<Key, Value>* node);
+    AVLNode<Key, Value>* rotate_left(AVLNode<Key, Value>* node);
 
     // redo funcs
-    void update_heights(AVLNode<Key, Value>* node);
+    static void update_height(AVLNode<Key, Value>* node);
+    static void update_size(AVLNode<Key, Value>* node);
+    AVLNode<Key, Value>* select_node(std::size_t k) const;
     void remove_helper(const Key& key);
 
-
+    // join-based building blocks. They work on detached subtrees, whose
+    // roots have no parent, and return detached subtrees.
+    static int height_of(const AVLNode<Key, Value>* node);
+    AVLNode<Key, Value>* link_nodes(AVLNode<Key, Value>* left, AVLNode<Key, Value>* node, AVLNode<Key, Value>* right);
+    AVLNode<Key, Value>* join(AVLNode<Key, Value>* left, AVLNode<Key, Value>* pivot, AVLNode<Key, Value>* right);
+    AVLNode<Key, Value>* join_right(AVLNode<Key, Value>* left, AVLNode<Key, Value>* pivot, AVLNode<Key, Value>* right);
+    AVLNode<Key, Value>* join_left(AVLNode<Key, Value>* left, AVLNode<Key, Value>* pivot, AVLNode<Key, Value>* right);
+    AVLNode<Key, Value>* join2(AVLNode<Key, Value>* left, AVLNode<Key, Value>* right);
+    AVLNode<Key, Value>* split_last(AVLNode<Key, Value>* tree, AVLNode<Key, Value>*& last);
+    void split(AVLNode<Key, Value>* tree, const Key& key, AVLNode<Key, Value>*& left,
+               AVLNode<Key, Value>*& found, AVLNode<Key, Value>*& right);
+
+    // the set operations on detached subtrees, nodes that leave the
+    // result are added to dropped to be freed afterwards
+    AVLNode<Key, Value>* union_nodes(AVLNode<Key, Value>* a, AVLNode<Key, Value>* b,
+                                     std::vector<Node<Key, Value>*>& dropped, unsigned threads);
+    AVLNode<Key, Value>* filter_nodes(AVLNode<Key, Value>* a, const AVLNode<Key, Value>* b, bool keep_common,
+                                      std::vector<Node<Key, Value>*>& dropped, unsigned threads);
+    AVLNode<Key, Value>* clone_nodes(const AVLNode<Key, Value>* node, std::vector<Node<Key, Value>*>& created);
+    void finish_set_operation(AVLNode<Key, Value>* root, std::vector<Node<Key, Value>*>& dropped);
+    // other is "much smaller" for intersect and subtract at this many times
+    // fewer keys; measured, key by key wins from about there down
+    static const std::size_t SMALL_OTHER_RATIO = 4;
+
+    // AVLNodes come from an allocator of their own type; the base tree's
+    // Node allocator is never used, and a NodePool takes no memory until
+    // its first allocate
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<AVLNode<Key, Value> > AVLNodeAlloc;
+    typedef std::allocator_traits<AVLNodeAlloc> AVLNodeAllocTraits;
+
+    AVLNodeAlloc avlNodeAlloc_;
 
 };
 
-template<typename Key, typename Value>
-void AVLTree<Key, Value>::update_heights(AVLNode<Key, Value>* node) {
-    if (node == nullptr) return;
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+AVLTree<Key, Value, Compare, Alloc, Ranked>::AVLTree()
+{
+
+}
 
-    // First, update the height of the children
-    if (node->getLeft()) {
-        update_heights(node->getLeft());
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+AVLTree<Key, Value, Compare, Alloc, Ranked>::AVLTree(const Compare& comp) :
+    BinarySearchTree<Key, Value, Compare, Alloc>(comp)
+{
+
+}
+
+/**
+* Builds a perfectly balanced AVL tree from a range in linear time. This
+* can't just use the base class constructor, which would make plain Nodes.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+template<typename ForwardIt>
+AVLTree<Key, Value, Compare, Alloc, Ranked>::AVLTree(ForwardIt first, ForwardIt last, const Compare& comp) :
+    BinarySearchTree<Key, Value, Compare, Alloc>(comp)
+{
+    this->assign(first, last);
+}
+
+/**
+* The base destructor would only see the base class node hooks,
+* so the AVL nodes are freed here while the AVL part still exists.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+AVLTree<Key, Value, Compare, Alloc, Ranked>::~AVLTree()
+{
+    this->clear();
+}
+
+/**
+* Allocates and constructs an AVLNode from the tree's allocator.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Ranked>::createNode(
+    const Key& key, const Value& value, Node<Key, Value>* parent)
+{
+    return constructNode(parent, key, value);
+}
+
+/**
+* Allocates an AVLNode and moves item into it.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Ranked>::createNodeFrom(
+    std::pair<Key, Value>&& item, Node<Key, Value>* parent)
+{
+    return constructNode(parent, std::move(item.first), std::move(item.second));
+}
+
+/**
+* Rebalances from the parent of a node the base tree just linked in.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::insertFixup(Node<Key, Value>* parent)
+{
+    if (parent != nullptr) update_avl(static_cast<AVLNode<Key, Value>*>(parent));
+}
+
+/**
+* Allocates an AVLNode and builds its item in place from item_args.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+template<typename... ItemArgs>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Ranked>::constructNode(
+    Node<Key, Value>* parent, ItemArgs&&... item_args)
+{
+    AVLNode<Key, Value>* node = AVLNodeAllocTraits::allocate(avlNodeAlloc_, 1);
+    try {
+        AVLNodeAllocTraits::construct(avlNodeAlloc_, node, in_place_item_t(),
+                                      static_cast<AVLNode<Key, Value>*>(parent),
+                                      std::forward<ItemArgs>(item_args)...);
+    } catch (...) {
+        AVLNodeAllocTraits::deallocate(avlNodeAlloc_, node, 1);
+        throw;
     }
-    if (node->getRight()) {
-        update_heights(node->getRight());
+    this->treeStats().add(STAT_ALLOCATIONS);
+    this->size_++;
+    return node;
+}
+
+/**
+* Destroys a single AVLNode and hands its storage back to the allocator.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::destroyNode(Node<Key, Value>* node)
+{
+    AVLNode<Key, Value>* n = static_cast<AVLNode<Key, Value>*>(node);
+    AVLNodeAllocTraits::destroy(avlNodeAlloc_, n);
+    AVLNodeAllocTraits::deallocate(avlNodeAlloc_, n, 1);
+    this->treeStats().add(STAT_DEALLOCATIONS);
+    this->size_--;
+}
+
+/**
+* AVL nodes must store their real height and balance, and be in balance.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+std::string AVLTree<Key, Value, Compare, Alloc, Ranked>::checkNode(const Node<Key, Value>* node, int left_height, int right_height) const
+{
+    const AVLNode<Key, Value>* n = static_cast<const AVLNode<Key, Value>*>(node);
+    int height = 1 + std::max(left_height, right_height);
+    if (n->get_height() != height) {
+        return "stored height " + std::to_string(n->get_height()) + ", actual " + std::to_string(height);
+    }
+    if (n->getBalance() != left_height - right_height) {
+        return "stored balance " + std::to_string(n->getBalance()) + ", actual " + std::to_string(left_height - right_height);
+    }
+    if (std::abs(left_height - right_height) > 1) {
+        return "out of balance, left height " + std::to_string(left_height) + ", right height " + std::to_string(right_height);
     }
+    if (Ranked) {
+        // the children were checked first, so their sizes can be trusted
+        uint32_t size = 1;
+        if (n->getLeft() != nullptr) size += n->getLeft()->getSubtreeSize();
+        if (n->getRight() != nullptr) size += n->getRight()->getSubtreeSize();
+        if (n->getSubtreeSize() != size) {
+            return "stored subtree size " + std::to_string(n->getSubtreeSize()) + ", actual " + std::to_string(size);
+        }
+    }
+    return "";
+}
 
-    // Now update the height and balance of the current node
+/**
+* Bulk loaded nodes need their balance as well as their height.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::setBuiltHeights(Node<Key, Value>* node, int left_height, int right_height)
+{
+    AVLNode<Key, Value>* n = static_cast<AVLNode<Key, Value>*>(node);
+    n->set_height(1 + std::max(left_height, right_height));
+    n->setBalance(left_height - right_height);
+    if (Ranked) update_size(n);
+}
+
+/**
+* Same as the base version, but for the AVL node allocator.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::destroyAllNodes()
+{
+    if (!std::is_trivially_destructible<std::pair<const Key, Value> >::value ||
+        !release_all(avlNodeAlloc_)) {
+        clear_nodes(this->root_, [this](Node<Key, Value>* n) { this->destroyNode(n); });
+    } else {
+        this->treeStats().add(STAT_DEALLOCATIONS, this->size_);
+    }
+}
+
+// helper to recompute a node's height and balance from its children's stored heights
+template<typename Key, typename Value, typename Compare, typename Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::update_height(AVLNode<Key, Value>* node) {
     int left_height = (node->getLeft() != nullptr) ? node->getLeft()->get_height() : 0;
     int right_height = (node->getRight() != nullptr) ? node->getRight()->get_height() : 0;
 
@@ -174,14 +402,25 @@ void AVLTree<Key, Value>::update_heights(AVLNode<Key, Value>* node) {
 
     // Update height (1 + max of left and right subtree heights)
     node->set_height(std::max(left_height, right_height) + 1);
+
+    if (Ranked) update_size(node);
+}
+
+// helper to recompute a node's subtree size from its children's stored sizes
+template<typename Key, typename Value, typename Compare, typename Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::update_size(AVLNode<Key, Value>* node) {
+    uint32_t size = 1;
+    if (node->getLeft() != nullptr) size += node->getLeft()->getSubtreeSize();
+    if (node->getRight() != nullptr) size += node->getRight()->getSubtreeSize();
+    node->setSubtreeSize(size);
 }
 
 
-// helper function to rotate a node left
-template<typename Key, typename Value>
-void AVLTree<Key, Value>::rotate_left(AVLNode<Key, Value> *node) {
+// helper function to rotate a node left, returns the new root of the subtree
+template<typename Key, typename Value, typename Compare, typename Alloc, bool Ranked>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Ranked>::rotate_left(AVLNode<Key, Value> *node) {
     // exit if rotation not possible
-    if (!node || !node->getRight()) return;
+    if (!node || !node->getRight()) return node;
 
     // get elements to use in rotation
     AVLNode<Key, Value>* parent = node->getParent();
@@ -200,25 +439,25 @@ void AVLTree<Key, Value>::rotate_left(AVLNode<Key, Value> *node) {
     if (parent) {
         if (parent->getLeft() == node) parent->setLeft(n1);
         else parent->setRight(n1);
-    } else {
+    } else if (this->root_ == node) {
+        // not for the detached subtrees the set operations rotate
         this->root_ = n1;
     }
 
     // update node's parent
     node->setParent(n1);
 
-    // update balance factors
-    node->updateBalance(-1);
-    n1->updateBalance(1);;
-//    if(t1)t1->updateBalance(3);
-
+    // only node and n1 changed children, node is now below n1
+    update_height(node);
+    update_height(n1);
+    return n1;
 }
 
-// helper function to rotate a node left
-template<typename Key, typename Value>
-void AVLTree<Key, Value>::rotate_right(AVLNode<Key, Value> *node) {
+// helper function to rotate a node right, returns the new root of the subtree
+template<typename Key, typename Value, typename Compare, typename Alloc, bool Ranked>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Ranked>::rotate_right(AVLNode<Key, Value> *node) {
     // exit if rotation not possible
-    if (!node || !node->getLeft()) return;
+    if (!node || !node->getLeft()) return node;
 
     // get elements to use in rotation
     AVLNode<Key, Value>* parent = node->getParent();
@@ -237,67 +476,75 @@ void AVLTree<Key, Value>::rotate_right(AVLNode<Key, Value> *node) {
     if (parent) {
         if (parent->getLeft() == node) parent->setLeft(n1);
         else parent->setRight(n1);
-    } else {
+    } else if (this->root_ == node) {
+        // not for the detached subtrees the set operations rotate
         this->root_ = n1;
     }
 
     // update node's parent
     node->setParent(n1);
 
-    node->updateBalance(1);
-    n1->updateBalance(-1);
-//    if(t1)t1->updateBalance(3);
+    // only node and n1 changed children, node is now below n1
+    update_height(node);
+    update_height(n1);
+    return n1;
 }
 
-// helper function to balance tree
-template<typename Key, typename Value>
-void AVLTree<Key, Value>::balance_avl(AVLNode<Key, Value> *node) {
+// helper function to balance tree, returns the new root of the subtree
+template<typename Key, typename Value, typename Compare, typename Alloc, bool Ranked>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Ranked>::balance_avl(AVLNode<Key, Value> *node) {
     int b_factor = node->getBalance();
 
     // handle cases
     if (b_factor > 1) {  // left heavy tree
         if (node->getLeft()->getBalance() >= 0) {  // left-left (LL) case
-            rotate_right(node);
+            this->treeStats().add(STAT_SINGLE_ROTATIONS);
+            return rotate_right(node);
         } else { // left-right (LR) case
+            this->treeStats().add(STAT_DOUBLE_ROTATIONS);
             rotate_left(node->getLeft());
-            rotate_right(node);
+            return rotate_right(node);
         }
     } else if (b_factor < -1) { // right heavy
         if (node->getRight()->getBalance() <= 0) {  // right-right (RR) case
-            rotate_left(node);
+            this->treeStats().add(STAT_SINGLE_ROTATIONS);
+            return rotate_left(node);
         } else { // right-left (RL) case
+            this->treeStats().add(STAT_DOUBLE_ROTATIONS);
             rotate_right(node->getRight());
-            rotate_left(node);
+            return rotate_left(node);
         }
 
     }
 
+    return node;
 }
 
-template<typename Key, typename Value>
-void AVLTree<Key, Value>::update_avl(AVLNode<Key, Value>* node) {
-    // return;
-//    update_heights(static_cast<AVLNode<Key, Value>*>(this->root_));
-
-    // use rotations to balance tree
+// walks from the lowest node whose children changed up to the root, fixing stored
+// heights and rotating where needed. Stops as soon as a subtree's height is the
+// same as before, since nothing above it can have changed. Ranked trees still
+// have to fix the subtree sizes the rest of the way up.
+template<typename Key, typename Value, typename Compare, typename Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::update_avl(AVLNode<Key, Value>* node) {
     while (node != nullptr) {
-        int left_height = getSubtreeHeight(node->getLeft());
-        int right_height = getSubtreeHeight(node->getRight());
-        node->setBalance(left_height - right_height);
-
-        // Update the height of the node
-//        update_heights(node);
-
-        // update balance
-        balance_avl(node);
+        AVLNode<Key, Value>* parent = node->getParent();
+        int old_height = node->get_height();
+
+        // recompute from children, then rotate if out of balance
+        update_height(node);
+        node = balance_avl(node);
+
+        // ancestors only depend on this subtree's height
+        if (node->get_height() == old_height) {
+            if (Ranked) {
+                for (node = parent; node != nullptr; node = node->getParent()) update_size(node);
+            }
+            break;
+        }
 
         // call again on parent
-        node = node->getParent();
-
+        node = parent;
     }
-
-//    this->print();
-
 }
 
 
@@ -305,35 +552,109 @@ void AVLTree<Key, Value>::update_avl(AVLNode<Key, Value>* node) {
  * Recall: If key is already in the tree, you should
  * overwrite the current value with the updated value.
  */
-template<class Key, class Value>
-void AVLTree<Key, Value>::insert (const std::pair<const Key, Value> &new_item)
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::insert (const std::pair<const Key, Value> &new_item)
 {
-    // TODO
-//    std::cout << "adding: " << new_item.first << std::endl;
+    // single descent: overwrite in place, or remember the leaf to attach under
+    Node<Key, Value>* parent;
+    bool go_left;
+    Node<Key, Value>* curr = this->findInsertPos(new_item.first, parent, go_left);
+    if (curr != nullptr) {
+        curr->setValue(new_item.second);
+        return;
+    }
 
-    // check to see if exists
-    Node<Key, Value>* exists = this->internalFind(new_item.first);
+    // only allocate once we know the key is new
+    this->linkNode(createNode(new_item.first, new_item.second, parent), parent, go_left);
 
-    // convert pair into a node
-    AVLNode<Key, Value>* node = new AVLNode<Key, Value>(new_item.first, new_item.second, nullptr);
+    // use rotations to balance tree
+    if (parent != nullptr) update_avl(static_cast<AVLNode<Key, Value>*>(parent));
+}
 
-    // make a new node if root is null
-    if (this->root_ == nullptr) {
-        this->root_ = node;
+/*
+ * Same as above, moving the value instead of copying it.
+ */
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::insert (std::pair<const Key, Value>&& new_item)
+{
+    Node<Key, Value>* parent;
+    bool go_left;
+    Node<Key, Value>* curr = this->findInsertPos(new_item.first, parent, go_left);
+    if (curr != nullptr) {
+        curr->setValue(std::move(new_item.second));
         return;
     }
 
-    // call helper function to insert
-    insert_node(this->root_, node);
+    this->linkNode(constructNode(parent, std::move(new_item)), parent, go_left);
+    if (parent != nullptr) update_avl(static_cast<AVLNode<Key, Value>*>(parent));
+}
 
-    // use rotations to balance tree
-    if (!exists) update_avl(node);
+/*
+ * Builds the item first since its key is needed for the descent,
+ * and throws it away if the key is already in the tree.
+ */
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+template<typename... Args>
+std::pair<typename AVLTree<Key, Value, Compare, Alloc, Ranked>::iterator, bool>
+AVLTree<Key, Value, Compare, Alloc, Ranked>::emplace(Args&&... args)
+{
+    AVLNode<Key, Value>* node = constructNode(nullptr, std::forward<Args>(args)...);
+
+    Node<Key, Value>* parent;
+    bool go_left;
+    Node<Key, Value>* curr = this->findInsertPos(node->getKey(), parent, go_left);
+    if (curr != nullptr) {
+        AVLTree<Key, Value, Compare, Alloc, Ranked>::destroyNode(node);
+        return std::make_pair(this->iteratorAt(curr), false);
+    }
+    node->setParent(parent);
+    this->linkNode(node, parent, go_left);
+    if (parent != nullptr) update_avl(static_cast<AVLNode<Key, Value>*>(parent));
+    return std::make_pair(this->iteratorAt(node), true);
+}
 
-//    this->print();
+/*
+ * Builds nothing if the key is already in the tree.
+ */
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+template<typename... Args>
+std::pair<typename AVLTree<Key, Value, Compare, Alloc, Ranked>::iterator, bool>
+AVLTree<Key, Value, Compare, Alloc, Ranked>::try_emplace(const Key& key, Args&&... args)
+{
+    return try_emplace_helper(key, std::forward<Args>(args)...);
+}
+
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+template<typename... Args>
+std::pair<typename AVLTree<Key, Value, Compare, Alloc, Ranked>::iterator, bool>
+AVLTree<Key, Value, Compare, Alloc, Ranked>::try_emplace(Key&& key, Args&&... args)
+{
+    return try_emplace_helper(std::move(key), std::forward<Args>(args)...);
 }
 
-template<typename Key, typename Value>
-void AVLTree<Key, Value>::remove_helper(const Key& key) {
+/*
+ * Both try_emplaces, key is a const Key& or a Key&&.
+ */
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+template<typename K, typename... Args>
+std::pair<typename AVLTree<Key, Value, Compare, Alloc, Ranked>::iterator, bool>
+AVLTree<Key, Value, Compare, Alloc, Ranked>::try_emplace_helper(K&& key, Args&&... args)
+{
+    Node<Key, Value>* parent;
+    bool go_left;
+    Node<Key, Value>* curr = this->findInsertPos(key, parent, go_left);
+    if (curr != nullptr) return std::make_pair(this->iteratorAt(curr), false);
+
+    AVLNode<Key, Value>* node = constructNode(parent, std::piecewise_construct,
+                                              std::forward_as_tuple(std::forward<K>(key)),
+                                              std::forward_as_tuple(std::forward<Args>(args)...));
+    this->linkNode(node, parent, go_left);
+    if (parent != nullptr) update_avl(static_cast<AVLNode<Key, Value>*>(parent));
+    return std::make_pair(this->iteratorAt(node), true);
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::remove_helper(const Key& key) {
 
     // first find node
     AVLNode<Key, Value>* node = static_cast<AVLNode<Key, Value>*>(this->internalFind(key));
@@ -364,7 +685,7 @@ void AVLTree<Key, Value>::remove_helper(const Key& key) {
 
         // update child pointer and delete node
         if (child) child->setParent(parent);
-        delete node;
+        destroyNode(node);
 
         // rebalance
         update_avl(parent);
@@ -379,11 +700,12 @@ void AVLTree<Key, Value>::remove_helper(const Key& key) {
  * Recall: The writeup specifies that if a node has 2 children you
  * should swap with the predecessor and then remove.
  */
-template<class Key, class Value>
-void AVLTree<Key, Value>:: remove(const Key& key)
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>:: remove(const Key& key)
 {
     // TODO
 //    std::cout << "removing: " << key << std::endl;
+    typename TreeStatsPolicy::Operation op(this->treeStats(), STAT_REMOVES, STAT_REMOVE_VISITS);
 
     // first find node
     AVLNode<Key, Value>* node = static_cast<AVLNode<Key, Value>*>(this->internalFind(key));
@@ -399,7 +721,7 @@ void AVLTree<Key, Value>:: remove(const Key& key)
 
     } else {
         // use bst implementation to remove node
-        BinarySearchTree<Key, Value>::remove(key);
+        BinarySearchTree<Key, Value, Compare, Alloc>::remove(key);
 
         // rebalance
         update_avl(parent);
@@ -409,14 +731,440 @@ void AVLTree<Key, Value>:: remove(const Key& key)
 
 }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2)
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2)
 {
-    BinarySearchTree<Key, Value>::nodeSwap(n1, n2);
+    BinarySearchTree<Key, Value, Compare, Alloc>::nodeSwap(n1, n2);
     int8_t tempB = n1->getBalance();
     n1->setBalance(n2->getBalance());
     n2->setBalance(tempB);
+    int tempH = n1->get_height();
+    n1->set_height(n2->get_height());
+    n2->set_height(tempH);
+    uint32_t tempS = n1->getSubtreeSize();
+    n1->setSubtreeSize(n2->getSubtreeSize());
+    n2->setSubtreeSize(tempS);
+}
+
+/**
+* Returns how many keys in the tree are less than key.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+std::size_t AVLTree<Key, Value, Compare, Alloc, Ranked>::rank(const Key& key) const
+{
+    static_assert(Ranked, "rank() needs a ranked tree, see RankedAVLTree");
+    std::size_t below = 0;
+    AVLNode<Key, Value>* node = static_cast<AVLNode<Key, Value>*>(this->root_);
+    while (node != nullptr) {
+        if (this->comp_(node->getKey(), key)) {
+            // node and its whole left subtree are below key
+            below += 1 + (node->getLeft() ? node->getLeft()->getSubtreeSize() : 0);
+            node = node->getRight();
+        } else {
+            node = node->getLeft();
+        }
+    }
+    return below;
+}
+
+/**
+* Returns an iterator to the item with k smaller keys in the tree (so
+* select(0) is the smallest), or the end iterator if k >= size().
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+typename AVLTree<Key, Value, Compare, Alloc, Ranked>::iterator
+AVLTree<Key, Value, Compare, Alloc, Ranked>::select(std::size_t k)
+{
+    return this->iteratorAt(select_node(k));
+}
+
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+typename AVLTree<Key, Value, Compare, Alloc, Ranked>::const_iterator
+AVLTree<Key, Value, Compare, Alloc, Ranked>::select(std::size_t k) const
+{
+    return this->iteratorAt(select_node(k));
+}
+
+// helper to walk down to the node with k smaller keys, null if k >= size()
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Ranked>::select_node(std::size_t k) const
+{
+    static_assert(Ranked, "select() needs a ranked tree, see RankedAVLTree");
+    AVLNode<Key, Value>* node = static_cast<AVLNode<Key, Value>*>(this->root_);
+    while (node != nullptr) {
+        std::size_t left_size = node->getLeft() ? node->getLeft()->getSubtreeSize() : 0;
+        if (k < left_size) {
+            node = node->getLeft();
+        } else if (k == left_size) {
+            break;
+        } else {
+            k -= left_size + 1;
+            node = node->getRight();
+        }
+    }
+    return node;
+}
+
+/**
+* Copies the tree into a FrozenTree, whose find and lower_bound search
+* one flat array instead of chasing node pointers. Later changes to the
+* tree do not show up in the snapshot.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+FrozenTree<Key, Value, Compare> AVLTree<Key, Value, Compare, Alloc, Ranked>::freeze() const
+{
+    return FrozenTree<Key, Value, Compare>(this->begin(), this->end(), this->comp_);
 }
 
+/**
+* Writes the tree to a snapshot file, see FrozenTree::save. Throws
+* std::runtime_error if it can't.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::save(const std::string& path) const
+{
+    freeze().save(path);
+}
+
+/**
+* Replaces the contents with a snapshot file's. The file is mapped and its
+* entries are linked into a perfectly balanced tree in key order, like
+* assign() does with a sorted range. Throws std::runtime_error for a bad
+* file (see FrozenTree::open) and leaves the tree as it was.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::load(const std::string& path, bool verify)
+{
+    FrozenTree<Key, Value, Compare> snapshot = FrozenTree<Key, Value, Compare>::open(path, verify, this->comp_);
+    this->clear();
+    typename FrozenTree<Key, Value, Compare>::const_iterator it = snapshot.begin();
+    int height;
+    this->root_ = this->buildSubtree(it, snapshot.size(), height);
+}
+
+/**
+* Replaces the contents with the keys in this tree or other. other's nodes
+* are copied into this tree's allocator first (each tree owns its node
+* pool, so nodes can't move between trees), then both are merged by
+* splitting this tree at the root of the copy and uniting the halves.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::unite(const AVLTree& other, unsigned threads)
+{
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    if (&other == this) return;
+
+    std::vector<Node<Key, Value>*> created;
+    AVLNode<Key, Value>* copy;
+    try {
+        copy = clone_nodes(static_cast<const AVLNode<Key, Value>*>(other.root_), created);
+    } catch (...) {
+        for (std::size_t i = 0; i < created.size(); i++) this->destroyNode(created[i]);
+        throw;
+    }
+
+    AVLNode<Key, Value>* root = static_cast<AVLNode<Key, Value>*>(this->root_);
+    this->root_ = nullptr;
+    std::vector<Node<Key, Value>*> dropped;
+    finish_set_operation(union_nodes(root, copy, dropped, threads), dropped);
+}
+
+/**
+* Keeps only the keys that are also in other, with this tree's values.
+* other is only read. Splitting and joining is O(m log(n/m + 1)) for m
+* keys in other, but every dropped node is freed one at a time on top
+* of that. So when other is much smaller and the pool can drop all its
+* nodes at once, the kept items are looked up and copied out instead,
+* O(m log n), and the tree is rebuilt from them after a bulk release.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::intersect(const AVLTree& other, unsigned threads)
+{
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    if (&other == this) return;
+
+    if (other.size_ * SMALL_OTHER_RATIO <= this->size_ &&
+        std::is_trivially_destructible<std::pair<const Key, Value> >::value &&
+        can_release_all<AVLNodeAlloc>::value) {
+        std::vector<std::pair<Key, Value> > kept;
+        for (const_iterator it = other.begin(); it != other.end(); ++it) {
+            Node<Key, Value>* found = find_node(it->first, this->root_, this->comp_);
+            if (found) kept.push_back(found->getItem());
+        }
+        this->assign(kept.begin(), kept.end());  // in order, so built without sorting
+        return;
+    }
+
+    AVLNode<Key, Value>* root = static_cast<AVLNode<Key, Value>*>(this->root_);
+    this->root_ = nullptr;
+    std::vector<Node<Key, Value>*> dropped;
+    finish_set_operation(filter_nodes(root, static_cast<const AVLNode<Key, Value>*>(other.root_), true,
+                                      dropped, threads), dropped);
+}
+
+/**
+* Removes every key that is in other. other is only read. Only the up to
+* m removed nodes are freed, but splitting and joining the whole tree
+* costs more than m removes unless other is a good part of its size, so
+* a much smaller other is just removed key by key, O(m log n).
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::subtract(const AVLTree& other, unsigned threads)
+{
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    if (&other == this) {
+        this->clear();
+        return;
+    }
+    if (other.size_ * SMALL_OTHER_RATIO <= this->size_) {
+        for (const_iterator it = other.begin(); it != other.end(); ++it) remove(it->first);
+        return;
+    }
+
+    AVLNode<Key, Value>* root = static_cast<AVLNode<Key, Value>*>(this->root_);
+    this->root_ = nullptr;
+    std::vector<Node<Key, Value>*> dropped;
+    finish_set_operation(filter_nodes(root, static_cast<const AVLNode<Key, Value>*>(other.root_), false,
+                                      dropped, threads), dropped);
+}
+
+// helper to install the result of a set operation and free what it left out,
+// the allocator is not thread safe so that waits until the threads are done
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::finish_set_operation(
+    AVLNode<Key, Value>* root, std::vector<Node<Key, Value>*>& dropped)
+{
+    this->root_ = root;
+    for (std::size_t i = 0; i < dropped.size(); i++) destroyNode(dropped[i]);
+}
+
+// helper for the height of a possibly empty subtree
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+int AVLTree<Key, Value, Compare, Alloc, Ranked>::height_of(const AVLNode<Key, Value>* node)
+{
+    return node ? node->get_height() : 0;
+}
+
+// helper to hang left and right under node and fix node's height, the
+// result is only balanced if left and right differ in height by at most 1
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Ranked>::link_nodes(
+    AVLNode<Key, Value>* left, AVLNode<Key, Value>* node, AVLNode<Key, Value>* right)
+{
+    node->setParent(nullptr);
+    node->setLeft(left);
+    if (left) left->setParent(node);
+    node->setRight(right);
+    if (right) right->setParent(node);
+    update_height(node);
+    return node;
+}
+
+/**
+* Joins two AVL subtrees and a pivot, where every key in left is less than
+* the pivot's and every key in right greater, into one AVL subtree. Costs
+* O(difference in heights): the shorter subtree is hung off the taller
+* one's spine at the first node no more than 1 taller, and the spine is
+* rebalanced on the way back up.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Ranked>::join(
+    AVLNode<Key, Value>* left, AVLNode<Key, Value>* pivot, AVLNode<Key, Value>* right)
+{
+    if (height_of(left) > height_of(right) + 1) return join_right(left, pivot, right);
+    if (height_of(right) > height_of(left) + 1) return join_left(left, pivot, right);
+    return link_nodes(left, pivot, right);
+}
+
+// helper for join when left is the taller one, walks down its right spine
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Ranked>::join_right(
+    AVLNode<Key, Value>* left, AVLNode<Key, Value>* pivot, AVLNode<Key, Value>* right)
+{
+    AVLNode<Key, Value>* inner = left->getRight();
+    AVLNode<Key, Value>* joined;
+    if (height_of(inner) <= height_of(right) + 1) joined = link_nodes(inner, pivot, right);
+    else joined = join_right(inner, pivot, right);
+    return balance_avl(link_nodes(left->getLeft(), left, joined));
+}
+
+// helper for join when right is the taller one, walks down its left spine
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Ranked>::join_left(
+    AVLNode<Key, Value>* left, AVLNode<Key, Value>* pivot, AVLNode<Key, Value>* right)
+{
+    AVLNode<Key, Value>* inner = right->getLeft();
+    AVLNode<Key, Value>* joined;
+    if (height_of(inner) <= height_of(left) + 1) joined = link_nodes(left, pivot, inner);
+    else joined = join_left(left, pivot, inner);
+    return balance_avl(link_nodes(joined, right, right->getRight()));
+}
+
+// helper to join two subtrees without a pivot, the largest node of left becomes it
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Ranked>::join2(
+    AVLNode<Key, Value>* left, AVLNode<Key, Value>* right)
+{
+    if (!left) return right;
+    AVLNode<Key, Value>* last;
+    AVLNode<Key, Value>* rest = split_last(left, last);
+    return join(rest, last, right);
+}
+
+// helper to take the largest node out of a subtree, returns the rest
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Ranked>::split_last(
+    AVLNode<Key, Value>* tree, AVLNode<Key, Value>*& last)
+{
+    AVLNode<Key, Value>* left = tree->getLeft();
+    if (left) left->setParent(nullptr);
+    if (!tree->getRight()) {
+        last = tree;
+        return left;
+    }
+    AVLNode<Key, Value>* rest = split_last(tree->getRight(), last);
+    return join(left, tree, rest);
+}
+
+/**
+* Splits a subtree into the keys less than key and the keys greater, in
+* O(log n): each node on the search path is joined onto the side it
+* belongs to. found is the node with key itself, detached, or null.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+void AVLTree<Key, Value, Compare, Alloc, Ranked>::split(AVLNode<Key, Value>* tree, const Key& key,
+    AVLNode<Key, Value>*& left, AVLNode<Key, Value>*& found, AVLNode<Key, Value>*& right)
+{
+    if (!tree) {
+        left = found = right = nullptr;
+        return;
+    }
+
+    AVLNode<Key, Value>* tree_left = tree->getLeft();
+    AVLNode<Key, Value>* tree_right = tree->getRight();
+    if (tree_left) tree_left->setParent(nullptr);
+    if (tree_right) tree_right->setParent(nullptr);
+
+    if (this->comp_(key, tree->getKey())) {
+        AVLNode<Key, Value>* between;
+        split(tree_left, key, left, found, between);
+        right = join(between, tree, tree_right);
+    } else if (this->comp_(tree->getKey(), key)) {
+        AVLNode<Key, Value>* between;
+        split(tree_right, key, between, found, right);
+        left = join(tree_left, tree, between);
+    } else {
+        left = tree_left;
+        right = tree_right;
+        found = link_nodes(nullptr, tree, nullptr);
+    }
+}
+
+/**
+* The union of two detached subtrees: a is split at b's root key, and the
+* halves are united with b's children, in parallel when b is big enough.
+* For keys in both b's node is kept. This does O(m log(n/m + 1)) work for
+* subtrees of m <= n nodes.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Ranked>::union_nodes(AVLNode<Key, Value>* a,
+    AVLNode<Key, Value>* b, std::vector<Node<Key, Value>*>& dropped, unsigned threads)
+{
+    // below about 2^12 nodes a thread costs more than it saves
+    const int SERIAL_BELOW_HEIGHT = 12;
+    if (!a) return b;
+    if (!b) return a;
+
+    AVLNode<Key, Value>* a_left;
+    AVLNode<Key, Value>* a_found;
+    AVLNode<Key, Value>* a_right;
+    split(a, b->getKey(), a_left, a_found, a_right);
+    if (a_found) dropped.push_back(a_found);
+
+    AVLNode<Key, Value>* b_left = b->getLeft();
+    AVLNode<Key, Value>* b_right = b->getRight();
+    if (b_left) b_left->setParent(nullptr);
+    if (b_right) b_right->setParent(nullptr);
+
+    AVLNode<Key, Value>* left;
+    AVLNode<Key, Value>* right;
+    if (threads > 1 && b->get_height() >= SERIAL_BELOW_HEIGHT) {
+        std::vector<Node<Key, Value>*> left_dropped;
+        run_in_parallel([&]() { left = union_nodes(a_left, b_left, left_dropped, threads / 2); },
+                        [&]() { right = union_nodes(a_right, b_right, dropped, threads - threads / 2); });
+        dropped.insert(dropped.end(), left_dropped.begin(), left_dropped.end());
+    } else {
+        left = union_nodes(a_left, b_left, dropped, 1);
+        right = union_nodes(a_right, b_right, dropped, 1);
+    }
+    return join(left, b, right);
+}
+
+/**
+* The intersection (keep_common) or difference of a detached subtree a
+* with b, which is only read: a is split at b's root key and the halves
+* are filtered by b's children, in parallel when b is big enough. The
+* splits and joins take the same O(m log(n/m + 1)) as union_nodes, plus
+* O(1) per node that ends up in dropped; for an intersection with a
+* small b that is nearly all of a, so O(n) in total.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Ranked>::filter_nodes(AVLNode<Key, Value>* a,
+    const AVLNode<Key, Value>* b, bool keep_common, std::vector<Node<Key, Value>*>& dropped, unsigned threads)
+{
+    const int SERIAL_BELOW_HEIGHT = 12;
+    if (!a) return nullptr;
+    if (!b) {
+        if (!keep_common) return a;
+        // nothing left in b to have in common with
+        clear_nodes(static_cast<Node<Key, Value>*>(a), [&dropped](Node<Key, Value>* n) { dropped.push_back(n); });
+        return nullptr;
+    }
+
+    AVLNode<Key, Value>* a_left;
+    AVLNode<Key, Value>* a_found;
+    AVLNode<Key, Value>* a_right;
+    split(a, b->getKey(), a_left, a_found, a_right);
+
+    AVLNode<Key, Value>* left;
+    AVLNode<Key, Value>* right;
+    if (threads > 1 && b->get_height() >= SERIAL_BELOW_HEIGHT) {
+        std::vector<Node<Key, Value>*> left_dropped;
+        run_in_parallel([&]() { left = filter_nodes(a_left, b->getLeft(), keep_common, left_dropped, threads / 2); },
+                        [&]() { right = filter_nodes(a_right, b->getRight(), keep_common, dropped,
+                                                     threads - threads / 2); });
+        dropped.insert(dropped.end(), left_dropped.begin(), left_dropped.end());
+    } else {
+        left = filter_nodes(a_left, b->getLeft(), keep_common, dropped, 1);
+        right = filter_nodes(a_right, b->getRight(), keep_common, dropped, 1);
+    }
+
+    if (a_found && keep_common) return join(left, a_found, right);
+    if (a_found) dropped.push_back(a_found);
+    return join2(left, right);
+}
+
+// helper to copy a subtree node for node into this tree's allocator,
+// recording each new node in created so a failed copy can be freed
+template<class Key, class Value, class Compare, class Alloc, bool Ranked>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare, Alloc, Ranked>::clone_nodes(
+    const AVLNode<Key, Value>* node, std::vector<Node<Key, Value>*>& created)
+{
+    if (!node) return nullptr;
+    AVLNode<Key, Value>* copy = createNode(node->getKey(), node->getValue(), nullptr);
+    created.push_back(copy);
+    copy->setLeft(clone_nodes(node->getLeft(), created));
+    copy->setRight(clone_nodes(node->getRight(), created));
+    return link_nodes(copy->getLeft(), copy, copy->getRight());
+}
+
+/**
+* An AVL tree that keeps subtree sizes for rank() and select().
+*/
+template <class Key, class Value,
+          class Compare = std::less<Key>,
+          class Alloc = NodePool<std::pair<const Key, Value> > >
+using RankedAVLTree = AVLTree<Key, Value, Compare, Alloc, true>;
+
 
 #endif
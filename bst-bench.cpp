@@ -0,0 +1,942 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <map>
+#include <functional>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "bst.h"
+#include "avlbst.h"
+#include "btree.h"
+#include "persistent_avlbst.h"
+#include "concurrent_avlbst.h"
+#include "sharded_avlbst.h"
+#include "durable_bst.h"
+
+using namespace std;
+
+// average nanoseconds per call of op(i) for i in [0, n)
+template<typename Op>
+static double time_ns(int n, Op op)
+{
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) op(i);
+    auto end = chrono::steady_clock::now();
+    return chrono::duration<double, nano>(end - start).count() / n;
+}
+
+static void report(const string& name, double ns)
+{
+    cout << name << ": " << ns << " ns/op" << endl;
+}
+
+// keeps the compiler from dropping results it thinks are unused
+static volatile size_t sink;
+
+static vector<string> shuffled_string_keys(int n)
+{
+    vector<string> keys(n);
+    for (int i = 0; i < n; i++) keys[i] = "key number " + to_string(i);
+    mt19937 rng(9);
+    shuffle(keys.begin(), keys.end(), rng);
+    return keys;
+}
+
+// a large value type, costly to copy around
+struct Big
+{
+    char bytes[256];
+    Big() { memset(bytes, 0, sizeof(bytes)); }
+    explicit Big(int i) { memset(bytes, i & 0xff, sizeof(bytes)); }
+};
+ostream& operator<<(ostream& out, const Big& b) { return out << int(b.bytes[0]); }
+
+// string keys with 256 byte values, copying insert vs moving insert vs
+// try_emplace, each inserting fresh keys and then hitting existing ones
+template<typename Tree>
+static void bench_insert_big(const string& tree_name, int n)
+{
+    const vector<string> keys = shuffled_string_keys(n);
+    vector<string> moved;
+
+    {
+        Tree tree;
+        report(tree_name + " insert(const&) new", time_ns(n, [&](int i) {
+            const pair<const string, Big> item(keys[i], Big(i));
+            tree.insert(item);
+        }));
+        report(tree_name + " insert(const&) existing", time_ns(n, [&](int i) {
+            const pair<const string, Big> item(keys[i], Big(i + 1));
+            tree.insert(item);
+        }));
+        sink = tree.size();
+    }
+    {
+        Tree tree;
+        moved = keys;
+        report(tree_name + " insert(&&) new", time_ns(n, [&](int i) {
+            tree.insert(pair<const string, Big>(std::move(moved[i]), Big(i)));
+        }));
+        report(tree_name + " insert(&&) existing", time_ns(n, [&](int i) {
+            tree.insert(pair<const string, Big>(keys[i], Big(i + 1)));
+        }));
+        sink = tree.size();
+    }
+    {
+        Tree tree;
+        moved = keys;
+        report(tree_name + " try_emplace new", time_ns(n, [&](int i) {
+            tree.try_emplace(std::move(moved[i]), i);
+        }));
+        report(tree_name + " try_emplace existing", time_ns(n, [&](int i) {
+            tree.try_emplace(keys[i], i + 1);
+        }));
+        report(tree_name + " emplace new", time_ns(n, [&](int i) {
+            tree.emplace(keys[i] + "!", Big(i));
+        }));
+        sink = tree.size();
+    }
+}
+
+// upserts where 80% of the keys are already in a tree of n: the single
+// descent insert against the old path, a find, a node built up front,
+// a second descent and the node thrown away when the key was there
+static void bench_upsert(int n)
+{
+    vector<int> keys(n);
+    for (int i = 0; i < n; i++) keys[i] = 2 * i;
+    mt19937 rng(2);
+    shuffle(keys.begin(), keys.end(), rng);
+    vector<int> upserts(n);
+    for (int i = 0; i < n; i++) upserts[i] = rng() % 5 == 0 ? 2 * (rng() % n) + 1 : keys[rng() % n];
+
+    AVLTree<int, int> tree;
+    for (int i = 0; i < n; i++) tree.insert(make_pair(keys[i], i));
+    report("AVL upsert, single descent", time_ns(n, [&](int i) {
+        tree.insert(make_pair(upserts[i], i));
+    }));
+    sink = tree.size();
+
+    AVLTree<int, int> old_tree;
+    for (int i = 0; i < n; i++) old_tree.insert(make_pair(keys[i], i));
+    report("AVL upsert, find + throwaway node + insert", time_ns(n, [&](int i) {
+        // a new key's node is the one insert allocates, so only an
+        // existing key pays for the extra new and delete
+        if (old_tree.find(upserts[i]) != old_tree.end()) {
+            AVLNode<int, int>* node = new AVLNode<int, int>(upserts[i], i, nullptr);
+            sink = reinterpret_cast<size_t>(node);
+            delete node;
+        }
+        old_tree.insert(make_pair(upserts[i], i));
+    }));
+    sink = old_tree.size();
+}
+
+// time window queries over n timestamps: for_each_in_range against
+// scanning from begin() up to the window, which is all there was before
+static void bench_range(int n)
+{
+    vector<pair<long long, int> > items(n);
+    for (int i = 0; i < n; i++) items[i] = make_pair(10LL * i, i);
+    AVLTree<long long, int> tree(items.begin(), items.end());
+    items.clear();
+    items.shrink_to_fit();
+
+    mt19937 rng(5);
+    const long long width = 1000;  // 100 keys per window
+    vector<long long> starts(100000);
+    for (size_t i = 0; i < starts.size(); i++) starts[i] = (long long)(rng() % n) * 10;
+
+    report("AVL for_each_in_range, 100 keys", time_ns(starts.size(), [&](int i) {
+        long long sum = 0;
+        tree.for_each_in_range(starts[i], starts[i] + width,
+                               [&sum](const pair<const long long, int>& item) { sum += item.second; });
+        sink = sum;
+    }));
+    report("AVL lower_bound", time_ns(starts.size(), [&](int i) {
+        sink = tree.lower_bound(starts[i] - 5)->second;
+    }));
+
+    // the linear scan is too slow to run as often
+    report("AVL scan from begin(), 100 keys", time_ns(20, [&](int i) {
+        long long sum = 0;
+        AVLTree<long long, int>::iterator it = tree.begin();
+        while (it != tree.end() && it->first < starts[i]) ++it;
+        for (; it != tree.end() && it->first < starts[i] + width; ++it) sum += it->second;
+        sink = sum;
+    }));
+}
+
+// point lookups on a tree bigger than the last level cache, a loop of
+// find against find_batch in request sized batches
+static void bench_find_batch(int n)
+{
+    // inserting in random order scatters neighbouring keys across memory
+    vector<long long> keys(n);
+    for (int i = 0; i < n; i++) keys[i] = 2LL * i;
+    mt19937 rng(14);
+    shuffle(keys.begin(), keys.end(), rng);
+    AVLTree<long long, int> tree;
+    for (int i = 0; i < n; i++) tree.insert(make_pair(keys[i], i));
+
+    const int batch = 128;
+    const int batches = 4000;
+    vector<long long> queries(batch * batches);
+    for (size_t i = 0; i < queries.size(); i++) queries[i] = 2LL * (rng() % n) + (rng() % 8 == 0);
+
+    vector<AVLTree<long long, int>::iterator> found(batch);
+    report("AVL find x128", time_ns(batches, [&](int b) {
+        for (int i = 0; i < batch; i++) found[i] = tree.find(queries[b * batch + i]);
+        sink = found[batch - 1] == tree.end();
+    }) / batch);
+
+    vector<long long> request(batch);
+    report("AVL find_batch of 128", time_ns(batches, [&](int b) {
+        copy(queries.begin() + b * batch, queries.begin() + (b + 1) * batch, request.begin());
+        tree.find_batch(request, found.begin());
+        sink = found[batch - 1] == tree.end();
+    }) / batch);
+}
+
+// point lookups in the tree against the same lookups in its frozen snapshot
+static void bench_freeze(int n)
+{
+    vector<int> keys(n);
+    for (int i = 0; i < n; i++) keys[i] = 2 * i;
+    mt19937 rng(15);
+    shuffle(keys.begin(), keys.end(), rng);
+    AVLTree<int, int> tree;
+    for (int i = 0; i < n; i++) tree.insert(make_pair(keys[i], i));
+    FrozenTree<int, int> frozen = tree.freeze();
+
+    const int lookups = 1000000;
+    vector<int> queries(lookups);
+    for (int i = 0; i < lookups; i++) queries[i] = 2 * (rng() % n) + (rng() % 8 == 0);
+
+    report("AVL find @" + to_string(n), time_ns(lookups, [&](int i) {
+        sink = tree.find(queries[i]) == tree.end();
+    }));
+    report("frozen find @" + to_string(n), time_ns(lookups, [&](int i) {
+        sink = frozen.find(queries[i]) == frozen.end();
+    }));
+}
+
+// the node layout from before the CRTP node base: virtual getters that
+// AVLNode overrode only to cast, so a vtable pointer in every node and
+// an indirect call per step down the tree
+struct VirtualNode
+{
+    VirtualNode(int key, int value) : item(key, value), parent(nullptr), left(nullptr), right(nullptr), height(1) { }
+    virtual ~VirtualNode() { }
+    virtual VirtualNode* getParent() const { return parent; }
+    virtual VirtualNode* getLeft() const { return left; }
+    virtual VirtualNode* getRight() const { return right; }
+
+    pair<const int, int> item;
+    VirtualNode* parent;
+    VirtualNode* left;
+    VirtualNode* right;
+    int height;
+};
+
+struct VirtualAVLNode : public VirtualNode
+{
+    VirtualAVLNode(int key, int value) : VirtualNode(key, value), balance(0) { }
+    VirtualAVLNode* getParent() const override { return static_cast<VirtualAVLNode*>(parent); }
+    VirtualAVLNode* getLeft() const override { return static_cast<VirtualAVLNode*>(left); }
+    VirtualAVLNode* getRight() const override { return static_cast<VirtualAVLNode*>(right); }
+
+    int8_t balance;
+};
+
+// a perfectly balanced tree of VirtualAVLNodes over items[lo, hi),
+// allocated in key order like the bulk load does
+static VirtualNode* build_virtual(const vector<pair<int, int> >& items, int lo, int hi)
+{
+    if (lo >= hi) return nullptr;
+    int mid = lo + (hi - lo) / 2;
+    VirtualNode* left = build_virtual(items, lo, mid);
+    VirtualNode* node = new VirtualAVLNode(items[mid].first, items[mid].second);
+    node->left = left;
+    node->right = build_virtual(items, mid + 1, hi);
+    if (node->left) node->left->parent = node;
+    if (node->right) node->right->parent = node;
+    return node;
+}
+
+static void delete_virtual(VirtualNode* node)
+{
+    if (!node) return;
+    delete_virtual(node->getLeft());
+    delete_virtual(node->getRight());
+    delete node;
+}
+
+// lookups in the same balanced tree of n int keys,
+// built with the same new and delete, with the node getters inlined
+// against called through the vtable; both descents compare once per level
+static void bench_devirtualized(int n)
+{
+    vector<pair<int, int> > items(n);
+    for (int i = 0; i < n; i++) items[i] = make_pair(2 * i, i);
+    AVLTree<int, int, less<int>, allocator<pair<const int, int> > > tree(items.begin(), items.end());
+    VirtualNode* root = build_virtual(items, 0, n);
+
+    mt19937 rng(5);
+    const int lookups = 1000000;
+    vector<int> queries(lookups);
+    for (int i = 0; i < lookups; i++) queries[i] = 2 * (rng() % n) + (rng() % 8 == 0);
+
+    report("AVL find @" + to_string(n), time_ns(lookups, [&](int i) {
+        sink = tree.find(queries[i]) == tree.end();
+    }));
+    report("virtual getters find @" + to_string(n), time_ns(lookups, [&](int i) {
+        VirtualNode* candidate = nullptr;
+        for (VirtualNode* node = root; node;) {
+            if (node->item.first < queries[i]) {
+                node = node->getRight();
+            } else {
+                candidate = node;
+                node = node->getLeft();
+            }
+        }
+        sink = candidate == nullptr || queries[i] < candidate->item.first;
+    }));
+    delete_virtual(root);
+}
+
+// the same inserts, lookups and removes on each backend
+template<typename Tree>
+static void bench_backend(const string& tree_name, int n)
+{
+    vector<int> keys(n);
+    for (int i = 0; i < n; i++) keys[i] = 2 * i;
+    mt19937 rng(16);
+    shuffle(keys.begin(), keys.end(), rng);
+    vector<int> queries(n);
+    for (int i = 0; i < n; i++) queries[i] = 2 * (rng() % n) + (rng() % 8 == 0);
+
+    Tree tree;
+    report(tree_name + " insert", time_ns(n, [&](int i) {
+        tree.insert(make_pair(keys[i], i));
+    }));
+    report(tree_name + " find", time_ns(n, [&](int i) {
+        sink = tree.find(queries[i]) == tree.end();
+    }));
+    report(tree_name + " remove", time_ns(n / 2, [&](int i) {
+        tree.remove(keys[i]);
+    }));
+    sink = tree.size();
+}
+
+// the default NodePool against std::allocator, i.e. global new and delete
+// for every node: filling a tree, churning it with removes each followed
+// by an insert of a new key, and tearing it down
+template<typename Alloc>
+static void bench_allocator(const string& alloc_name, int n)
+{
+    vector<int> keys(n);
+    for (int i = 0; i < n; i++) keys[i] = i;
+    mt19937 rng(4);
+    shuffle(keys.begin(), keys.end(), rng);
+
+    AVLTree<int, int, less<int>, Alloc> tree;
+    report(alloc_name + " insert", time_ns(n, [&](int i) {
+        tree.insert(make_pair(keys[i], i));
+    }));
+    report(alloc_name + " churn", time_ns(n, [&](int i) {
+        tree.remove(keys[i]);
+        tree.insert(make_pair(keys[i] + n, i));
+    }));
+    auto start = chrono::steady_clock::now();
+    tree.clear();
+    cout << alloc_name << " teardown: " << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()
+         << " ms" << endl;
+}
+
+// what path copying costs the writer, and what a snapshot costs
+static void bench_persistent(int n)
+{
+    vector<int> keys(n);
+    for (int i = 0; i < n; i++) keys[i] = 2 * i;
+    mt19937 rng(17);
+    shuffle(keys.begin(), keys.end(), rng);
+
+    AVLTree<int, int> tree;
+    report("AVL insert", time_ns(n, [&](int i) {
+        tree.insert(make_pair(keys[i], i));
+    }));
+    PersistentAVLTree<int, int> persistent;
+    report("persistent insert", time_ns(n, [&](int i) {
+        persistent.insert(make_pair(keys[i], i));
+    }));
+    report("persistent snapshot", time_ns(n, [&](int) {
+        sink = persistent.snapshot().size();
+    }));
+    PersistentAVLTree<int, int>::Snapshot snap = persistent.snapshot();
+    report("persistent find", time_ns(n, [&](int i) {
+        sink = snap.find(keys[i]) == snap.end();
+    }));
+    report("persistent lookup", time_ns(n, [&](int i) {
+        sink = snap.lookup(keys[i]) != nullptr;
+    }));
+    report("persistent remove", time_ns(n / 2, [&](int i) {
+        persistent.remove(keys[i]);
+    }));
+}
+
+// an AVLTree behind one mutex, what ConcurrentAVLTree replaces
+struct LockedAVL
+{
+    AVLTree<int, int> tree;
+    mutex lock;
+
+    void insert(const pair<const int, int>& item) { lock_guard<mutex> guard(lock); tree.insert(item); }
+    void remove(int key) { lock_guard<mutex> guard(lock); tree.remove(key); }
+    bool find(int key, int& value)
+    {
+        lock_guard<mutex> guard(lock);
+        AVLTree<int, int>::iterator it = tree.find(key);
+        if (it == tree.end()) return false;
+        value = it->second;
+        return true;
+    }
+};
+
+// total throughput of threads doing finds and, write_percent of the
+// time, an insert or a remove, on a map half full of [0, 2n)
+template<typename Map>
+static void bench_threads(const string& map_name, int n, int write_percent, int max_threads)
+{
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        Map map;
+        for (int i = 0; i < n; i += 2) map.insert(make_pair(i, i));
+
+        const int ops = 1000000 / threads;
+        vector<thread> workers;
+        auto start = chrono::steady_clock::now();
+        for (int t = 0; t < threads; t++) {
+            workers.push_back(thread([&map, t, ops, n, write_percent]() {
+                mt19937 rng(t);
+                int value;
+                size_t found = 0;
+                for (int i = 0; i < ops; i++) {
+                    int key = rng() % n;
+                    int dice = rng() % 100;
+                    if (dice >= write_percent) found += map.find(key, value);
+                    else if (dice % 2 == 0) map.insert(make_pair(key, i));
+                    else map.remove(key);
+                }
+                sink = found;
+            }));
+        }
+        for (int t = 0; t < threads; t++) workers[t].join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << map_name << " " << (100 - write_percent) << "/" << write_percent << " read/write, "
+             << threads << " threads: " << ops * threads / seconds / 1e6 << " Mops/s" << endl;
+    }
+}
+
+// insert throughput of threads each putting n / threads keys into an
+// empty map; with ascending keys every thread writes into the top of the
+// key space, so the sharded tree has to keep moving its boundaries there
+template<typename MakeMap>
+static void bench_insert_threads(const string& map_name, int n, bool ascending, int max_threads, MakeMap make_map)
+{
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        auto map = make_map();
+        const int per_thread = n / threads;
+        vector<thread> workers;
+        auto start = chrono::steady_clock::now();
+        for (int t = 0; t < threads; t++) {
+            workers.push_back(thread([&map, t, threads, per_thread, n, ascending]() {
+                mt19937 rng(t);
+                for (int i = 0; i < per_thread; i++) {
+                    int key = ascending ? i * threads + t : (int)(rng() % n);
+                    map->insert(make_pair(key, i));
+                }
+            }));
+        }
+        for (int t = 0; t < threads; t++) workers[t].join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << map_name << (ascending ? " ascending" : " random") << " inserts, " << threads
+             << " threads: " << per_thread * threads / seconds / 1e6 << " Mops/s" << endl;
+    }
+}
+
+// wall clock for merging batch_n random pairs into an AVL tree of n,
+// one insert at a time and with bulk_insert on 1 to 16 threads
+static void bench_bulk_insert(int n, int batch_n)
+{
+    mt19937 rng(20);
+    vector<pair<int, int> > initial, batch;
+    for (int i = 0; i < n; i++) initial.push_back(make_pair((int)rng(), i));
+    for (int i = 0; i < batch_n; i++) batch.push_back(make_pair((int)rng(), i));
+
+    {
+        AVLTree<int, int> tree(initial.begin(), initial.end());
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < batch_n; i++) tree.insert(batch[i]);
+        cout << "insert loop: " << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()
+             << " ms" << endl;
+    }
+    for (unsigned threads = 1; threads <= 16; threads *= 2) {
+        AVLTree<int, int> tree(initial.begin(), initial.end());
+        auto start = chrono::steady_clock::now();
+        tree.bulk_insert(batch, threads);
+        cout << "bulk_insert, " << threads << " threads: "
+             << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+    }
+}
+
+// cold start of an index of n int keys read back in sorted order: an
+// insert per key against the bulk load, and the bulk load of the same
+// keys shuffled, which has to sort them first
+static void bench_cold_start(int n)
+{
+    vector<pair<int, int> > sorted(n);
+    for (int i = 0; i < n; i++) sorted[i] = make_pair(i, i);
+    vector<pair<int, int> > shuffled = sorted;
+    mt19937 rng(7);
+    shuffle(shuffled.begin(), shuffled.end(), rng);
+
+    {
+        auto start = chrono::steady_clock::now();
+        AVLTree<int, int> tree;
+        for (int i = 0; i < n; i++) tree.insert(sorted[i]);
+        cout << "insert loop, sorted: " << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()
+             << " ms" << endl;
+        sink = tree.size();
+    }
+    {
+        auto start = chrono::steady_clock::now();
+        AVLTree<int, int> tree(sorted.begin(), sorted.end());
+        cout << "bulk load, sorted: " << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()
+             << " ms" << endl;
+        sink = tree.size();
+    }
+    {
+        auto start = chrono::steady_clock::now();
+        AVLTree<int, int> tree(shuffled.begin(), shuffled.end());
+        cout << "bulk load, shuffled: " << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()
+             << " ms" << endl;
+        sink = tree.size();
+    }
+}
+
+// milliseconds for op(tree) on a fresh copy of the pairs in items
+template<typename Op>
+static double time_on_copy_ms(const vector<pair<int, int> >& items, Op op)
+{
+    AVLTree<int, int> tree(items.begin(), items.end());
+    auto start = chrono::steady_clock::now();
+    op(tree);
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// the join-based set operations against looping over the smaller tree,
+// for a tree of n and one of n / ratio random keys
+static void bench_set_operations(int n, int ratio)
+{
+    mt19937 rng(21);
+    vector<pair<int, int> > a_items, b_items;
+    for (int i = 0; i < n; i++) a_items.push_back(make_pair((int)(rng() % (2u * n)), i));
+    for (int i = 0; i < n / ratio; i++) b_items.push_back(make_pair((int)(rng() % (2u * n)), i));
+    AVLTree<int, int> b(b_items.begin(), b_items.end());
+
+    cout << n << " and " << n / ratio << " keys, join-based vs loop, ms:" << endl;
+    cout << "  union " << time_on_copy_ms(a_items, [&](AVLTree<int, int>& a) { a.unite(b); }) << " vs "
+         << time_on_copy_ms(a_items, [&](AVLTree<int, int>& a) {
+                for (AVLTree<int, int>::iterator it = b.begin(); it != b.end(); ++it) a.insert(*it);
+            }) << endl;
+    cout << "  intersection " << time_on_copy_ms(a_items, [&](AVLTree<int, int>& a) { a.intersect(b); }) << " vs "
+         << time_on_copy_ms(a_items, [&](AVLTree<int, int>& a) {
+                AVLTree<int, int> common;
+                for (AVLTree<int, int>::iterator it = b.begin(); it != b.end(); ++it) {
+                    AVLTree<int, int>::iterator found = a.find(it->first);
+                    if (found != a.end()) common.insert(*found);
+                }
+                sink = common.size();
+            }) << endl;
+    cout << "  difference " << time_on_copy_ms(a_items, [&](AVLTree<int, int>& a) { a.subtract(b); }) << " vs "
+         << time_on_copy_ms(a_items, [&](AVLTree<int, int>& a) {
+                for (AVLTree<int, int>::iterator it = b.begin(); it != b.end(); ++it) a.remove(it->first);
+            }) << endl;
+}
+
+// asks the kernel to drop path's cached pages, so the next read goes to disk
+static void evict_from_cache(const string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// milliseconds from nothing in memory to the answer of one find, for the
+// ways of getting a saved tree of n entries back
+static void bench_snapshot(int n)
+{
+    typedef long long Key;
+    const string path = "bst-bench.snapshot";
+    {
+        vector<pair<Key, Key> > items;
+        for (int i = 0; i < n; i++) items.push_back(make_pair(2 * (Key)i, (Key)i));
+        AVLTree<Key, Key> tree(items.begin(), items.end());
+        auto start = chrono::steady_clock::now();
+        tree.save(path);
+        cout << "save: " << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms, "
+             << n * 2 * sizeof(Key) / 1000000 << " MB" << endl;
+    }
+
+    const Key probe = 2 * (Key)(n / 3);
+    auto first_query_ms = [&](const string& how, function<bool()> load_and_find) {
+        evict_from_cache(path);
+        auto start = chrono::steady_clock::now();
+        bool found = load_and_find();
+        cout << how << ": " << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()
+             << " ms" << (found ? "" : " (lost the key)") << endl;
+    };
+    first_query_ms("insert key by key", [&]() {
+        FrozenTree<Key, Key> file = FrozenTree<Key, Key>::open(path, false);
+        AVLTree<Key, Key> tree;
+        for (FrozenTree<Key, Key>::const_iterator it = file.begin(); it != file.end(); ++it) {
+            tree.insert(make_pair(it.key(), it.value()));
+        }
+        return tree.find(probe) != tree.end();
+    });
+    first_query_ms("AVLTree::load", [&]() {
+        AVLTree<Key, Key> tree;
+        tree.load(path);
+        return tree.find(probe) != tree.end();
+    });
+    first_query_ms("mapped view, checksum", [&]() {
+        return FrozenTree<Key, Key>::open(path).find(probe).value() == probe / 2;
+    });
+    first_query_ms("mapped view", [&]() {
+        return FrozenTree<Key, Key>::open(path, false).find(probe).value() == probe / 2;
+    });
+    remove(path.c_str());
+}
+
+// durable inserts per second from 1 to max_threads writers, syncing the
+// log once per batch of waiting writers or once per insert
+static void bench_durable(int ops, bool group_commit, int max_threads)
+{
+    const string log_path = "bst-bench.wal";
+    const string snapshot_path = "bst-bench.wal.snapshot";
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        remove(log_path.c_str());
+        DurableTree<int, int> tree(log_path, snapshot_path, group_commit);
+        vector<thread> writers;
+        auto start = chrono::steady_clock::now();
+        for (int t = 0; t < threads; t++) {
+            writers.push_back(thread([&tree, t, threads, ops]() {
+                mt19937 rng(t);
+                for (int i = 0; i < ops / threads; i++) tree.insert(make_pair((int)rng(), i));
+            }));
+        }
+        for (int t = 0; t < threads; t++) writers[t].join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << (group_commit ? "group commit, " : "fsync per insert, ") << threads << " threads: "
+             << ops / threads * threads / seconds << " inserts/s" << endl;
+    }
+    remove(log_path.c_str());
+}
+
+/*
+  The workload suite behind "make bench": every tree against every
+  workload, one line of CSV or one JSON object per pair, for tracking
+  regressions between releases. Columns:
+
+    tree, workload, keys, ops, ops_per_sec, p50_ns, p99_ns, peak_rss_kb
+
+  A workload preloads keys keys (except the load ones, which time the
+  inserts themselves), then times ops operations one by one. Key shapes
+  are sequential (0, 1, 2, ... so the plain BST degenerates into a list),
+  uniformly random, or Zipf (s = 0.99) over the keys, with the popular
+  keys scattered over the key space. Each pair runs in its own child
+  process. peak_rss_kb is how far that process's peak resident size rose
+  above where it stood once the operations and latency buffer were made,
+  so it counts the tree and not the harness. A run stops early once it
+  has taken SUITE_SECONDS, ops says how many were done.
+*/
+
+enum SuiteOp { SUITE_FIND, SUITE_INSERT, SUITE_REMOVE, SUITE_SCAN };
+
+struct SuiteWorkload
+{
+    string name;
+    char shape;         // 's'equential, 'r'andom or 'z'ipf
+    int read_percent;   // the rest are writes, half inserts and half removes
+    bool scan;          // reads are 100 item range scans instead of finds
+    bool load;          // time inserting the keys into an empty tree
+};
+
+static const double SUITE_SECONDS = 2.0;
+static const int SUITE_SCAN_LENGTH = 100;
+
+// the same few operations on the trees and std::map
+template<typename Tree>
+static void suite_put(Tree& tree, int key, int value) { tree.insert(make_pair(key, value)); }
+static void suite_put(map<int, int>& tree, int key, int value) { tree[key] = value; }
+template<typename Tree>
+static void suite_erase(Tree& tree, int key) { tree.remove(key); }
+static void suite_erase(map<int, int>& tree, int key) { tree.erase(key); }
+
+// draws keys in [0, n) with probability falling off as 1 / rank^0.99,
+// rank r is key r * a large odd number mod n so hot keys are spread out
+class ZipfKeys
+{
+public:
+    ZipfKeys(int n) : n_(n), cdf_(n)
+    {
+        double total = 0;
+        for (int r = 0; r < n; r++) cdf_[r] = total += 1.0 / pow(r + 1.0, 0.99);
+        for (int r = 0; r < n; r++) cdf_[r] /= total;
+    }
+
+    int operator()(mt19937& rng)
+    {
+        double u = uniform_real_distribution<double>(0, 1)(rng);
+        long long rank = lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+        if (rank >= n_) rank = n_ - 1;
+        return (int)(rank * 2654435761ll % n_);
+    }
+
+private:
+    int n_;
+    vector<double> cdf_;
+};
+
+// runs one workload on a fresh Tree and prints its line
+template<typename Tree>
+static void suite_run(const string& tree_name, const SuiteWorkload& w, int keys, int ops, bool json, bool first)
+{
+    // the operations are made up front so only the tree is timed
+    mt19937 rng(24);
+    ZipfKeys zipf(w.shape == 'z' ? keys : 1);
+    vector<pair<SuiteOp, int> > plan;
+    int count = w.load ? keys : ops;
+    for (int i = 0; i < count; i++) {
+        int key = w.shape == 's' ? i % keys : w.shape == 'z' ? zipf(rng) : (int)(rng() % keys);
+        SuiteOp op = SUITE_INSERT;
+        if (!w.load) {
+            int dice = rng() % 100;
+            if (dice < w.read_percent) op = w.scan ? SUITE_SCAN : SUITE_FIND;
+            else op = dice % 2 == 0 ? SUITE_INSERT : SUITE_REMOVE;
+        }
+        plan.push_back(make_pair(op, key));
+    }
+
+    // written through now so the measured peak is only the tree
+    vector<double> latency(plan.size(), 0.0);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long baseline_kb = usage.ru_maxrss;  // kilobytes on Linux
+
+    Tree tree;
+    if (!w.load) {
+        // sequential workloads load in order, the others in random order
+        vector<int> order(keys);
+        for (int i = 0; i < keys; i++) order[i] = i;
+        if (w.shape != 's') shuffle(order.begin(), order.end(), rng);
+        for (int i = 0; i < keys; i++) suite_put(tree, order[i], i);
+    }
+
+    size_t done = 0;
+    size_t found = 0;
+    auto start = chrono::steady_clock::now();
+    auto before = start;
+    for (size_t i = 0; i < plan.size(); i++) {
+        int key = plan[i].second;
+        switch (plan[i].first) {
+        case SUITE_FIND:
+            found += tree.find(key) != tree.end();
+            break;
+        case SUITE_INSERT:
+            suite_put(tree, key, (int)i);
+            break;
+        case SUITE_REMOVE:
+            suite_erase(tree, key);
+            break;
+        case SUITE_SCAN: {
+            auto it = tree.lower_bound(key);
+            for (int j = 0; j < SUITE_SCAN_LENGTH && it != tree.end(); j++, ++it) found += it->second;
+            break;
+        }
+        }
+        auto after = chrono::steady_clock::now();
+        latency[done++] = chrono::duration<double, nano>(after - before).count();
+        before = after;
+        if (chrono::duration<double>(after - start).count() > SUITE_SECONDS) break;
+    }
+    double seconds = chrono::duration<double>(before - start).count();
+    sink = found;
+
+    // main rejects an empty plan, so at least one op was timed
+    latency.resize(done);
+    nth_element(latency.begin(), latency.begin() + done / 2, latency.end());
+    double p50 = latency[done / 2];
+    nth_element(latency.begin(), latency.begin() + done * 99 / 100, latency.end());
+    double p99 = latency[done * 99 / 100];
+    getrusage(RUSAGE_SELF, &usage);
+    long peak_kb = usage.ru_maxrss - baseline_kb;
+
+    if (json) {
+        cout << (first ? "  " : ", ") << "{\"tree\": \"" << tree_name << "\", \"workload\": \"" << w.name
+             << "\", \"keys\": " << keys << ", \"ops\": " << done << ", \"ops_per_sec\": " << done / seconds
+             << ", \"p50_ns\": " << p50 << ", \"p99_ns\": " << p99 << ", \"peak_rss_kb\": " << peak_kb << "}" << endl;
+    } else {
+        cout << tree_name << "," << w.name << "," << keys << "," << done << "," << done / seconds << ","
+             << p50 << "," << p99 << "," << peak_kb << endl;
+    }
+}
+
+// every tree on every workload, each in a child process of its own
+static int run_suite(bool json, int keys, int ops)
+{
+    vector<SuiteWorkload> workloads = {
+        { "load-sequential", 's', 0, false, true },
+        { "load-random", 'r', 0, false, true },
+        { "read95-sequential", 's', 95, false, false },
+        { "read95-random", 'r', 95, false, false },
+        { "read95-zipf", 'z', 95, false, false },
+        { "read50-sequential", 's', 50, false, false },
+        { "read50-random", 'r', 50, false, false },
+        { "read50-zipf", 'z', 50, false, false },
+        { "scan95-random", 'r', 95, true, false },
+        { "scan95-zipf", 'z', 95, true, false },
+    };
+    vector<pair<string, function<void(const SuiteWorkload&, bool)> > > trees = {
+        { "BST", [=](const SuiteWorkload& w, bool first) {
+            suite_run<BinarySearchTree<int, int> >("BST", w, keys, ops, json, first); } },
+        { "AVL", [=](const SuiteWorkload& w, bool first) {
+            suite_run<AVLTree<int, int> >("AVL", w, keys, ops, json, first); } },
+        { "std::map", [=](const SuiteWorkload& w, bool first) {
+            suite_run<map<int, int> >("std::map", w, keys, ops, json, first); } },
+    };
+
+    cout << (json ? "[" : "tree,workload,keys,ops,ops_per_sec,p50_ns,p99_ns,peak_rss_kb") << endl;
+    bool first = true;
+    for (size_t w = 0; w < workloads.size(); w++) {
+        for (size_t t = 0; t < trees.size(); t++) {
+            cout.flush();
+            pid_t child = fork();
+            if (child == 0) {
+                trees[t].second(workloads[w], first);
+                cout.flush();
+                _exit(0);
+            }
+            int status = 0;
+            if (child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                cerr << trees[t].first << " on " << workloads[w].name << " failed" << endl;
+                return 1;
+            }
+            first = false;
+        }
+    }
+    if (json) cout << "]" << endl;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    // bst-bench --suite csv|json [keys [ops]], see run_suite
+    if (argc > 1 && string(argv[1]) == "--suite") {
+        bool json = argc > 2 && string(argv[2]) == "json";
+        int keys = argc > 3 ? atoi(argv[3]) : 50000;
+        int ops = argc > 4 ? atoi(argv[4]) : 200000;
+        if (keys <= 0 || ops <= 0) {
+            cerr << "bst-bench --suite: keys and ops must be positive" << endl;
+            return 1;
+        }
+        return run_suite(json, keys, ops);
+    }
+
+    const int n = 200000;
+    cout << "string keys, 256 byte values, " << n << " keys" << endl;
+    bench_insert_big<BinarySearchTree<string, Big> >("BST", n);
+    bench_insert_big<AVLTree<string, Big> >("AVL", n);
+
+    const int upsert_n = 1000000;
+    cout << "upserts, 80% existing keys, " << upsert_n << " int keys" << endl;
+    bench_upsert(upsert_n);
+
+    const int range_n = 10000000;
+    cout << "range queries, " << range_n << " keys" << endl;
+    bench_range(range_n);
+
+    cout << "batched lookups, " << range_n << " keys, per key" << endl;
+    bench_find_batch(range_n);
+
+    const int backend_n = 1000000;
+    cout << "backends, " << backend_n << " int keys" << endl;
+    bench_backend<AVLTree<int, int> >("AVL", backend_n);
+    bench_backend<BTreeMap<int, int> >("B-tree", backend_n);
+
+    cout << "node layout, AVL" << endl;
+    cout << "bytes/node: AVLNode<int, int> " << sizeof(AVLNode<int, int>)
+         << ", with virtual getters " << sizeof(VirtualAVLNode) << endl;
+    for (int layout_n = 100000; layout_n <= backend_n; layout_n *= 10) bench_devirtualized(layout_n);
+
+    cout << "node allocators, AVL, " << backend_n << " int keys" << endl;
+    bench_allocator<NodePool<pair<const int, int> > >("pool", backend_n);
+    bench_allocator<allocator<pair<const int, int> > >("new/delete", backend_n);
+
+    cout << "persistent tree, " << backend_n << " int keys" << endl;
+    bench_persistent(backend_n);
+
+    // at least up to 4 threads, so the locking shows even on small machines
+    const int max_threads = max(4, (int)thread::hardware_concurrency());
+    cout << "thread scaling, " << backend_n << " int keys, " << thread::hardware_concurrency() << " cores" << endl;
+    for (int write_percent = 10; write_percent <= 50; write_percent += 40) {
+        bench_threads<LockedAVL>("mutex AVL", backend_n, write_percent, max_threads);
+        bench_threads<ConcurrentAVLTree<int, int> >("concurrent AVL", backend_n, write_percent, max_threads);
+    }
+
+    const int shards = 16;
+    cout << "sharded inserts, " << backend_n << " int keys, " << shards << " shards" << endl;
+    for (int ascending = 0; ascending <= 1; ascending++) {
+        bench_insert_threads("mutex AVL", backend_n, ascending, max_threads, []() {
+            return unique_ptr<LockedAVL>(new LockedAVL);
+        });
+        bench_insert_threads("sharded AVL", backend_n, ascending, max_threads, [backend_n, shards]() {
+            vector<int> boundaries;
+            for (int i = 1; i < shards; i++) boundaries.push_back(i * (backend_n / shards));
+            return unique_ptr<ShardedAVLTree<int, int> >(new ShardedAVLTree<int, int>(boundaries));
+        });
+    }
+
+    cout << "cold start, AVL, " << range_n << " int keys" << endl;
+    bench_cold_start(range_n);
+
+    cout << "bulk insert, " << 4 * backend_n << " random keys into " << backend_n << endl;
+    bench_bulk_insert(backend_n, 4 * backend_n);
+
+    cout << "set operations" << endl;
+    for (int ratio = 1; ratio <= 1000; ratio *= 10) bench_set_operations(backend_n, ratio);
+
+    const int snapshot_n = 20000000;
+    cout << "time to first query from a snapshot file, " << snapshot_n << " entries" << endl;
+    bench_snapshot(snapshot_n);
+
+    cout << "write-ahead log, BST of int keys" << endl;
+    bench_durable(4000, false, 16);
+    bench_durable(4000, true, 16);
+
+    cout << "frozen snapshot lookups" << endl;
+    for (int freeze_n = 100000; freeze_n <= range_n; freeze_n *= 10) bench_freeze(freeze_n);
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include "bst.h"
+
+using namespace std;
+
+// Inserting sorted keys one at a time into a plain BST is quadratic, so this
+// links the nodes up directly to get a ten million node "linked list" quickly.
+template<typename Alloc>
+class DegenerateTree : public BinarySearchTree<int, int, less<int>, Alloc>
+{
+public:
+    void build_chain(int n)
+    {
+        this->clear();
+        Node<int, int>* tail = nullptr;
+        for (int i = 0; i < n; i++) {
+            Node<int, int>* node = this->createNode(i, i, tail);
+            if (tail) tail->setRight(node);
+            else this->root_ = node;
+            tail = node;
+        }
+    }
+};
+
+// runs the whole stress on a tree with the given allocator. With the
+// default NodePool and int items clear() just drops the pool's slabs, so
+// std::allocator is run as well to make clear() and the destructor walk
+// every node of the chain.
+template<typename Alloc>
+static bool stress(const string& name, int n)
+{
+    DegenerateTree<Alloc> tree;
+    tree.build_chain(n);
+    cout << name << ": built degenerate tree with " << n << " nodes" << endl;
+
+    // every lookup path is as long as the tree
+    if (tree.find(n - 1) == tree.end() || tree.find(n) != tree.end()) {
+        cout << name << ": find failed on degenerate tree" << endl;
+        return false;
+    }
+
+    // inserting past the end walks the whole chain too
+    tree.insert(make_pair(n, n));
+    if (tree.find(n) == tree.end() || tree[n] != n) {
+        cout << name << ": insert failed on degenerate tree" << endl;
+        return false;
+    }
+
+    int count = 0;
+    for (typename DegenerateTree<Alloc>::iterator it = tree.begin(); it != tree.end(); ++it) {
+        count++;
+    }
+    if (count != n + 1) {
+        cout << name << ": iteration visited " << count << " nodes, expected " << n + 1 << endl;
+        return false;
+    }
+
+    tree.clear();
+    if (!tree.empty()) {
+        cout << name << ": clear left nodes behind" << endl;
+        return false;
+    }
+
+    // destructor has to tear down a deep tree as well
+    tree.build_chain(n);
+    return true;
+}
+
+int main()
+{
+    const int n = 10000000;
+
+    if (!stress<NodePool<pair<const int, int> > >("pool", n)) return 1;
+    if (!stress<allocator<pair<const int, int> > >("std::allocator", n)) return 1;
+    cout << "degenerate tree stress test passed" << endl;
+    return 0;
+}
@@ -1,10 +1,1498 @@
 #include <iostream>
 #include <map>
+#include <list>
+#include <set>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <stdexcept>
+#include <csignal>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "bst.h"
 #include "avlbst.h"
+#include "compact_avlbst.h"
+#include "btree.h"
+#include "persistent_avlbst.h"
+#include "concurrent_avlbst.h"
+#include "sharded_avlbst.h"
+#include "durable_bst.h"
 
 using namespace std;
 
+// std::less that counts its calls, so a test can check how much work
+// the tree does per op instead of how long it takes
+struct CountingLess
+{
+    static long calls;
+    template<typename T>
+    bool operator()(const T& a, const T& b) const { calls++; return a < b; }
+};
+long CountingLess::calls = 0;
+
+// the work of inserting, finding and then removing n shuffled keys: the
+// average comparisons per insert and per remove, the height (a find
+// compares once per level down to a leaf, then once more), the average
+// nanoseconds per op, and with BST_STATS the rotations per insert
+struct AVLWork
+{
+    double insert_comparisons, remove_comparisons;
+    int height;
+    double insert_ns, remove_ns;
+    double insert_rotations;
+};
+
+static bool measure_avl_ops(int n, AVLWork& work)
+{
+    vector<int> keys(n);
+    for (int i = 0; i < n; i++) keys[i] = i;
+    mt19937 rng(104);
+    shuffle(keys.begin(), keys.end(), rng);
+
+    AVLTree<int, int, CountingLess> tree;
+    CountingLess::calls = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) tree.insert(make_pair(keys[i], i));
+    auto mid = chrono::steady_clock::now();
+    work.insert_comparisons = double(CountingLess::calls) / n;
+    TreeStats stats = tree.stats();
+    work.insert_rotations = double(stats.singleRotations + stats.doubleRotations) / n;
+
+    // heights are only sane if the stored heights were kept correct
+    bool ok = tree.validate().empty();
+    work.height = 0;
+    for (int i = 0; i < n; i++) {
+        CountingLess::calls = 0;
+        tree.find(keys[i]);
+        work.height = max(work.height, int(CountingLess::calls) - 1);
+    }
+
+    shuffle(keys.begin(), keys.end(), rng);
+    CountingLess::calls = 0;
+    auto mid2 = chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) tree.remove(keys[i]);
+    auto end = chrono::steady_clock::now();
+    work.remove_comparisons = double(CountingLess::calls) / n;
+
+    work.insert_ns = chrono::duration<double, nano>(mid - start).count() / n;
+    work.remove_ns = chrono::duration<double, nano>(end - mid2).count() / n;
+    return ok && tree.empty();
+}
+
+// at 10^6 and 10^7 keys the tree must stay within the AVL height bound,
+// 1.44 log2(n + 2), and an insert must compare about once per level
+// (a remove about twice, it finds the node again to unlink it).
+// Comparisons only cover the descent, so an O(n) height or balance
+// update after it would not show up there; the time per op is checked
+// instead. Going from 10^6 to 10^7 keys costs about 1.8x per op, mostly
+// cache misses, where an O(n) update would cost 10x, so more than 5x
+// fails. An insert must also average at most one rotation (always
+// true without BST_STATS, where nothing is counted).
+static bool avl_runtime_test()
+{
+    const int sizes[] = { 1000000, 10000000 };
+    AVLWork work[2];
+    for (int i = 0; i < 2; i++) {
+        int n = sizes[i];
+        if (!measure_avl_ops(n, work[i])) {
+            cout << "AVL runtime test: tree was not balanced at " << n << endl;
+            return false;
+        }
+        double bound = 1.4405 * log2(n + 2.0) - 0.3277;
+        if (work[i].height > bound || work[i].insert_comparisons > work[i].height + 1 ||
+            work[i].remove_comparisons > 2 * (work[i].height + 1)) {
+            cout << "AVL runtime test: height " << work[i].height << " (bound " << bound << "), "
+                 << work[i].insert_comparisons << " comparisons per insert, "
+                 << work[i].remove_comparisons << " per remove at " << n << endl;
+            return false;
+        }
+        if (work[i].insert_rotations > 1) {
+            cout << "AVL runtime test: " << work[i].insert_rotations << " rotations per insert at " << n << endl;
+            return false;
+        }
+    }
+
+    const double max_growth = 5;
+    if (work[1].insert_ns > max_growth * work[0].insert_ns ||
+        work[1].remove_ns > max_growth * work[0].remove_ns) {
+        cout << "AVL runtime test: ns/op grew from " << work[0].insert_ns << " to " << work[1].insert_ns
+             << " (insert), " << work[0].remove_ns << " to " << work[1].remove_ns
+             << " (remove) between " << sizes[0] << " and " << sizes[1] << " keys" << endl;
+        return false;
+    }
+
+    cout << "AVL insert ns/op: " << work[0].insert_ns << " @" << sizes[0]
+         << ", " << work[1].insert_ns << " @" << sizes[1] << endl;
+    cout << "AVL remove ns/op: " << work[0].remove_ns << " @" << sizes[0]
+         << ", " << work[1].remove_ns << " @" << sizes[1] << endl;
+    cout << "AVL comparisons/op: insert " << work[0].insert_comparisons << ", " << work[1].insert_comparisons
+         << "; remove " << work[0].remove_comparisons << ", " << work[1].remove_comparisons
+         << "; height " << work[0].height << ", " << work[1].height << endl;
+    return true;
+}
+
+
+// churns a tree through insert/remove/clear, checking it ends up with
+// exactly the keys still in the reference map
+template<typename Tree>
+static bool churn_matches_map(Tree& tree)
+{
+    map<string, int> expected;
+    mt19937 rng(42);
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 2000; i++) {
+            string key = to_string(rng() % 500);
+            if (rng() % 3 == 0) {
+                tree.remove(key);
+                expected.erase(key);
+            } else {
+                tree.insert(make_pair(key, i));
+                expected[key] = i;
+            }
+        }
+
+        size_t count = 0;
+        for (typename Tree::iterator it = tree.begin(); it != tree.end(); ++it) {
+            if (expected.count(it->first) == 0 || expected[it->first] != it->second) return false;
+            count++;
+        }
+        if (count != expected.size()) return false;
+
+        tree.clear();
+        expected.clear();
+    }
+    return tree.empty();
+}
+
+// the pooled default and plain std::allocator should behave the same,
+// string keys also exercise the path where clear has to run destructors
+static bool allocator_test()
+{
+    BinarySearchTree<string, int> pooled_bst;
+    AVLTree<string, int> pooled_avl;
+    BinarySearchTree<string, int, less<string>, allocator<pair<const string, int> > > std_bst;
+    AVLTree<string, int, less<string>, allocator<pair<const string, int> > > std_avl;
+    if (!churn_matches_map(pooled_bst) || !churn_matches_map(pooled_avl) ||
+        !churn_matches_map(std_bst) || !churn_matches_map(std_avl)) {
+        cout << "allocator test: tree contents did not match" << endl;
+        return false;
+    }
+    return true;
+}
+
+// a key whose copies start throwing once copies_left runs out, and whose
+// move may throw, so containers have to copy it when they relocate
+struct Fragile
+{
+    static int copies_left;
+    int n;
+    Fragile(int n) : n(n) { }
+    Fragile(const Fragile& other) : n(other.n)
+    {
+        if (copies_left == 0) throw runtime_error("copy failed");
+        if (copies_left > 0) copies_left--;
+    }
+    Fragile(Fragile&& other) : n(other.n) { }
+    Fragile& operator=(const Fragile& other) = default;
+};
+int Fragile::copies_left = -1;
+bool operator<(const Fragile& a, const Fragile& b) { return a.n < b.n; }
+
+// the compact index-linked tree should match std::map and keep
+// its balance factors right through the same churn
+static bool compact_test()
+{
+    CompactAVLTree<string, int> compact;
+    if (!churn_matches_map(compact)) {
+        cout << "compact test: tree contents did not match" << endl;
+        return false;
+    }
+
+    CompactAVLTree<int, int> numbers;
+    for (int i = 0; i < 100000; i++) numbers.insert(make_pair(i, i));
+    for (int i = 0; i < 100000; i += 3) numbers.remove(i);
+    if (!numbers.isBalanced() || numbers.size() != 66666 || numbers[99998] != 99998) {
+        cout << "compact test: tree not balanced after sorted inserts" << endl;
+        return false;
+    }
+
+    // a const tree only hands out const_iterators, and iterators convert
+    typedef CompactAVLTree<int, int> Tree;
+    static_assert(is_same<decltype(declval<const Tree&>().begin()), Tree::const_iterator>::value,
+                  "const begin gives a const_iterator");
+    static_assert(is_same<iterator_traits<Tree::const_iterator>::reference,
+                          pair<const int&, const int&> >::value, "const_iterator gives const values");
+    const Tree& view = numbers;
+    Tree::const_iterator found = numbers.find(99998);
+    if (found != view.find(99998) || found->second != 99998 ||
+        distance(view.begin(), view.end()) != 66666 || distance(numbers.cbegin(), numbers.cend()) != 66666) {
+        cout << "compact test: const iteration" << endl;
+        return false;
+    }
+
+    // a custom order is used for every comparison
+    CompactAVLTree<int, int, greater<int> > reversed;
+    for (int i = 0; i < 1000; i++) reversed.insert(make_pair(i, i));
+    for (int i = 0; i < 1000; i += 2) reversed.remove(i);
+    int expected = 999;
+    for (CompactAVLTree<int, int, greater<int> >::iterator it = reversed.begin(); it != reversed.end(); ++it) {
+        if (it->first != expected || it->second != expected) {
+            cout << "compact test: custom order" << endl;
+            return false;
+        }
+        it->second = -expected;
+        expected -= 2;
+    }
+    if (expected != -1 || reversed[1] != -1 || reversed.find(2) != reversed.end()) {
+        cout << "compact test: custom order" << endl;
+        return false;
+    }
+
+    // a key copy throwing while the array grows leaves the tree as it was
+    CompactAVLTree<Fragile, int> fragile;
+    for (int i = 0; i < 16; i++) fragile.insert(make_pair(Fragile(i), i));
+    Fragile::copies_left = 5;
+    bool threw = false;
+    try {
+        fragile.insert(make_pair(Fragile(16), 16));
+    } catch (const runtime_error&) {
+        threw = true;
+    }
+    Fragile::copies_left = -1;
+    if (!threw || fragile.size() != 16 || !fragile.isBalanced() || fragile[Fragile(15)] != 15) {
+        cout << "compact test: throwing copy while growing" << endl;
+        return false;
+    }
+    fragile.insert(make_pair(Fragile(16), 16));
+    if (fragile.size() != 17 || fragile[Fragile(16)] != 16) {
+        cout << "compact test: insert after a throwing copy" << endl;
+        return false;
+    }
+    return true;
+}
+
+// bulk loading should give a balanced tree holding exactly the input,
+// which then keeps working as a normal tree
+static bool bulk_load_test()
+{
+    vector<pair<int, int> > sorted;
+    for (int i = 0; i < 100000; i++) sorted.push_back(make_pair(2 * i, i));
+
+    AVLTree<int, int> avl(sorted.begin(), sorted.end());
+    BinarySearchTree<int, int> bst(sorted.begin(), sorted.end());
+    if (!avl.isBalanced() || !bst.isBalanced()) {
+        cout << "bulk load test: loaded tree not balanced" << endl;
+        return false;
+    }
+
+    size_t i = 0;
+    for (AVLTree<int, int>::iterator it = avl.begin(); it != avl.end(); ++it, ++i) {
+        if (i >= sorted.size() || it->first != sorted[i].first || it->second != sorted[i].second) {
+            cout << "bulk load test: wrong contents" << endl;
+            return false;
+        }
+    }
+    if (i != sorted.size()) return false;
+
+    // stored heights/balances must be right for later rebalancing
+    for (int k = 1; k < 200000; k += 2) avl.insert(make_pair(k, k));
+    for (int k = 0; k < 200000; k += 3) avl.remove(k);
+    if (!avl.isBalanced()) {
+        cout << "bulk load test: unbalanced after updates" << endl;
+        return false;
+    }
+
+    // unsorted input with repeats, the last pair for a key wins like insert
+    vector<pair<int, int> > unsorted;
+    unsorted.push_back(make_pair(5, 1));
+    unsorted.push_back(make_pair(3, 1));
+    unsorted.push_back(make_pair(5, 2));
+    unsorted.push_back(make_pair(9, 1));
+    unsorted.push_back(make_pair(3, 2));
+    avl.assign(unsorted.begin(), unsorted.end());
+    if (avl[3] != 2 || avl[5] != 2 || avl[9] != 1 || avl.find(0) != avl.end()) {
+        cout << "bulk load test: unsorted input loaded wrong" << endl;
+        return false;
+    }
+    return true;
+}
+
+// lets the validator test break a tree on purpose
+class BreakableAVL : public AVLTree<int, int>
+{
+public:
+    AVLNode<int, int>* rootNode() { return static_cast<AVLNode<int, int>*>(this->root_); }
+};
+
+// validate() should pass trees built every way, and name what is wrong
+// when a tree is broken
+static bool validate_test()
+{
+    AVLTree<string, int> avl;
+    BinarySearchTree<string, int> bst;
+    churn_matches_map(avl);
+    churn_matches_map(bst);
+    for (int i = 0; i < 1000; i++) {
+        avl.insert(make_pair(to_string(i * 7919 % 1000), i));
+        bst.insert(make_pair(to_string(i * 7919 % 1000), i));
+    }
+    for (int i = 0; i < 1000; i += 3) {
+        avl.remove(to_string(i));
+        bst.remove(to_string(i));
+    }
+    if (!avl.validate().empty() || !bst.validate().empty() || avl.size() != 666 || bst.size() != 666) {
+        cout << "validate test: " << avl.validate() << bst.validate() << endl;
+        return false;
+    }
+
+    BreakableAVL broken;
+    for (int i = 0; i < 100; i++) broken.insert(make_pair(i, i));
+    if (!broken.validate().empty()) return false;
+
+    AVLNode<int, int>* root = broken.rootNode();
+    root->setBalance(1);
+    if (broken.validate().find("balance") == string::npos) {
+        cout << "validate test: wrong balance not reported" << endl;
+        return false;
+    }
+    root->setBalance(0);
+
+    AVLNode<int, int>* left = root->getLeft();
+    left->setParent(left);
+    if (broken.validate().find("parent") == string::npos) {
+        cout << "validate test: bad parent pointer not reported" << endl;
+        return false;
+    }
+    left->setParent(root);
+
+    // swapping two children keeps the shape but breaks the order
+    AVLNode<int, int>* right = root->getRight();
+    root->setLeft(right);
+    root->setRight(left);
+    if (broken.validate().find("not greater") == string::npos) {
+        cout << "validate test: out of order keys not reported" << endl;
+        return false;
+    }
+    root->setLeft(left);
+    root->setRight(right);
+    return broken.validate().empty() && broken.isBalanced();
+}
+
+// counts how often values get built and copied
+struct Counted
+{
+    static int built, copies;
+    int n;
+    Counted(int n = 0) : n(n) { built++; }
+    Counted(const Counted& other) : n(other.n) { built++; copies++; }
+    Counted(Counted&& other) noexcept : n(other.n) { built++; }
+    Counted& operator=(const Counted& other) { n = other.n; copies++; return *this; }
+    Counted& operator=(Counted&& other) noexcept { n = other.n; return *this; }
+};
+int Counted::built = 0;
+int Counted::copies = 0;
+ostream& operator<<(ostream& out, const Counted& c) { return out << c.n; }
+bool operator<(const Counted& a, const Counted& b) { return a.n < b.n; }
+
+// rvalue inserts should never copy a value, try_emplace should build
+// nothing for a key already there, and emplace should not overwrite
+template<typename Tree>
+static bool emplace_matches(Tree& tree)
+{
+    Counted::built = Counted::copies = 0;
+    for (int i = 0; i < 1000; i++) tree.insert(pair<const int, Counted>(i, Counted(i)));
+    for (int i = 0; i < 1000; i++) tree.insert(pair<const int, Counted>(i, Counted(i + 1)));
+    if (Counted::copies != 0 || tree[0].n != 1) return false;
+
+    int built = Counted::built;
+    for (int i = 0; i < 1000; i++) {
+        if (tree.try_emplace(i, -1).second) return false;
+    }
+    if (Counted::built != built) return false;
+
+    for (int i = 1000; i < 2000; i++) {
+        if (!tree.try_emplace(i, i).second || !tree.emplace(i + 1000, i).second) return false;
+    }
+    pair<typename Tree::iterator, bool> result = tree.emplace(5, Counted(-1));
+    if (result.second || result.first->second.n != 6) return false;
+    return Counted::copies == 0 && tree.size() == 3000 && tree.validate().empty();
+}
+
+static bool emplace_test()
+{
+    BinarySearchTree<int, Counted> bst;
+    AVLTree<int, Counted> avl;
+    if (!emplace_matches(bst) || !emplace_matches(avl)) {
+        cout << "emplace test: values copied or overwritten" << endl;
+        return false;
+    }
+    if (!avl.isBalanced()) {
+        cout << "emplace test: AVL tree not balanced" << endl;
+        return false;
+    }
+
+    // through a base reference they still build AVL nodes and rebalance
+    AVLTree<int, int> by_base;
+    RankedAVLTree<int, int> ranked;
+    BinarySearchTree<int, int>& base = by_base;
+    BinarySearchTree<int, int>& ranked_base = ranked;
+    for (int i = 0; i < 2000; i++) {
+        base.emplace(i, i);
+        base.try_emplace(i + 2000, i);
+        ranked_base.emplace(i, i);
+    }
+    if (!by_base.validate().empty() || !by_base.isBalanced() || by_base.size() != 4000 ||
+        !ranked.validate().empty() || ranked.rank(1500) != 1500) {
+        cout << "emplace test: through the base " << by_base.validate() << ranked.validate() << endl;
+        return false;
+    }
+
+    // the compact tree builds each entry in its slot, copying the key once,
+    // and growing the array or filling a hole on remove only moves keys
+    CompactAVLTree<Counted, int> compact;
+    Counted::copies = 0;
+    for (int i = 0; i < 1000; i++) compact.insert(make_pair(Counted(i), i));
+    for (int i = 0; i < 1000; i += 2) compact.remove(Counted(i));
+    if (Counted::copies != 1000 || compact.size() != 500 || !compact.isBalanced()) {
+        cout << "emplace test: compact insert made " << Counted::copies << " copies" << endl;
+        return false;
+    }
+    return true;
+}
+
+// a custom order should be respected everywhere, lookups should cost one
+// comparison per level, and a transparent comparator should allow finding
+// a string key by string_view
+static bool comparator_test()
+{
+    AVLTree<int, int, greater<int> > reversed;
+    for (int i = 0; i < 1000; i++) reversed.insert(make_pair(i, i));
+    for (int i = 0; i < 1000; i += 2) reversed.remove(i);
+    int expected = 999;
+    for (AVLTree<int, int, greater<int> >::iterator it = reversed.begin(); it != reversed.end(); ++it) {
+        if (it->first != expected) {
+            cout << "comparator test: wrong order with greater<int>" << endl;
+            return false;
+        }
+        expected -= 2;
+    }
+    if (expected != -1 || !reversed.validate().empty() || reversed.find(500) != reversed.end()) {
+        cout << "comparator test: " << reversed.validate() << endl;
+        return false;
+    }
+
+    // 2^16 - 1 sorted keys bulk load into a perfect tree of height 16
+    vector<pair<string, int> > items;
+    for (int i = 0; i < 65535; i++) items.push_back(make_pair(to_string(100000 + i), i));
+    AVLTree<string, int, CountingLess> counted(items.begin(), items.end());
+    CountingLess::calls = 0;
+    for (size_t i = 0; i < items.size(); i++) {
+        if (counted.find(items[i].first) == counted.end()) return false;
+    }
+    if (CountingLess::calls > long(items.size()) * 17) {
+        cout << "comparator test: " << CountingLess::calls << " comparisons for "
+             << items.size() << " finds" << endl;
+        return false;
+    }
+
+    BinarySearchTree<string, int, less<> > by_view;
+    by_view.insert(make_pair(string("apple"), 1));
+    by_view.insert(make_pair(string("pear"), 2));
+    string_view pear("pear and more", 4);
+    if (by_view.find(pear) == by_view.end() || by_view.find(pear)->second != 2 ||
+        by_view.find(string_view("plum")) != by_view.end()) {
+        cout << "comparator test: string_view lookup failed" << endl;
+        return false;
+    }
+    return true;
+}
+
+// bounds and range scans should agree with std::map's
+template<typename Tree>
+static bool ranges_match_map(Tree& tree)
+{
+    map<int, int> expected;
+    mt19937 rng(11);
+    for (int i = 0; i < 3000; i++) {
+        int key = rng() % 10000;
+        tree.insert(make_pair(key, i));
+        expected[key] = i;
+    }
+
+    for (int q = 0; q < 2000; q++) {
+        int lo = int(rng() % 10200) - 100;
+        int hi = lo + int(rng() % 300);
+
+        typename Tree::iterator lb = tree.lower_bound(lo), ub = tree.upper_bound(lo);
+        map<int, int>::iterator mlb = expected.lower_bound(lo), mub = expected.upper_bound(lo);
+        if ((lb == tree.end()) != (mlb == expected.end()) || (lb != tree.end() && lb->first != mlb->first)) return false;
+        if ((ub == tree.end()) != (mub == expected.end()) || (ub != tree.end() && ub->first != mub->first)) return false;
+
+        pair<typename Tree::iterator, typename Tree::iterator> eq = tree.equal_range(lo);
+        if (eq.first != lb || eq.second != (expected.count(lo) ? ub : lb)) return false;
+
+        vector<pair<int, int> > seen;
+        tree.for_each_in_range(lo, hi, [&seen](pair<const int, int>& item) { seen.push_back(item); });
+        vector<pair<int, int> > want(expected.lower_bound(lo), expected.lower_bound(hi));
+        if (seen != want) return false;
+    }
+    return true;
+}
+
+static bool range_test()
+{
+    BinarySearchTree<int, int> bst;
+    AVLTree<int, int> avl;
+    if (!ranges_match_map(bst) || !ranges_match_map(avl)) {
+        cout << "range test: bounds or range scan did not match std::map" << endl;
+        return false;
+    }
+    return true;
+}
+
+// rank and select should match positions in the sorted keys through
+// inserts, removes (including two-child ones) and a bulk load
+static bool ranked_test()
+{
+    RankedAVLTree<int, int> tree;
+    set<int> expected;
+    mt19937 rng(12);
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < 5000; i++) {
+            int key = rng() % 4000;
+            if (rng() % 3 == 0) {
+                tree.remove(key);
+                expected.erase(key);
+            } else {
+                tree.insert(make_pair(key, key));
+                expected.insert(key);
+            }
+        }
+        if (!tree.validate().empty() || tree.size() != expected.size()) {
+            cout << "ranked test: " << tree.validate() << endl;
+            return false;
+        }
+
+        size_t i = 0;
+        for (set<int>::iterator it = expected.begin(); it != expected.end(); ++it, ++i) {
+            if (tree.select(i)->first != *it || tree.rank(*it) != i || tree.rank(*it + 1) != i + 1) {
+                cout << "ranked test: rank/select wrong at " << i << endl;
+                return false;
+            }
+        }
+        if (tree.select(i) != tree.end() || tree.rank(-1) != 0) return false;
+    }
+
+    vector<pair<int, int> > items;
+    for (int i = 0; i < 1000; i++) items.push_back(make_pair(3 * i, i));
+    RankedAVLTree<int, int> loaded(items.begin(), items.end());
+    loaded.insert(make_pair(1, 1));
+    if (!loaded.validate().empty() || loaded.rank(300) != 101 || loaded.select(500)->first != 1497) {
+        cout << "ranked test: bulk loaded tree ranks wrong" << endl;
+        return false;
+    }
+    return true;
+}
+
+// iterators should walk both ways, reverse, and work with std algorithms
+static bool iterator_test()
+{
+    typedef AVLTree<int, int> Tree;
+    static_assert(is_same<iterator_traits<Tree::iterator>::iterator_category,
+                          bidirectional_iterator_tag>::value, "iterator is bidirectional");
+    static_assert(is_same<iterator_traits<Tree::const_iterator>::reference,
+                          const pair<const int, int>&>::value, "const_iterator gives const items");
+
+    Tree tree;
+    vector<int> keys;
+    for (int i = 0; i < 500; i++) {
+        tree.insert(make_pair(i * 3, i));
+        keys.push_back(i * 3);
+    }
+    const Tree& ctree = tree;
+
+    // latest 10 entries straight from the back
+    vector<int> last;
+    for (Tree::const_reverse_iterator it = ctree.rbegin(); it != ctree.rend() && last.size() < 10; ++it) {
+        last.push_back(it->first);
+    }
+    if (last.size() != 10 || last[0] != 1497 || last[9] != 1470) {
+        cout << "iterator test: reverse iteration wrong" << endl;
+        return false;
+    }
+
+    // stepping back from end() and forth again visits every key
+    vector<int> backwards;
+    for (Tree::iterator it = tree.end(); it != tree.begin(); ) {
+        --it;
+        backwards.push_back(it->first);
+    }
+    reverse(backwards.begin(), backwards.end());
+    if (backwards != keys || prev(tree.end())->first != 1497 || next(tree.begin(), 2)->first != 6) {
+        cout << "iterator test: decrement wrong" << endl;
+        return false;
+    }
+
+    // iterators convert to const_iterators and compare with them
+    Tree::const_iterator found = tree.find(300);
+    if (found != ctree.find(300) || found == tree.end() || distance(ctree.begin(), found) != 100) {
+        cout << "iterator test: const_iterator wrong" << endl;
+        return false;
+    }
+
+    // std algorithms straight on the tree
+    Tree::const_iterator odd = find_if(ctree.cbegin(), ctree.cend(),
+                                       [](const pair<const int, int>& item) { return item.second % 7 == 6; });
+    vector<pair<int, int> > copied(ctree.lower_bound(30), ctree.upper_bound(60));
+    if (odd == ctree.end() || odd->first != 18 || copied.size() != 11 || copied.back().first != 60) {
+        cout << "iterator test: std algorithms gave the wrong result" << endl;
+        return false;
+    }
+    for (Tree::iterator it = tree.begin(); it != tree.end(); it++) it->second = -it->second;
+    return tree[3] == -1 && (--tree.end())->second == -499;
+}
+
+// find_batch should give what find gives, in key order, for any batch size
+static bool find_batch_test()
+{
+    AVLTree<string, int> tree;
+    for (int i = 0; i < 2000; i += 2) tree.insert(make_pair(to_string(i), i));
+
+    for (int n = 0; n < 100; n += 7) {
+        vector<string> keys;
+        for (int i = 0; i < n; i++) keys.push_back(to_string((i * 37) % 2000));
+        vector<AVLTree<string, int>::iterator> found;
+        tree.find_batch(keys, back_inserter(found));
+        if (found.size() != keys.size()) return false;
+        for (int i = 0; i < n; i++) {
+            if (found[i] != tree.find(keys[i])) {
+                cout << "find batch test: wrong result for " << keys[i] << endl;
+                return false;
+            }
+        }
+    }
+
+    const BinarySearchTree<int, int> empty;
+    vector<int> keys(20, 1);
+    vector<BinarySearchTree<int, int>::const_iterator> found(keys.size());
+    empty.find_batch(keys, found.begin());
+    return found.back() == empty.end();
+}
+
+static bool freeze_test()
+{
+    // every size up to a few full levels, so the last level is both
+    // partly and completely filled
+    for (int n = 0; n < 70; n++) {
+        AVLTree<int, int> tree;
+        for (int i = 0; i < n; i++) tree.insert(make_pair(2 * ((i * 17) % n), i));
+        FrozenTree<int, int> frozen = tree.freeze();
+        if (frozen.size() != tree.size()) return false;
+
+        AVLTree<int, int>::iterator it = tree.begin();
+        for (FrozenTree<int, int>::const_iterator f = frozen.begin(); f != frozen.end(); ++f, ++it) {
+            if (it == tree.end() || f.key() != it->first || f.value() != it->second) {
+                cout << "freeze test: wrong order at size " << n << endl;
+                return false;
+            }
+        }
+        if (it != tree.end()) return false;
+
+        for (int key = -1; key <= 2 * n; key++) {
+            AVLTree<int, int>::iterator lb = tree.lower_bound(key);
+            FrozenTree<int, int>::const_iterator flb = frozen.lower_bound(key);
+            if ((lb == tree.end()) != (flb == frozen.end()) ||
+                (flb != frozen.end() && flb.key() != lb->first)) {
+                cout << "freeze test: wrong lower bound of " << key << " at size " << n << endl;
+                return false;
+            }
+            FrozenTree<int, int>::const_iterator found = frozen.find(key);
+            if ((found == frozen.end()) != (tree.find(key) == tree.end())) return false;
+            if (found != frozen.end() && found.value() != tree.find(key)->second) return false;
+        }
+    }
+
+    // the snapshot keeps the tree's comparator and ignores later changes
+    AVLTree<string, int, std::greater<string> > tree;
+    tree.insert(make_pair(string("a"), 1));
+    tree.insert(make_pair(string("b"), 2));
+    FrozenTree<string, int, std::greater<string> > frozen = tree.freeze();
+    tree.insert(make_pair(string("c"), 3));
+    return frozen.size() == 2 && frozen.begin().key() == "b" &&
+           frozen.find("c") == frozen.end() && frozen.lower_bound("c").key() == "b";
+}
+
+// random inserts and removes against std::map, with small nodes so the
+// tree gets deep and every split, borrow and merge case comes up
+template<typename Tree, typename Key>
+static bool btree_random_test(const string& name, Key (*make_key)(int))
+{
+    Tree tree;
+    map<Key, int> expected;
+    mt19937 rng(16);
+    for (int round = 0; round < 6; round++) {
+        // grow for a few rounds, then shrink back towards empty
+        unsigned insert_odds = round < 3 ? 3 : 1;
+        for (int i = 0; i < 4000; i++) {
+            Key key = make_key(rng() % 3000);
+            if (rng() % 4 < insert_odds) {
+                tree.insert(make_pair(key, i));
+                expected[key] = i;
+            } else {
+                tree.remove(key);
+                expected.erase(key);
+            }
+        }
+        string error = tree.validate();
+        if (!error.empty() || tree.size() != expected.size()) {
+            cout << name << " test: " << error << endl;
+            return false;
+        }
+
+        typename Tree::iterator it = tree.begin();
+        for (typename map<Key, int>::iterator e = expected.begin(); e != expected.end(); ++e, ++it) {
+            if (it == tree.end() || it->first != e->first || it->second != e->second) {
+                cout << name << " test: iteration differs from std::map" << endl;
+                return false;
+            }
+        }
+        if (it != tree.end()) return false;
+        for (typename map<Key, int>::reverse_iterator e = expected.rbegin(); e != expected.rend(); ++e) {
+            --it;
+            if ((*it).first != e->first) return false;
+        }
+
+        for (int k = 0; k < 3000; k += 7) {
+            Key key = make_key(k);
+            typename map<Key, int>::iterator e = expected.lower_bound(key);
+            typename Tree::iterator lb = tree.lower_bound(key);
+            if ((e == expected.end()) != (lb == tree.end()) || (lb != tree.end() && lb->first != e->first)) {
+                cout << name << " test: wrong lower bound" << endl;
+                return false;
+            }
+            if ((tree.find(key) == tree.end()) != (expected.count(key) == 0)) return false;
+        }
+    }
+
+    while (!expected.empty()) {
+        tree.remove(expected.begin()->first);
+        expected.erase(expected.begin());
+    }
+    return tree.empty() && tree.begin() == tree.end() && tree.validate().empty();
+}
+
+static int int_key(int i) { return i; }
+static long long long_key(int i) { return 1000000000LL * i - i; }
+static string string_key(int i) { return to_string(i); }
+
+static bool btree_test()
+{
+    if (!btree_random_test<BTreeMap<int, int, std::less<int>, 8>, int>("btree int", int_key)) return false;
+    if (!btree_random_test<BTreeMap<long long, int, std::less<long long>, 16>, long long>("btree long", long_key)) return false;
+    if (!btree_random_test<BTreeMap<string, int, std::less<string>, 8>, string>("btree string", string_key)) return false;
+    if (!btree_random_test<BTreeMap<int, int>, int>("btree default", int_key)) return false;
+
+    BTreeMap<int, int> tree;
+    tree.insert(make_pair(-5, 1));
+    tree.insert(make_pair(7, 2));
+    tree.insert(make_pair(7, 3));
+    tree[-5] = 4;
+    bool threw = false;
+    try {
+        tree[6];
+    } catch (const std::out_of_range&) {
+        threw = true;
+    }
+    if (!threw || tree.size() != 2 || tree[-5] != 4 || tree[7] != 3 || tree.find(6) != tree.end()) return false;
+
+    // the const side and the in-place inserts, as BinarySearchTree has them
+    const BTreeMap<int, int>& view = tree;
+    BTreeMap<int, int>::const_iterator found = view.find(7);
+    BTreeMap<int, int>::const_iterator first = tree.begin();
+    if (found == view.end() || found->second != 3 || first != view.cbegin() ||
+        std::distance(view.begin(), view.end()) != 2) {
+        return false;
+    }
+    BTreeMap<string, string> strings;
+    string value(100, 'v');
+    strings.insert(make_pair(string("a"), std::move(value)));
+    pair<BTreeMap<string, string>::iterator, bool> placed = strings.emplace("b", "built");
+    pair<BTreeMap<string, string>::iterator, bool> kept = strings.try_emplace("b", "ignored");
+    pair<BTreeMap<string, string>::iterator, bool> added = strings.try_emplace(string("c"), 3, 'c');
+    return value.empty() && placed.second && !kept.second && kept.first->second == "built" &&
+           added.second && added.first->second == "ccc" && strings.size() == 3 && strings.validate().empty();
+}
+
+// every snapshot has to keep matching the std::map copy taken with it,
+// however much the tree changes afterwards
+static bool persistent_test()
+{
+    typedef PersistentAVLTree<int, int> Tree;
+    Tree tree;
+    map<int, int> expected;
+    vector<pair<Tree::Snapshot, map<int, int> > > versions;
+    mt19937 rng(17);
+    for (int i = 0; i < 20000; i++) {
+        int key = rng() % 2000;
+        if (rng() % 3 == 0) {
+            tree.remove(key);
+            expected.erase(key);
+        } else {
+            tree.insert(make_pair(key, i));
+            expected[key] = i;
+        }
+        if (i % 2000 == 0) versions.push_back(make_pair(tree.snapshot(), expected));
+    }
+    versions.push_back(make_pair(tree.snapshot(), expected));
+    tree.clear();
+
+    for (size_t v = 0; v < versions.size(); v++) {
+        const Tree::Snapshot& snap = versions[v].first;
+        const map<int, int>& items = versions[v].second;
+        if (!snap.validate().empty() || snap.size() != items.size()) {
+            cout << "persistent test: " << snap.validate() << endl;
+            return false;
+        }
+        Tree::Snapshot::const_iterator it = snap.begin();
+        for (map<int, int>::const_iterator e = items.begin(); e != items.end(); ++e, ++it) {
+            if (it == snap.end() || it->first != e->first || it->second != e->second) {
+                cout << "persistent test: snapshot " << v << " changed" << endl;
+                return false;
+            }
+        }
+        if (it != snap.end()) return false;
+        for (int key = 0; key < 2000; key += 13) {
+            map<int, int>::const_iterator e = items.find(key);
+            const int* value = snap.lookup(key);
+            if ((snap.find(key) == snap.end()) != (e == items.end())) return false;
+            if (snap.contains(key) != (e != items.end())) return false;
+            if ((value == nullptr) != (e == items.end()) || (value != nullptr && *value != e->second)) {
+                cout << "persistent test: lookup of " << key << " in snapshot " << v << endl;
+                return false;
+            }
+        }
+    }
+
+    // readers on another thread always see a whole version: the keys
+    // 0..k-1 for some k, in order, since the writer only appends
+    Tree shared;
+    atomic<bool> done(false);
+    bool reader_ok = true;
+    thread reader([&]() {
+        while (!done) {
+            Tree::Snapshot snap = shared.snapshot();
+            int expected_key = 0;
+            for (Tree::Snapshot::const_iterator it = snap.begin(); it != snap.end(); ++it) {
+                if (it->first != expected_key++) reader_ok = false;
+            }
+            if ((size_t)expected_key != snap.size()) reader_ok = false;
+        }
+    });
+    for (int i = 0; i < 20000; i++) shared.insert(make_pair(i, i));
+    done = true;
+    reader.join();
+    return reader_ok && shared.validate().empty();
+}
+
+// one thread against std::map, then writers on disjoint keys at once,
+// each checking its own keys as it goes
+static bool concurrent_test()
+{
+    ConcurrentAVLTree<int, int> tree;
+    map<int, int> expected;
+    mt19937 rng(18);
+    for (int i = 0; i < 50000; i++) {
+        int key = rng() % 3000;
+        if (rng() % 3 == 0) {
+            tree.remove(key);
+            expected.erase(key);
+        } else {
+            tree.insert(make_pair(key, i));
+            expected[key] = i;
+        }
+    }
+    if (!tree.validate().empty() || tree.size() != expected.size()) {
+        cout << "concurrent test: " << tree.validate() << endl;
+        return false;
+    }
+    map<int, int>::iterator e = expected.begin();
+    bool same = true;
+    tree.for_each([&](int key, int value) {
+        if (e == expected.end() || e->first != key || e->second != value) same = false;
+        else ++e;
+    });
+    if (!same || e != expected.end()) return false;
+
+    const int threads = 4;
+    ConcurrentAVLTree<int, int> shared;
+    vector<map<int, int> > owned(threads);
+    atomic<bool> wrong(false);
+    vector<thread> writers;
+    for (int t = 0; t < threads; t++) {
+        writers.push_back(thread([&, t]() {
+            mt19937 thread_rng(t);
+            for (int i = 0; i < 20000; i++) {
+                int key = (thread_rng() % 2000) * threads + t;
+                if (thread_rng() % 3 == 0) {
+                    shared.remove(key);
+                    owned[t].erase(key);
+                } else {
+                    shared.insert(make_pair(key, i));
+                    owned[t][key] = i;
+                }
+                int value;
+                bool found = shared.find(key, value);
+                if (found != (owned[t].count(key) == 1) || (found && value != owned[t][key])) wrong = true;
+            }
+        }));
+    }
+    size_t total = 0;
+    for (int t = 0; t < threads; t++) {
+        writers[t].join();
+        total += owned[t].size();
+    }
+    if (wrong || !shared.validate().empty() || shared.size() != total) {
+        cout << "concurrent test: threads disagree " << shared.validate() << endl;
+        return false;
+    }
+
+    // churn over a few keys unlinks tens of thousands of nodes, while
+    // readers keep pinning; only a few batches of them may be left unfreed
+    ConcurrentAVLTree<int, int> churned;
+    atomic<bool> churning(true);
+    thread reader([&]() {
+        int value;
+        for (int key = 0; churning.load(); key = (key + 1) % 256) churned.find(key, value);
+    });
+    writers.clear();
+    for (int t = 0; t < threads; t++) {
+        writers.push_back(thread([&, t]() {
+            for (int i = 0; i < 40000; i++) {
+                int key = (i * 7 + t) % 256;
+                if (i % 2 == 0) churned.insert(make_pair(key, i));
+                else churned.remove(key);
+            }
+        }));
+    }
+    for (int t = 0; t < threads; t++) writers[t].join();
+    churning = false;
+    reader.join();
+    if (churned.retired() > 2000 || !churned.validate().empty()) {
+        cout << "concurrent test: " << churned.retired() << " unlinked nodes never freed" << endl;
+        return false;
+    }
+    return true;
+}
+
+// random operations against std::map, then a hot range that has to
+// push the boundaries around
+static bool sharded_test()
+{
+    vector<int> boundaries;
+    for (int b = 1000; b < 8000; b += 1000) boundaries.push_back(b);
+    ShardedAVLTree<int, int> tree(boundaries);
+    map<int, int> expected;
+    mt19937 rng(19);
+    for (int i = 0; i < 30000; i++) {
+        int key = rng() % 9000 - 500;
+        if (rng() % 3 == 0) {
+            tree.remove(key);
+            expected.erase(key);
+        } else {
+            tree.insert(make_pair(key, i));
+            expected[key] = i;
+        }
+    }
+    if (!tree.validate().empty() || tree.size() != expected.size()) {
+        cout << "sharded test: " << tree.validate() << endl;
+        return false;
+    }
+
+    ShardedAVLTree<int, int>::const_iterator it = tree.begin();
+    for (map<int, int>::iterator e = expected.begin(); e != expected.end(); ++e, ++it) {
+        if (it == tree.end() || it->first != e->first || it->second != e->second) {
+            cout << "sharded test: iteration differs from std::map" << endl;
+            return false;
+        }
+    }
+    if (it != tree.end()) return false;
+
+    // a range across several shards
+    vector<int> scanned;
+    tree.for_each_in_range(1500, 4500, [&scanned](const pair<const int, int>& item) { scanned.push_back(item.first); });
+    vector<int> in_range;
+    for (map<int, int>::iterator e = expected.lower_bound(1500); e != expected.lower_bound(4500); ++e) {
+        in_range.push_back(e->first);
+    }
+    if (scanned != in_range || tree.lower_bound(1500)->first != expected.lower_bound(1500)->first) return false;
+
+    // everything new lands in the last shard, which has to spill over
+    for (int i = 0; i < 40000; i++) tree.insert(make_pair(100000 + i, i));
+    tree.rebalance();
+    vector<size_t> sizes = tree.shardSizes();
+    size_t average = tree.size() / sizes.size();
+    for (size_t i = 0; i < sizes.size(); i++) {
+        if (sizes[i] > 2 * average + ShardedAVLTree<int, int>::REBALANCE_SLACK) {
+            cout << "sharded test: shard " << i << " still hot" << endl;
+            return false;
+        }
+    }
+    if (tree.boundaries().back() <= 8000 || !tree.validate().empty()) return false;
+    return tree.contains(100000) && tree.contains(139999) && tree.size() == expected.size() + 40000;
+}
+
+// a batch bigger than the tree and sorted on several threads, then one
+// small enough to go in one insert at a time, both checked against
+// std::map with the same inserts done in order
+template<typename Tree>
+static bool bulk_insert_matches_map(const string& name)
+{
+    Tree tree;
+    map<int, int> expected;
+    mt19937 rng(20);
+    for (int i = 0; i < 20000; i++) {
+        int key = rng() % 100000;
+        tree.insert(make_pair(key, i));
+        expected[key] = i;
+    }
+
+    for (int round = 0; round < 2; round++) {
+        vector<pair<int, int> > batch;
+        int batch_size = round == 0 ? 100000 : 50;
+        for (int i = 0; i < batch_size; i++) {
+            int key = rng() % 200000;
+            batch.push_back(make_pair(key, -i));
+            expected[key] = -i;
+        }
+        tree.bulk_insert(batch, 4);
+        // only the big batch rebuilds, a plain BST stays as unbalanced as inserts leave it
+        bool rebuilt = round == 0;
+        if (!tree.validate().empty() || (rebuilt && !tree.isBalanced()) || tree.size() != expected.size()) {
+            cout << "bulk insert test: " << name << " " << tree.validate() << endl;
+            return false;
+        }
+
+        typename Tree::iterator it = tree.begin();
+        for (map<int, int>::iterator e = expected.begin(); e != expected.end(); ++e, ++it) {
+            if (it == tree.end() || it->first != e->first || it->second != e->second) {
+                cout << "bulk insert test: " << name << " differs from std::map" << endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool bulk_insert_test()
+{
+    BinarySearchTree<int, int> empty;
+    empty.bulk_insert(vector<pair<int, int> >());
+
+    // any container works, and a small batch keeps the later value of a key
+    AVLTree<int, int> tree;
+    for (int i = 0; i < 1000; i++) tree.insert(make_pair(i, i));
+    list<pair<const int, int> > small = { { 5, -1 }, { 2000, 1 }, { 5, -2 } };
+    tree.bulk_insert(small);
+    if (tree.size() != 1001 || tree[5] != -2 || tree[2000] != 1 || !tree.isBalanced()) {
+        cout << "bulk insert test: small batch from a list" << endl;
+        return false;
+    }
+    return empty.empty() &&
+           bulk_insert_matches_map<BinarySearchTree<int, int> >("BST") &&
+           bulk_insert_matches_map<AVLTree<int, int> >("AVL") &&
+           bulk_insert_matches_map<RankedAVLTree<int, int> >("ranked AVL");
+}
+
+// unite, intersect and subtract on trees of very different sizes against
+// the same operations on std::map
+template<typename Tree>
+static bool set_operations_match_map(const string& name, int a_size, int b_size)
+{
+    Tree a, b;
+    map<int, int> a_expected, b_expected;
+    mt19937 rng(a_size + b_size);
+    for (int i = 0; i < a_size; i++) {
+        int key = rng() % (2 * (a_size + b_size));
+        a.insert(make_pair(key, i));
+        a_expected[key] = i;
+    }
+    for (int i = 0; i < b_size; i++) {
+        int key = rng() % (2 * (a_size + b_size));
+        b.insert(make_pair(key, -i));
+        b_expected[key] = -i;
+    }
+
+    for (int op = 0; op < 3; op++) {
+        Tree result;
+        for (map<int, int>::iterator it = a_expected.begin(); it != a_expected.end(); ++it) result.insert(*it);
+        map<int, int> expected;
+        if (op == 0) {
+            result.unite(b, 4);
+            expected = a_expected;
+            for (map<int, int>::iterator it = b_expected.begin(); it != b_expected.end(); ++it) expected[it->first] = it->second;
+        } else {
+            if (op == 1) result.intersect(b, 4);
+            else result.subtract(b, 4);
+            for (map<int, int>::iterator it = a_expected.begin(); it != a_expected.end(); ++it) {
+                if ((b_expected.count(it->first) != 0) == (op == 1)) expected.insert(*it);
+            }
+        }
+
+        string problem = result.validate();
+        if (problem.empty() && result.size() != expected.size()) problem = "wrong size";
+        typename Tree::iterator it = result.begin();
+        for (map<int, int>::iterator e = expected.begin(); problem.empty() && e != expected.end(); ++e, ++it) {
+            if (it == result.end() || it->first != e->first || it->second != e->second) problem = "wrong contents";
+        }
+        if (!problem.empty()) {
+            cout << "set operations test: " << name << " op " << op << " " << a_size << "/" << b_size << ": " << problem << endl;
+            return false;
+        }
+    }
+    return a.validate().empty() && b.validate().empty() && b.size() == b_expected.size();
+}
+
+static bool set_operations_test()
+{
+    const int sizes[] = { 0, 1, 10, 1000, 50000 };
+    for (int i = 0; i < 5; i++) {
+        for (int j = 0; j < 5; j++) {
+            if (!set_operations_match_map<AVLTree<int, int> >("AVL", sizes[i], sizes[j])) return false;
+        }
+    }
+    if (!set_operations_match_map<RankedAVLTree<int, int> >("ranked AVL", 20000, 3000)) return false;
+
+    // a tree with itself
+    AVLTree<int, int> self;
+    for (int i = 0; i < 100; i++) self.insert(make_pair(i, i));
+    self.unite(self);
+    self.intersect(self);
+    if (self.size() != 100) return false;
+    self.subtract(self);
+    return self.empty() && self.validate().empty();
+}
+
+// true if opening path as a FrozenTree<Key, Value> throws
+template<typename Key, typename Value>
+static bool snapshot_rejected(const string& path)
+{
+    try {
+        FrozenTree<Key, Value>::open(path);
+    } catch (const runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+// save and load round trips, the mapped view, and files that must be refused
+static bool snapshot_test()
+{
+    const string path = "bst-test.snapshot";
+    for (int n = 0; n <= 5000; n += 2500) {
+        AVLTree<int, double> tree;
+        for (int i = 0; i < n; i++) tree.insert(make_pair(i * 7919 % 10007, i / 2.0));
+        tree.save(path);
+
+        FrozenTree<int, double> view = FrozenTree<int, double>::open(path);
+        AVLTree<int, double> loaded;
+        loaded.insert(make_pair(-1, 0.0));
+        loaded.load(path);
+        if (view.size() != tree.size() || loaded.size() != tree.size() || !loaded.validate().empty()) {
+            cout << "snapshot test: size " << n << " " << loaded.validate() << endl;
+            return false;
+        }
+
+        AVLTree<int, double>::iterator it = tree.begin();
+        AVLTree<int, double>::iterator l = loaded.begin();
+        for (FrozenTree<int, double>::const_iterator v = view.begin(); v != view.end(); ++v, ++it, ++l) {
+            if (v.key() != it->first || v.value() != it->second || l->first != it->first || l->second != it->second) {
+                cout << "snapshot test: contents differ at size " << n << endl;
+                return false;
+            }
+        }
+        for (int key = -1; key < 10010; key += 37) {
+            FrozenTree<int, double>::const_iterator found = view.find(key);
+            if ((found == view.end()) != (tree.find(key) == tree.end())) return false;
+        }
+    }
+
+    // wrong types, a flipped bit, a cut off file and no file at all
+    bool refused = snapshot_rejected<long long, double>(path) && snapshot_rejected<int, float>(path);
+    FILE* file = fopen(path.c_str(), "r+b");
+    fseek(file, 100, SEEK_SET);
+    fputc(fgetc(file) ^ 1, file);
+    fclose(file);
+    refused = refused && snapshot_rejected<int, double>(path);
+    FrozenTree<int, double>::open(path, false);  // without the checksum it is taken as is
+    vector<char> bytes(1 << 20);
+    file = fopen(path.c_str(), "rb");
+    bytes.resize(fread(bytes.data(), 1, bytes.size(), file));
+    fclose(file);
+    file = fopen(path.c_str(), "wb");
+    fwrite(bytes.data(), 1, bytes.size() - 8, file);
+    fclose(file);
+    refused = refused && snapshot_rejected<int, double>(path);
+    remove(path.c_str());
+    refused = refused && snapshot_rejected<int, double>(path);
+    if (!refused) cout << "snapshot test: a bad file was accepted" << endl;
+    return refused;
+}
+
+// true if tree holds exactly what expected does
+template<typename Durable>
+static bool durable_matches_map(const Durable& tree, const map<int, int>& expected)
+{
+    bool same = tree.size() == expected.size();
+    tree.read([&](const typename Durable::tree_type& t) {
+        for (map<int, int>::const_iterator e = expected.begin(); same && e != expected.end(); ++e) {
+            typename Durable::tree_type::const_iterator it = t.find(e->first);
+            same = it != t.end() && it->second == e->second;
+        }
+    });
+    return same;
+}
+
+// writes from several threads, then reopening after a "crash" (dropping
+// the object without a checkpoint), after a checkpoint, and with a torn
+// record at the end of the log
+template<typename Tree>
+static bool durable_recovers(const string& name)
+{
+    const string log_path = "bst-test.wal";
+    const string snapshot_path = "bst-test.wal.snapshot";
+    remove(log_path.c_str());
+    remove(snapshot_path.c_str());
+    typedef DurableTree<int, int, std::less<int>, Tree> Durable;
+
+    map<int, int> expected;
+    {
+        Durable tree(log_path, snapshot_path);
+        vector<thread> writers;
+        for (int t = 0; t < 4; t++) {
+            // each thread owns the keys equal to t mod 4, so the result is known
+            writers.push_back(thread([&tree, t]() {
+                for (int i = 0; i < 50; i++) {
+                    tree.insert(make_pair(4 * i + t, i));
+                    if (i % 5 == 0) tree.remove(4 * (i / 2) + t);
+                }
+            }));
+        }
+        for (int t = 0; t < 4; t++) writers[t].join();
+    }
+    for (int t = 0; t < 4; t++) {
+        for (int i = 0; i < 50; i++) {
+            expected[4 * i + t] = i;
+            if (i % 5 == 0) expected.erase(4 * (i / 2) + t);
+        }
+    }
+
+    bool ok;
+    {
+        Durable tree(log_path, snapshot_path);
+        ok = durable_matches_map(tree, expected);
+        tree.checkpoint();
+        tree.insert(make_pair(1000, 1));
+        tree.remove(0);
+        expected[1000] = 1;
+        expected.erase(0);
+    }
+    {
+        Durable tree(log_path, snapshot_path, false);
+        ok = ok && durable_matches_map(tree, expected);
+        tree.insert(make_pair(2000, 2));
+        expected[2000] = 2;
+    }
+
+    // half a record, as if the process died in the middle of a write
+    FILE* file = fopen(log_path.c_str(), "ab");
+    fputc('I', file);
+    fputc(7, file);
+    fclose(file);
+    {
+        Durable tree(log_path, snapshot_path);
+        ok = ok && durable_matches_map(tree, expected);
+        tree.insert(make_pair(3000, 3));
+        expected[3000] = 3;
+    }
+    {
+        Durable tree(log_path, snapshot_path);
+        ok = ok && durable_matches_map(tree, expected);
+    }
+
+    remove(log_path.c_str());
+    remove(snapshot_path.c_str());
+    if (!ok) cout << "durable test: " << name << " lost or made up a change" << endl;
+    return ok;
+}
+
+// a write that fails part way: the child runs into a file size limit
+// mid-record, and must refuse every write after that even once the
+// limit is lifted; reopening keeps exactly what was acknowledged
+static bool durable_fails_stop(bool group_commit)
+{
+    const string log_path = "bst-test.wal";
+    const string snapshot_path = "bst-test.wal.snapshot";
+    remove(log_path.c_str());
+    remove(snapshot_path.c_str());
+    typedef DurableTree<int, int> Durable;
+
+    pid_t child = fork();
+    if (child == 0) {
+        signal(SIGXFSZ, SIG_IGN);
+        Durable tree(log_path, snapshot_path, group_commit);
+        struct rlimit limit;
+        getrlimit(RLIMIT_FSIZE, &limit);
+        struct rlimit small = limit;
+        small.rlim_cur = 32 + 17 * 40 + 5;  // the header, 40 records and part of one
+        setrlimit(RLIMIT_FSIZE, &small);
+        int acknowledged = 0;
+        try {
+            for (; acknowledged < 100; acknowledged++) tree.insert(make_pair(acknowledged, acknowledged));
+        } catch (const std::runtime_error&) {
+        }
+        setrlimit(RLIMIT_FSIZE, &limit);
+        bool refused = false;
+        try {
+            tree.insert(make_pair(1000, 1000));
+        } catch (const std::runtime_error&) {
+            refused = true;
+        }
+        _exit(refused ? acknowledged : 255);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    int acknowledged = WIFEXITED(status) ? WEXITSTATUS(status) : 255;
+
+    bool ok = acknowledged == 40;
+    map<int, int> expected;
+    for (int i = 0; i < acknowledged; i++) expected[i] = i;
+    if (ok) {
+        Durable tree(log_path, snapshot_path, group_commit);
+        ok = durable_matches_map(tree, expected);
+        tree.insert(make_pair(2000, 2));
+        expected[2000] = 2;
+    }
+    if (ok) {
+        Durable tree(log_path, snapshot_path, group_commit);
+        ok = durable_matches_map(tree, expected);
+    }
+
+    remove(log_path.c_str());
+    remove(snapshot_path.c_str());
+    if (!ok) cout << "durable test: kept writing after a failed write (" << acknowledged << ")" << endl;
+    return ok;
+}
+
+static bool durable_test()
+{
+    return durable_recovers<BinarySearchTree<int, int> >("BST") && durable_recovers<AVLTree<int, int> >("AVL") &&
+           durable_recovers<BTreeMap<int, int> >("B-tree") &&
+           durable_fails_stop(true) && durable_fails_stop(false);
+}
+
+// stats() is all zero without BST_STATS; with it, the counts of a few
+// small trees worked out by hand, and a reader thread while inserting
+static bool stats_test()
+{
+    AVLTree<int, int> rr;
+    for (int i = 1; i <= 3; i++) rr.insert(make_pair(i, i));  // one left rotation at 1
+    AVLTree<int, int> rl;
+    rl.insert(make_pair(1, 1));
+    rl.insert(make_pair(3, 3));
+    rl.insert(make_pair(2, 2));  // right then left at 1
+    rr.find(3);
+    rr.remove(2);  // the root has two children, swapped with 1
+    BinarySearchTree<int, int> bst;
+    bst.insert(make_pair(2, 2));
+    bst.insert(make_pair(1, 1));
+    bst.remove(1);
+    bst.clear();
+
+#ifndef BST_STATS
+    TreeStats zero = TreeStats();
+    TreeStats got = rr.stats();
+    if (memcmp(&got, &zero, sizeof got) != 0) {
+        cout << "stats test: counting without BST_STATS" << endl;
+        return false;
+    }
+    return true;
+#else
+    TreeStats s = rr.stats();
+    // inserts compare 0, 2 and 3 times and visit 0, 1 and 2 nodes; the find
+    // visits 2 and 3 and compares 2 + 1, the remove walks 2, 1 twice
+    if (s.inserts != 3 || s.insertVisits != 3 || s.finds != 1 || s.findVisits != 2 ||
+        s.removes != 1 || s.removeVisits != 4 || s.comparisons != 5 + 3 + 6 ||
+        s.singleRotations != 1 || s.doubleRotations != 0 || s.nodeSwaps != 1 ||
+        s.allocations != 3 || s.deallocations != 1) {
+        cout << "stats test: AVL counts " << s.inserts << " " << s.insertVisits << " " << s.finds << " "
+             << s.findVisits << " " << s.removes << " " << s.removeVisits << " " << s.comparisons << " "
+             << s.singleRotations << " " << s.nodeSwaps << " " << s.allocations << " " << s.deallocations << endl;
+        return false;
+    }
+    s = rl.stats();
+    if (s.singleRotations != 0 || s.doubleRotations != 1) {
+        cout << "stats test: double rotation not counted" << endl;
+        return false;
+    }
+    s = bst.stats();
+    if (s.inserts != 2 || s.removes != 1 || s.finds != 0 || s.removeVisits != 2 ||
+        s.allocations != 2 || s.deallocations != 2 || s.singleRotations != 0) {
+        cout << "stats test: BST counts" << endl;
+        return false;
+    }
+
+    // the bound and range lookups are finds too, and a batch is one per key;
+    // 1..7 makes a perfect tree, so every descent looks at 3 nodes
+    AVLTree<int, int> ranged;
+    for (int i = 1; i <= 7; i++) ranged.insert(make_pair(i, i));
+    ranged.lower_bound(4);
+    ranged.upper_bound(4);
+    ranged.equal_range(5);
+    int in_range = 0;
+    ranged.for_each_in_range(2, 5, [&](const pair<const int, int>&) { in_range++; });
+    vector<int> batch_keys = { 1, 6, 9 };
+    vector<AVLTree<int, int>::iterator> batch_found;
+    ranged.find_batch(batch_keys, back_inserter(batch_found));
+    s = ranged.stats();
+    if (s.finds != 7 || s.findVisits != 21 || in_range != 3 || batch_found.size() != 3) {
+        cout << "stats test: range lookups counted " << s.finds << " finds, " << s.findVisits << " visits" << endl;
+        return false;
+    }
+
+    // stats() from another thread while the tree grows only ever goes up
+    AVLTree<int, int> grown;
+    std::atomic<bool> done(false);
+    bool monotonic = true;
+    std::thread reader([&]() {
+        uint64_t last = 0;
+        while (!done.load()) {
+            TreeStats now = grown.stats();
+            if (now.inserts < last) monotonic = false;
+            last = now.inserts;
+        }
+    });
+    for (int i = 0; i < 20000; i++) grown.insert(make_pair(i, i));
+    done.store(true);
+    reader.join();
+    s = grown.stats();
+    if (!monotonic || s.inserts != 20000 || s.allocations != 20000 ||
+        s.singleRotations + s.doubleRotations == 0) {
+        cout << "stats test: reader saw " << (monotonic ? "" : "counts going down, ") << s.inserts << endl;
+        return false;
+    }
+    return true;
+#endif
+}
 
 int main(int argc, char *argv[])
 {
@@ -121,5 +1609,27 @@ int main(int argc, char *argv[])
   //  cout << "Erasing b" << endl;
   //  at.remove('b');
 
+    if (!avl_runtime_test()) return 1;
+    if (!allocator_test()) return 1;
+    if (!compact_test()) return 1;
+    if (!bulk_load_test()) return 1;
+    if (!validate_test()) return 1;
+    if (!emplace_test()) return 1;
+    if (!comparator_test()) return 1;
+    if (!range_test()) return 1;
+    if (!ranked_test()) return 1;
+    if (!iterator_test()) return 1;
+    if (!find_batch_test()) return 1;
+    if (!freeze_test()) return 1;
+    if (!btree_test()) return 1;
+    if (!persistent_test()) return 1;
+    if (!concurrent_test()) return 1;
+    if (!sharded_test()) return 1;
+    if (!bulk_insert_test()) return 1;
+    if (!set_operations_test()) return 1;
+    if (!snapshot_test()) return 1;
+    if (!durable_test()) return 1;
+    if (!stats_test()) return 1;
+
     return 0;
 }
@@ -4,21 +4,216 @@
 #include <iostream>
 #include <exception>
 #include <cstdlib>
+#include <cstdint>
 #include <utility>
+#include <memory>
+#include <type_traits>
+#include <iterator>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <tuple>
+#include <thread>
+#include <system_error>
+#include "node_pool.h"
+
+// hint that *p will be read soon, a no-op where the builtin is missing
+#if defined(__GNUC__) || defined(__clang__)
+#define BST_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define BST_PREFETCH(p) ((void)0)
+#endif
+
+// -DBST_STATS makes every tree count what it does, see TreeStats below.
+// It changes the tree layout, so define it for the whole program or not at all.
+#ifdef BST_STATS
+#include <atomic>
+#endif
+
+/**
+ * What a tree has done since it was made, as returned by stats().
+ * Comparisons are the ones made while searching the tree (not the ones
+ * made sorting batches or splitting for set operations). The visits
+ * are the nodes looked at on the way down, summed over the operations;
+ * a remove that has to find the node twice counts both walks.
+ * Everything is zero unless the program is built with -DBST_STATS.
+ */
+struct TreeStats
+{
+    uint64_t comparisons;
+    uint64_t finds;
+    uint64_t findVisits;
+    uint64_t inserts;
+    uint64_t insertVisits;
+    uint64_t removes;
+    uint64_t removeVisits;
+    uint64_t singleRotations;
+    uint64_t doubleRotations;
+    uint64_t nodeSwaps;
+    uint64_t allocations;
+    uint64_t deallocations;
+};
+
+// the counters, in the order of the fields of TreeStats
+enum TreeStatCounter {
+    STAT_COMPARISONS, STAT_FINDS, STAT_FIND_VISITS, STAT_INSERTS, STAT_INSERT_VISITS,
+    STAT_REMOVES, STAT_REMOVE_VISITS, STAT_SINGLE_ROTATIONS, STAT_DOUBLE_ROTATIONS,
+    STAT_NODE_SWAPS, STAT_ALLOCATIONS, STAT_DEALLOCATIONS, STAT_COUNTERS
+};
+
+/**
+ * The statistics policy of a build without BST_STATS. Every hook is
+ * empty and inline, and count() hands back the comparator itself, so
+ * the trees compile to exactly what they would without the hooks.
+ */
+class NoTreeStats
+{
+public:
+    // an open find, insert or remove
+    class Operation
+    {
+    public:
+        Operation(const NoTreeStats&, TreeStatCounter, TreeStatCounter, uint64_t = 1) { }
+        void add(uint64_t = 1) { }
+    };
+
+    template<typename Compare>
+    const Compare& count(const Compare& comp) const { return comp; }
+    void add(TreeStatCounter, uint64_t = 1) const { }
+    void visit() const { }
+    TreeStats snapshot() const { return TreeStats(); }
+};
+
+#ifdef BST_STATS
+/**
+ * The statistics policy of a BST_STATS build. The counters are atomics
+ * so stats() can be read from any thread while the tree is in use, and
+ * so const lookups from several threads don't lose counts. Nodes visited
+ * are totted up per thread for the outermost open operation and added
+ * to its counter when it closes, so a remove that calls internalFind is
+ * one remove and not a find as well.
+ */
+class CountingTreeStats
+{
+public:
+    // a comparator that counts its calls into a CountingTreeStats
+    template<typename Compare>
+    class CountingCompare
+    {
+    public:
+        CountingCompare(const Compare& comp, const CountingTreeStats& stats) :
+            comp_(comp), stats_(stats) { }
+        template<typename A, typename B>
+        bool operator()(const A& a, const B& b) const
+        {
+            stats_.add(STAT_COMPARISONS);
+            return comp_(a, b);
+        }
+
+    private:
+        const Compare& comp_;
+        const CountingTreeStats& stats_;
+    };
+
+    class Operation
+    {
+    public:
+        // n is how many operations the scope stands for, for batches
+        Operation(const CountingTreeStats& stats, TreeStatCounter ops, TreeStatCounter visits, uint64_t n = 1) :
+            stats_(stats), ops_(ops), visits_(visits), n_(n), outermost_(current().depth++ == 0)
+        {
+            if (outermost_) current().visits = 0;
+        }
+        ~Operation()
+        {
+            current().depth--;
+            if (!outermost_) return;
+            stats_.add(ops_, n_);
+            stats_.add(visits_, current().visits);
+        }
+        void add(uint64_t n = 1) { n_ += n; }
+
+    private:
+        const CountingTreeStats& stats_;
+        TreeStatCounter ops_;
+        TreeStatCounter visits_;
+        uint64_t n_;
+        bool outermost_;
+    };
+
+    CountingTreeStats()
+    {
+        for (int i = 0; i < STAT_COUNTERS; i++) counts_[i].store(0, std::memory_order_relaxed);
+    }
+
+    template<typename Compare>
+    CountingCompare<Compare> count(const Compare& comp) const
+    {
+        return CountingCompare<Compare>(comp, *this);
+    }
+    void add(TreeStatCounter counter, uint64_t n = 1) const
+    {
+        counts_[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+    void visit() const { current().visits++; }
+    TreeStats snapshot() const
+    {
+        uint64_t values[STAT_COUNTERS];
+        for (int i = 0; i < STAT_COUNTERS; i++) values[i] = counts_[i].load(std::memory_order_relaxed);
+        TreeStats stats = {
+            values[STAT_COMPARISONS], values[STAT_FINDS], values[STAT_FIND_VISITS],
+            values[STAT_INSERTS], values[STAT_INSERT_VISITS], values[STAT_REMOVES],
+            values[STAT_REMOVE_VISITS], values[STAT_SINGLE_ROTATIONS],
+            values[STAT_DOUBLE_ROTATIONS], values[STAT_NODE_SWAPS],
+            values[STAT_ALLOCATIONS], values[STAT_DEALLOCATIONS]
+        };
+        return stats;
+    }
+
+private:
+    struct OperationState
+    {
+        int depth;
+        uint64_t visits;
+    };
+    static OperationState& current()
+    {
+        static thread_local OperationState state = { 0, 0 };
+        return state;
+    }
+
+    mutable std::atomic<uint64_t> counts_[STAT_COUNTERS];
+};
+
+typedef CountingTreeStats TreeStatsPolicy;
+#else
+typedef NoTreeStats TreeStatsPolicy;
+#endif
 
 /**
  * A templated class for a Node in a search tree.
- * The getters for parent/left/right are virtual so
- * that they can be overridden for future kinds of
- * search trees, such as Red Black trees, Splay trees,
- * and AVL trees.
+ * Nothing in a node is virtual, so nodes carry no
+ * vtable pointer and every getter is a plain inlinable
+ * load. Future kinds of search trees, such as Red Black
+ * trees, Splay trees, and AVL trees, derive their nodes
+ * from TypedNode below to get getters of their own type.
+ */
+
+/**
+ * Tag for the node constructors that build the item in place from
+ * whatever arguments a std::pair<const Key, Value> can be built from.
  */
+struct in_place_item_t { };
+
 template <typename Key, typename Value>
 class Node
 {
 public:
     Node(const Key& key, const Value& value, Node<Key, Value>* parent);
-    virtual ~Node();
+    template<typename... ItemArgs>
+    Node(in_place_item_t, Node<Key, Value>* parent, ItemArgs&&... item_args);
+    ~Node();
 
     const std::pair<const Key, Value>& getItem() const;
     std::pair<const Key, Value>& getItem();
@@ -26,25 +221,28 @@ public:
     const Value& getValue() const;
     Value& getValue();
 
-    virtual Node<Key, Value>* getParent() const;
-    virtual Node<Key, Value>* getLeft() const;
-    virtual Node<Key, Value>* getRight() const;
+    Node<Key, Value>* getParent() const;
+    Node<Key, Value>* getLeft() const;
+    Node<Key, Value>* getRight() const;
 
     void setParent(Node<Key, Value>* parent);
     void setLeft(Node<Key, Value>* left);
     void setRight(Node<Key, Value>* right);
     void setValue(const Value &value);
+    void setValue(Value&& value);
 
-    // height functions
-    void set_height(int height) { height_ = height; }
-    int get_height() { return height_; }
+    // height functions, a lone node has height 1. A balanced tree never
+    // gets anywhere near 127 levels, so a byte is plenty and leaves room
+    // for derived nodes' fields in what would otherwise be padding.
+    void set_height(int height) { height_ = static_cast<int8_t>(height); }
+    int get_height() const { return height_; }
 
 protected:
     std::pair<const Key, Value> item_;
     Node<Key, Value>* parent_;
     Node<Key, Value>* left_;
     Node<Key, Value>* right_;
-    int height_;
+    int8_t height_;
 };
 
 /*
@@ -62,7 +260,23 @@ Node<Key, Value>::Node(const Key& key, const Value& value, Node<Key, Value>* par
     parent_(parent),
     left_(NULL),
     right_(NULL),
-    height_(0)
+    height_(1)
+{
+
+}
+
+/**
+* Constructor that builds the item in place from item_args, the way
+* std::pair<const Key, Value>(item_args...) would.
+*/
+template<typename Key, typename Value>
+template<typename... ItemArgs>
+Node<Key, Value>::Node(in_place_item_t, Node<Key, Value>* parent, ItemArgs&&... item_args) :
+    item_(std::forward<ItemArgs>(item_args)...),
+    parent_(parent),
+    left_(NULL),
+    right_(NULL),
+    height_(1)
 {
 
 }
@@ -124,7 +338,7 @@ Value& Node<Key, Value>::getValue()
 }
 
 /**
-* An implementation of the virtual function for retreiving the parent.
+* A getter for the parent.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getParent() const
@@ -133,7 +347,7 @@ Node<Key, Value>* Node<Key, Value>::getParent() const
 }
 
 /**
-* An implementation of the virtual function for retreiving the left child.
+* A getter for the left child.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getLeft() const
@@ -142,7 +356,7 @@ Node<Key, Value>* Node<Key, Value>::getLeft() const
 }
 
 /**
-* An implementation of the virtual function for retreiving the right child.
+* A getter for the right child.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getRight() const
@@ -186,60 +400,206 @@ void Node<Key, Value>::setValue(const Value& value)
     item_.second = value;
 }
 
+/**
+* A setter that moves the new value into the node.
+*/
+template<typename Key, typename Value>
+void Node<Key, Value>::setValue(Value&& value)
+{
+    item_.second = std::move(value);
+}
+
 /*
   ---------------------------------------
   End implementations for the Node class.
   ---------------------------------------
 */
 
+/**
+ * CRTP base for the nodes of a specific kind of tree. Derived is the node
+ * class itself, e.g. class AVLNode : public TypedNode<Key, Value, AVLNode<Key, Value> >.
+ * The getters here hide the Node ones and return Derived pointers, so the
+ * tree code that knows it holds a Derived gets one at compile time.
+ * Every node in such a tree must be a Derived for the casts to be valid.
+ */
+template <typename Key, typename Value, typename Derived>
+class TypedNode : public Node<Key, Value>
+{
+public:
+    TypedNode(const Key& key, const Value& value, Node<Key, Value>* parent) :
+        Node<Key, Value>(key, value, parent)
+    {
+
+    }
+
+    template<typename... ItemArgs>
+    TypedNode(in_place_item_t tag, Node<Key, Value>* parent, ItemArgs&&... item_args) :
+        Node<Key, Value>(tag, parent, std::forward<ItemArgs>(item_args)...)
+    {
+
+    }
+
+    Derived* getParent() const { return static_cast<Derived*>(this->parent_); }
+    Derived* getLeft() const { return static_cast<Derived*>(this->left_); }
+    Derived* getRight() const { return static_cast<Derived*>(this->right_); }
+};
+
 /**
 * A templated unbalanced binary search tree.
+* Compare orders the keys like std::map's, a strict weak ordering called as
+* comp(a, b) for "a goes before b". If it has an is_transparent member type
+* (e.g. std::less<>), find also takes anything comparable with a Key.
+* Alloc is an allocator of std::pair<const Key, Value> that gets rebound
+* to the node type. The default NodePool is not a standard Allocator: its
+* copies share nothing and compare unequal, which is fine here only
+* because a tree never copies its allocator or hands nodes between trees.
 */
-template <typename Key, typename Value>
-class BinarySearchTree
+template <typename Key, typename Value,
+          typename Compare = std::less<Key>,
+          typename Alloc = NodePool<std::pair<const Key, Value> > >
+class BinarySearchTree : protected TreeStatsPolicy
 {
 public:
     BinarySearchTree(); //TODO
+    explicit BinarySearchTree(const Compare& comp);
+    template<typename ForwardIt>
+    BinarySearchTree(ForwardIt first, ForwardIt last, const Compare& comp = Compare());
     virtual ~BinarySearchTree(); //TODO
+    template<typename ForwardIt>
+    void assign(ForwardIt first, ForwardIt last);
+    // merges an unsorted batch (any container of key/value pairs) into the
+    // tree, sorting and relinking on up to threads threads, 0 for one per core
+    template<typename Range>
+    void bulk_insert(const Range& items, unsigned threads = 0);
     virtual void insert(const std::pair<const Key, Value>& keyValuePair); //TODO
+    virtual void insert(std::pair<const Key, Value>&& keyValuePair);
     virtual void remove(const Key& key); //TODO
     void clear(); //TODO
     bool isBalanced() const; //TODO
+    std::string validate() const;
     void print() const;
     bool empty() const;
+    std::size_t size() const;
+    Compare key_comp() const;
+    // counts since the tree was made, all zero unless built with -DBST_STATS
+    TreeStats stats() const;
 
-    template<typename PPKey, typename PPValue>
-    friend void prettyPrintBST(BinarySearchTree<PPKey, PPValue> & tree);
+    template<typename PPKey, typename PPValue, typename PPCompare, typename PPAlloc>
+    friend void prettyPrintBST(BinarySearchTree<PPKey, PPValue, PPCompare, PPAlloc> & tree);
 public:
     /**
     * An internal iterator class for traversing the contents of the BST.
+    * It is bidirectional: -- steps to the in-order predecessor, and
+    * decrementing end() gives the largest item. Item is the pair for
+    * iterator and a const pair for const_iterator, and an iterator
+    * converts to a const_iterator.
     */
-    class iterator  // TODO
+    template<typename Item>
+    class tree_iterator  // TODO
     {
     public:
-        iterator();
-
-        std::pair<const Key,Value>& operator*() const;
-        std::pair<const Key,Value>* operator->() const;
-
-        bool operator==(const iterator& rhs) const;
-        bool operator!=(const iterator& rhs) const;
-
-        iterator& operator++();
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef Item* pointer;
+        typedef Item& reference;
+
+        tree_iterator();
+        template<typename OtherItem, typename = typename std::enable_if<
+                     std::is_convertible<OtherItem*, Item*>::value>::type>
+        tree_iterator(const tree_iterator<OtherItem>& other);
+
+        Item& operator*() const;
+        Item* operator->() const;
+
+        template<typename OtherItem>
+        bool operator==(const tree_iterator<OtherItem>& rhs) const;
+        template<typename OtherItem>
+        bool operator!=(const tree_iterator<OtherItem>& rhs) const;
+
+        tree_iterator& operator++();
+        tree_iterator operator++(int);
+        tree_iterator& operator--();
+        tree_iterator operator--(int);
 
     protected:
-        friend class BinarySearchTree<Key, Value>;
-        iterator(Node<Key,Value>* ptr);
+        friend class BinarySearchTree<Key, Value, Compare, Alloc>;
+        template<typename OtherItem> friend class tree_iterator;
+        tree_iterator(Node<Key,Value>* ptr, const BinarySearchTree<Key, Value, Compare, Alloc>* tree);
         Node<Key, Value>* current_;
+        // only needed to step back from end()
+        const BinarySearchTree<Key, Value, Compare, Alloc>* tree_;
     };
 
+    typedef tree_iterator<std::pair<const Key, Value> > iterator;
+    typedef tree_iterator<const std::pair<const Key, Value> > const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
 public:
-    iterator begin() const;
-    iterator end() const;
-    iterator find(const Key& key) const;
+    iterator begin();
+    const_iterator begin() const;
+    iterator end();
+    const_iterator end() const;
+    const_iterator cbegin() const;
+    const_iterator cend() const;
+    reverse_iterator rbegin();
+    const_reverse_iterator rbegin() const;
+    reverse_iterator rend();
+    const_reverse_iterator rend() const;
+
+    iterator find(const Key& key);
+    const_iterator find(const Key& key) const;
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(const K& key);
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator find(const K& key) const;
+
+    // ordered lookups, each one descent from the root
+    iterator lower_bound(const Key& key);
+    const_iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key);
+    const_iterator upper_bound(const Key& key) const;
+    std::pair<iterator, iterator> equal_range(const Key& key);
+    std::pair<const_iterator, const_iterator> equal_range(const Key& key) const;
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator lower_bound(const K& key);
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator lower_bound(const K& key) const;
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator upper_bound(const K& key);
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator upper_bound(const K& key) const;
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    std::pair<iterator, iterator> equal_range(const K& key);
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    std::pair<const_iterator, const_iterator> equal_range(const K& key) const;
+    template<typename Fn>
+    void for_each_in_range(const Key& lo, const Key& hi, Fn fn);
+    template<typename Fn>
+    void for_each_in_range(const Key& lo, const Key& hi, Fn fn) const;
+
+    // looks up every key in keys (any container of Key), writing one
+    // iterator per key to out in the same order, end() for missing keys
+    template<typename KeyRange, typename OutputIt>
+    void find_batch(const KeyRange& keys, OutputIt out);
+    template<typename KeyRange, typename OutputIt>
+    void find_batch(const KeyRange& keys, OutputIt out) const;
+
     Value& operator[](const Key& key);
     Value const & operator[](const Key& key) const;
 
+    // Unlike insert, these leave an existing key's value alone, like
+    // std::map. They build the new node and fix the tree up through the
+    // virtual createNodeFrom and insertFixup, so they work through a
+    // base reference too; AVLTree's own versions build in place.
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args);
+
 protected:
     // Mandatory helper functions
     Node<Key, Value>* internalFind(const Key& k) const; // TODO
@@ -255,13 +615,54 @@ protected:
     // Add helper functions here
 //    int tree_height(Node<Key, Value>* node);
 
+    // node storage, overridden by trees that use a bigger node type
+    virtual Node<Key, Value>* createNode(const Key& key, const Value& value, Node<Key, Value>* parent);
+    virtual Node<Key, Value>* createNodeFrom(std::pair<Key, Value>&& item, Node<Key, Value>* parent);
+    template<typename... ItemArgs>
+    Node<Key, Value>* constructNode(Node<Key, Value>* parent, ItemArgs&&... item_args);
+    virtual void destroyNode(Node<Key, Value>* node);
+    virtual void destroyAllNodes();
+
+    // insertion helpers shared with derived trees
+    Node<Key, Value>* findInsertPos(const Key& key, Node<Key, Value>*& parent, bool& go_left) const;
+    void linkNode(Node<Key, Value>* node, Node<Key, Value>* parent, bool go_left);
+    virtual void insertFixup(Node<Key, Value>* parent);
+    iterator iteratorAt(Node<Key, Value>* node);
+    const_iterator iteratorAt(Node<Key, Value>* node) const;
+    template<typename K>
+    std::pair<Node<Key, Value>*, Node<Key, Value>*> equal_range_nodes(const K& key) const;
+    template<typename KeyIt, typename Emit>
+    void find_batch_nodes(KeyIt first, KeyIt last, Emit emit) const;
+    template<typename K, typename... Args>
+    std::pair<iterator, bool> try_emplace_helper(K&& key, Args&&... args);
+
+    // bulk loading helpers
+    template<typename ForwardIt>
+    Node<Key, Value>* buildSubtree(ForwardIt& it, std::size_t count, int& height);
+    Node<Key, Value>* linkSubtree(Node<Key, Value>* const* nodes, std::size_t count, int& height, unsigned threads);
+    virtual void setBuiltHeights(Node<Key, Value>* node, int left_height, int right_height);
+
+    // checking helpers
+    std::string checkTree(bool balance_only, bool& balanced) const;
+    virtual std::string checkNode(const Node<Key, Value>* node, int left_height, int right_height) const;
+
 
 public:
     void print_tree() const;
 
 
 protected:
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<Node<Key, Value> > NodeAlloc;
+    typedef std::allocator_traits<NodeAlloc> NodeAllocTraits;
+
+    // the statistics policy is a base rather than a member so that the
+    // empty NoTreeStats of a default build takes no room in the tree
+    const TreeStatsPolicy& treeStats() const { return *this; }
+
     Node<Key, Value>* root_ = nullptr;
+    std::size_t size_ = 0;
+    Compare comp_;
+    NodeAlloc nodeAlloc_;
     // You should not need other data members
 };
 
@@ -271,34 +672,83 @@ Begin implementations for the BinarySearchTree::iterator class.
 ---------------------------------------------------------------
 */
 
+// helper to find successor of current node
+template<typename Key, typename Value>
+Node<Key, Value>* successor(Node<Key, Value>* current) {
+    if (!current) return current;
+
+    // init subtree to use to search
+    Node<Key, Value>* next;
+
+    // left most node of right subtree
+    if (current->getRight()) {
+        next = current->getRight();
+        while (next->getLeft()) {
+            next = next->getLeft();
+        }
+        return next;
+    }
+
+    // otherwise find first ancestor with curr node in left
+    next = current->getParent();
+    while (next && next->getRight() == current) {
+        current = next;
+        next = next->getParent();
+    }
+
+    return next;
+
+}
+
+
 /**
 * Explicit constructor that initializes an iterator with a given node pointer.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator(Node<Key,Value> *ptr)
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+BinarySearchTree<Key, Value, Compare, Alloc>::tree_iterator<Item>::tree_iterator(
+    Node<Key,Value> *ptr, const BinarySearchTree<Key, Value, Compare, Alloc>* tree)
 {
     // TODO
     current_ = ptr;
+    tree_ = tree;
 }
 
 /**
 * A default constructor that initializes the iterator to NULL.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator()
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+BinarySearchTree<Key, Value, Compare, Alloc>::tree_iterator<Item>::tree_iterator()
 {
     // TODO
 
     current_ = nullptr;
+    tree_ = nullptr;
+
+}
+
+/**
+* Converts an iterator to a const_iterator.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+template<typename OtherItem, typename>
+BinarySearchTree<Key, Value, Compare, Alloc>::tree_iterator<Item>::tree_iterator(
+    const tree_iterator<OtherItem>& other) :
+    current_(other.current_),
+    tree_(other.tree_)
+{
 
 }
 
 /**
 * Provides access to the item.
 */
-template<class Key, class Value>
-std::pair<const Key,Value> &
-BinarySearchTree<Key, Value>::iterator::operator*() const
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+Item&
+BinarySearchTree<Key, Value, Compare, Alloc>::tree_iterator<Item>::operator*() const
 {
     return current_->getItem();
 }
@@ -306,9 +756,10 @@ BinarySearchTree<Key, Value>::iterator::operator*() const
 /**
 * Provides access to the address of the item.
 */
-template<class Key, class Value>
-std::pair<const Key,Value> *
-BinarySearchTree<Key, Value>::iterator::operator->() const
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+Item*
+BinarySearchTree<Key, Value, Compare, Alloc>::tree_iterator<Item>::operator->() const
 {
     return &(current_->getItem());
 }
@@ -317,10 +768,12 @@ BinarySearchTree<Key, Value>::iterator::operator->() const
 * Checks if 'this' iterator's internals have the same value
 * as 'rhs'
 */
-template<class Key, class Value>
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+template<typename OtherItem>
 bool
-BinarySearchTree<Key, Value>::iterator::operator==(
-    const BinarySearchTree<Key, Value>::iterator& rhs) const
+BinarySearchTree<Key, Value, Compare, Alloc>::tree_iterator<Item>::operator==(
+    const tree_iterator<OtherItem>& rhs) const
 {
     // TODO
     return current_ == rhs.current_;
@@ -330,56 +783,70 @@ BinarySearchTree<Key, Value>::iterator::operator==(
 * Checks if 'this' iterator's internals have a different value
 * as 'rhs'
 */
-template<class Key, class Value>
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+template<typename OtherItem>
 bool
-BinarySearchTree<Key, Value>::iterator::operator!=(
-    const BinarySearchTree<Key, Value>::iterator& rhs) const
+BinarySearchTree<Key, Value, Compare, Alloc>::tree_iterator<Item>::operator!=(
+    const tree_iterator<OtherItem>& rhs) const
 {
     // TODO
     return current_ != rhs.current_;
 }
 
-// helper to find successor of current node
-template<typename Key, typename Value>
-Node<Key, Value>* successor(Node<Key, Value>* current) {
-    if (!current) return current;
-
-    // init subtree to use to search
-    Node<Key, Value>* next;
-
-    // left most node of right subtree
-    if (current->getRight()) {
-        next = current->getRight();
-        while (next->getLeft()) {
-            next = next->getLeft();
-        }
-        return next;
-    }
-
-    // otherwise find first ancestor with curr node in left
-    next = current->getParent();
-    while (next && next->getRight() == current) {
-        current = next;
-        next = next->getParent();
-    }
-
-    return next;
-
-}
-
-
 /**
 * Advances the iterator's location using an in-order sequencing
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator&
-BinarySearchTree<Key, Value>::iterator::operator++()
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::template tree_iterator<Item>&
+BinarySearchTree<Key, Value, Compare, Alloc>::tree_iterator<Item>::operator++()
 {
     // TODO
     if (current_) current_ = successor(current_);
     return *this;
 }
 
+/**
+* Advances the iterator and returns where it was before
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::template tree_iterator<Item>
+BinarySearchTree<Key, Value, Compare, Alloc>::tree_iterator<Item>::operator++(int)
+{
+    tree_iterator<Item> old = *this;
+    ++*this;
+    return old;
+}
+
+/**
+* Moves the iterator back to the previous item in order. From end()
+* that is the largest item.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::template tree_iterator<Item>&
+BinarySearchTree<Key, Value, Compare, Alloc>::tree_iterator<Item>::operator--()
+{
+    if (current_) current_ = predecessor(current_);
+    else current_ = find_largest(tree_->root_);
+    return *this;
+}
+
+/**
+* Moves the iterator back and returns where it was before
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::template tree_iterator<Item>
+BinarySearchTree<Key, Value, Compare, Alloc>::tree_iterator<Item>::operator--(int)
+{
+    tree_iterator<Item> old = *this;
+    --*this;
+    return old;
+}
+
 
 /*
 -------------------------------------------------------------
@@ -396,143 +863,744 @@ Begin implementations for the BinarySearchTree class.
 /**
 * Default constructor for a BinarySearchTree, which sets the root to NULL.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::BinarySearchTree()
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::BinarySearchTree()
 {
     // TODO
     root_ = nullptr;
 }
 
-template<typename Key, typename Value>
-BinarySearchTree<Key, Value>::~BinarySearchTree()
+/**
+* Constructor for a tree ordered by a given comparison object.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::BinarySearchTree(const Compare& comp) :
+    comp_(comp)
 {
-    // TODO
 
-    this->clear();
 }
 
 /**
- * Returns true if tree is empty
+* Builds a perfectly balanced tree from a range of key/value pairs in
+* linear time, see assign().
 */
-template<class Key, class Value>
-bool BinarySearchTree<Key, Value>::empty() const
+template<class Key, class Value, class Compare, class Alloc>
+template<typename ForwardIt>
+BinarySearchTree<Key, Value, Compare, Alloc>::BinarySearchTree(ForwardIt first, ForwardIt last, const Compare& comp) :
+    comp_(comp)
 {
-    return root_ == NULL;
+    root_ = nullptr;
+    assign(first, last);
 }
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::print() const
+template<typename Key, typename Value, typename Compare, typename Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::~BinarySearchTree()
 {
-    printRoot(root_);
-    std::cout << "\n";
+    // TODO
+
+    this->clear();
 }
 
-/**
-* Returns an iterator to the "smallest" item in the tree
-*/
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::begin() const
+// helper function to drop all but the last of each run of equal keys in
+// items, which is sorted by key, returns how many are left at the front
+template<typename Key, typename Value, typename Compare>
+std::size_t keep_last_of_equal(std::vector<std::pair<Key, Value> >& items, const Compare& comp)
 {
-    BinarySearchTree<Key, Value>::iterator begin(getSmallestNode());
-    return begin;
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < items.size(); i++) {
+        if (i + 1 < items.size() && !comp(items[i].first, items[i + 1].first)) continue;
+        if (kept != i) items[kept] = std::move(items[i]);
+        kept++;
+    }
+    return kept;
 }
 
-/**
-* Returns an iterator whose value means INVALID
-*/
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::end() const
+// helper function to run first on a new thread and second on this one,
+// or both on this one if no thread can be started
+template<typename First, typename Second>
+void run_in_parallel(First first, Second second)
 {
-    BinarySearchTree<Key, Value>::iterator end(NULL);
-    return end;
+    std::thread helper;
+    try {
+        helper = std::thread(first);
+    } catch (const std::system_error&) {
+        first();
+    }
+    try {
+        second();
+    } catch (...) {
+        if (helper.joinable()) helper.join();
+        throw;
+    }
+    if (helper.joinable()) helper.join();
 }
 
-/**
-* Returns an iterator to the item with the given key, k
-* or the end iterator if k does not exist in the tree
-*/
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::find(const Key & k) const
+// helper function for a stable merge sort that sorts the two halves on
+// separate threads until it runs out of threads or the halves get small
+template<typename RandomIt, typename Less>
+void parallel_stable_sort(RandomIt first, RandomIt last, Less less, unsigned threads)
 {
-    Node<Key, Value> *curr = internalFind(k);
-    BinarySearchTree<Key, Value>::iterator it(curr);
-    return it;
+    const std::ptrdiff_t SERIAL_BELOW = 16384;
+    if (threads < 2 || last - first < SERIAL_BELOW) {
+        std::stable_sort(first, last, less);
+        return;
+    }
+
+    RandomIt middle = first + (last - first) / 2;
+    run_in_parallel([=]() { parallel_stable_sort(first, middle, less, threads / 2); },
+                    [=]() { parallel_stable_sort(middle, last, less, threads - threads / 2); });
+    std::inplace_merge(first, middle, last, less);
 }
 
 /**
- * @precondition The key exists in the map
- * Returns the value associated with the key
- */
-template<class Key, class Value>
-Value& BinarySearchTree<Key, Value>::operator[](const Key& key)
-{
-    Node<Key, Value> *curr = internalFind(key);
-    if(curr == NULL) throw std::out_of_range("Invalid key");
-    return curr->getValue();
-}
-template<class Key, class Value>
-Value const & BinarySearchTree<Key, Value>::operator[](const Key& key) const
+* Replaces the contents of the tree with the key/value pairs in [first, last).
+* If the keys are strictly increasing the nodes are built straight from the
+* range, in O(n) and without any rotations. Otherwise the range is copied and
+* sorted first, and for repeated keys the last one wins, same as calling
+* insert on each pair in order.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename ForwardIt>
+void BinarySearchTree<Key, Value, Compare, Alloc>::assign(ForwardIt first, ForwardIt last)
 {
-    Node<Key, Value> *curr = internalFind(key);
-    if(curr == NULL) throw std::out_of_range("Invalid key");
-    return curr->getValue();
-}
-
-template<class Key, class Value>
-Node<Key, Value>* get_leaf(Node<Key, Value>* root) {
-    if (root == nullptr) return nullptr;
+    clear();
+
+    // strictly increasing means no sort and no duplicates to drop
+    bool sorted = true;
+    std::size_t count = 0;
+    for (ForwardIt prev = first, it = first; it != last; prev = it, ++it, ++count) {
+        if (it != first && !comp_(prev->first, it->first)) {
+            sorted = false;
+            break;
+        }
+    }
 
-    // check children
-    if (root->getLeft() == nullptr && root->getRight() == nullptr) {
-        return root;
-    } else if (root->getLeft() == nullptr) {
-        return get_leaf(root->getRight());
-    } else {
-        return get_leaf(root->getLeft());
+    int height;
+    if (sorted) {
+        root_ = buildSubtree(first, count, height);
+        return;
     }
-}
 
-// helper function to recursively traverse to insert a node
-template<class Key, class Value>
-void insert_node(Node<Key, Value>* parent, Node<Key, Value>* n) {
-    if (!parent) return;
+    // sort by key, stable so equal keys stay in input order
+    std::vector<std::pair<Key, Value> > items(first, last);
+    std::stable_sort(items.begin(), items.end(),
+                     [this](const std::pair<Key, Value>& a, const std::pair<Key, Value>& b) {
+                         return comp_(a.first, b.first);
+                     });
 
-    // over write if exists
-    if (parent->getKey() == n->getKey()) {
-        parent->setValue(n->getValue());
-        delete n;  // newly allocated node not needed anymore
-    }
+    std::size_t kept = keep_last_of_equal(items, comp_);
+    typename std::vector<std::pair<Key, Value> >::const_iterator it = items.begin();
+    root_ = buildSubtree(it, kept, height);
+}
 
-    // check left if inserted val is less than curr node
-    else if (n->getKey() < parent->getKey()) {
-        if (parent->getLeft()) {
-            return insert_node(parent->getLeft(), n);
-        } else {
-            parent->setLeft(n);
-            n->setParent(parent);
+/**
+* Inserts every key/value pair in items, same as calling insert on each in
+* order (the last of repeated keys wins), but in O(n + m log m) for m
+* items into n instead of O(m log(n + m)). The batch is sorted in
+* parallel, merged with the nodes already in the tree, and the merged
+* nodes are relinked into a perfectly balanced tree with the subtrees
+* built in parallel. Existing nodes are reused, so iterators stay valid.
+* Only the nodes for new keys are allocated, on this thread, since the
+* allocator is not thread safe.
+* A batch too small to pay for touching every node is inserted one by one.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Range>
+void BinarySearchTree<Key, Value, Compare, Alloc>::bulk_insert(const Range& items, unsigned threads)
+{
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // a batch this small against the tree goes in one insert at a time,
+    // straight from items without copying it first
+    std::size_t depth = 1;
+    while (size_ >> depth) depth++;
+    std::size_t count = std::distance(std::begin(items), std::end(items));
+    if (count * depth < size_) {
+        for (auto it = std::begin(items); it != std::end(items); ++it) {
+            const std::pair<const Key, Value>& item = *it;
+            insert(item);
         }
+        return;
     }
-
-    // check right if inserted val is greater than curr node
-    else if (n->getKey() > parent->getKey()) {
-        if (parent->getRight()) {
-            return insert_node(parent->getRight(), n);
-        } else {
-            parent->setRight(n);
-            n->setParent(parent);
-        }
+    std::vector<std::pair<Key, Value> > batch(std::begin(items), std::end(items));
+
+    // sort by key, stable so equal keys stay in input order
+    parallel_stable_sort(batch.begin(), batch.end(),
+                         [this](const std::pair<Key, Value>& a, const std::pair<Key, Value>& b) {
+                             return comp_(a.first, b.first);
+                         }, threads);
+    std::size_t kept = keep_last_of_equal(batch, comp_);
+
+    // the existing nodes in order
+    std::vector<Node<Key, Value>*> existing;
+    existing.reserve(size_);
+    std::vector<Node<Key, Value>*> stack;
+    for (Node<Key, Value>* node = root_; node || !stack.empty(); node = node->getRight()) {
+        for (; node; node = node->getLeft()) stack.push_back(node);
+        node = stack.back();
+        stack.pop_back();
+        existing.push_back(node);
     }
 
-    // Update the height of the current node after insertion
-    int left_height = (parent->getLeft()) ? parent->getLeft()->get_height() : 0;
-    int right_height = (parent->getRight()) ? parent->getRight()->get_height() : 0;
-    parent->set_height(1 + std::max(left_height, right_height));
+    // merge, reusing the node of every key already there
+    std::vector<Node<Key, Value>*> merged;
+    merged.reserve(existing.size() + kept);
+    std::vector<Node<Key, Value>*> created;
+    try {
+        std::size_t i = 0;
+        std::size_t j = 0;
+        while (i < existing.size() || j < kept) {
+            if (j == kept || (i < existing.size() && comp_(existing[i]->getKey(), batch[j].first))) {
+                merged.push_back(existing[i++]);
+            } else if (i == existing.size() || comp_(batch[j].first, existing[i]->getKey())) {
+                created.push_back(createNode(batch[j].first, batch[j].second, nullptr));
+                merged.push_back(created.back());
+                j++;
+            } else {
+                existing[i]->setValue(std::move(batch[j].second));
+                merged.push_back(existing[i++]);
+                j++;
+            }
+        }
+    } catch (...) {
+        // nothing is relinked yet, so the tree is still whole without them
+        for (std::size_t k = 0; k < created.size(); k++) destroyNode(created[k]);
+        throw;
+    }
+
+    int height;
+    root_ = linkSubtree(merged.data(), merged.size(), height, threads);
+    if (root_) root_->setParent(nullptr);
+}
+
+/**
+* Relinks count nodes, already in key order, into a balanced subtree the
+* same shape buildSubtree makes, and sets height to its height. The two
+* halves of big subtrees are linked on separate threads, each with half of
+* the threads left. The returned root's parent is left alone.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::linkSubtree(
+    Node<Key, Value>* const* nodes, std::size_t count, int& height, unsigned threads)
+{
+    const std::size_t SERIAL_BELOW = 16384;
+    if (count == 0) {
+        height = 0;
+        return nullptr;
+    }
+
+    std::size_t left_count = count / 2;
+    Node<Key, Value>* node = nodes[left_count];
+    int left_height, right_height;
+    Node<Key, Value>* left;
+    Node<Key, Value>* right;
+    if (threads > 1 && count >= SERIAL_BELOW) {
+        run_in_parallel([&]() { left = linkSubtree(nodes, left_count, left_height, threads / 2); },
+                        [&]() { right = linkSubtree(nodes + left_count + 1, count - left_count - 1,
+                                                    right_height, threads - threads / 2); });
+    } else {
+        left = linkSubtree(nodes, left_count, left_height, 1);
+        right = linkSubtree(nodes + left_count + 1, count - left_count - 1, right_height, 1);
+    }
+
+    node->setLeft(left);
+    if (left) left->setParent(node);
+    node->setRight(right);
+    if (right) right->setParent(node);
+
+    setBuiltHeights(node, left_height, right_height);
+    height = 1 + std::max(left_height, right_height);
+    return node;
+}
+
+/**
+* Builds a balanced subtree out of the next count items, consuming them in
+* order: left half, then this node, then right half. Sets height to the
+* height of the new subtree. The returned root has no parent yet.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename ForwardIt>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::buildSubtree(ForwardIt& it, std::size_t count, int& height)
+{
+    if (count == 0) {
+        height = 0;
+        return nullptr;
+    }
+
+    // the left side gets the extra item, so no node ever leans right
+    int left_height, right_height;
+    std::size_t left_count = count / 2;
+    Node<Key, Value>* left = buildSubtree(it, left_count, left_height);
+
+    Node<Key, Value>* node = createNode(it->first, it->second, nullptr);
+    ++it;
+
+    Node<Key, Value>* right = buildSubtree(it, count - left_count - 1, right_height);
+
+    node->setLeft(left);
+    if (left) left->setParent(node);
+    node->setRight(right);
+    if (right) right->setParent(node);
+
+    setBuiltHeights(node, left_height, right_height);
+    height = 1 + std::max(left_height, right_height);
+    return node;
+}
+
+/**
+* Records the height of a bulk loaded node, trees that keep more per-node
+* balancing state fill it in here too.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::setBuiltHeights(Node<Key, Value>* node, int left_height, int right_height)
+{
+    node->set_height(1 + std::max(left_height, right_height));
+}
+
+/**
+ * Returns true if tree is empty
+*/
+template<class Key, class Value, class Compare, class Alloc>
+bool BinarySearchTree<Key, Value, Compare, Alloc>::empty() const
+{
+    return root_ == NULL;
+}
+
+/**
+ * Returns the number of items in the tree
+*/
+template<class Key, class Value, class Compare, class Alloc>
+std::size_t BinarySearchTree<Key, Value, Compare, Alloc>::size() const
+{
+    return size_;
+}
+
+/**
+ * Returns a copy of the object that orders the keys
+*/
+template<class Key, class Value, class Compare, class Alloc>
+Compare BinarySearchTree<Key, Value, Compare, Alloc>::key_comp() const
+{
+    return comp_;
+}
+
+/**
+ * Returns what the tree has counted so far. Safe to call from another
+ * thread while the tree is in use; the fields are read one at a time,
+ * so a snapshot taken mid-operation may be off by that operation.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+TreeStats BinarySearchTree<Key, Value, Compare, Alloc>::stats() const
+{
+    return treeStats().snapshot();
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::print() const
+{
+    printRoot(root_);
+    std::cout << "\n";
+}
+
+/**
+* Returns an iterator to the "smallest" item in the tree
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::begin()
+{
+    return iterator(getSmallestNode(), this);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::begin() const
+{
+    return const_iterator(getSmallestNode(), this);
+}
+
+/**
+* Returns an iterator whose value means INVALID
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::end()
+{
+    return iterator(NULL, this);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::end() const
+{
+    return const_iterator(NULL, this);
+}
+
+/**
+* begin() and end() as const_iterators even on a non-const tree
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::cbegin() const
+{
+    return begin();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::cend() const
+{
+    return end();
+}
+
+/**
+* Reverse iterators, from the largest item down to the smallest
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::reverse_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::rbegin()
+{
+    return reverse_iterator(end());
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_reverse_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::rbegin() const
+{
+    return const_reverse_iterator(end());
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::reverse_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::rend()
+{
+    return reverse_iterator(begin());
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_reverse_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::rend() const
+{
+    return const_reverse_iterator(begin());
+}
+
+/**
+* Returns an iterator to the item with the given key, k
+* or the end iterator if k does not exist in the tree
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::find(const Key & k)
+{
+    return iterator(internalFind(k), this);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::find(const Key & k) const
+{
+    return const_iterator(internalFind(k), this);
+}
+
+/**
+* Heterogeneous find, only there when Compare is transparent. Looks up
+* anything Compare can compare with a Key without building a Key from it.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::find(const K& k)
+{
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_FINDS, STAT_FIND_VISITS);
+    return iterator(find_node(k, root_, treeStats().count(comp_), treeStats()), this);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::find(const K& k) const
+{
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_FINDS, STAT_FIND_VISITS);
+    return const_iterator(find_node(k, root_, treeStats().count(comp_), treeStats()), this);
+}
+
+/**
+* Returns an iterator to the first item whose key is not less than key,
+* or the end iterator if there is none
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::lower_bound(const Key& key)
+{
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_FINDS, STAT_FIND_VISITS);
+    return iterator(lower_bound_node(key, root_, treeStats().count(comp_), treeStats()), this);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::lower_bound(const Key& key) const
+{
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_FINDS, STAT_FIND_VISITS);
+    return const_iterator(lower_bound_node(key, root_, treeStats().count(comp_), treeStats()), this);
+}
+
+/**
+* Returns an iterator to the first item whose key is greater than key,
+* or the end iterator if there is none
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::upper_bound(const Key& key)
+{
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_FINDS, STAT_FIND_VISITS);
+    return iterator(upper_bound_node(key, root_, treeStats().count(comp_), treeStats()), this);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::upper_bound(const Key& key) const
+{
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_FINDS, STAT_FIND_VISITS);
+    return const_iterator(upper_bound_node(key, root_, treeStats().count(comp_), treeStats()), this);
+}
+
+/**
+* Returns the range of items with the given key, which holds one item
+* at most since keys are unique. Both ends are empty if there is none.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator,
+          typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator>
+BinarySearchTree<Key, Value, Compare, Alloc>::equal_range(const Key& key)
+{
+    std::pair<Node<Key, Value>*, Node<Key, Value>*> range = equal_range_nodes(key);
+    return std::make_pair(iterator(range.first, this), iterator(range.second, this));
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator,
+          typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator>
+BinarySearchTree<Key, Value, Compare, Alloc>::equal_range(const Key& key) const
+{
+    std::pair<Node<Key, Value>*, Node<Key, Value>*> range = equal_range_nodes(key);
+    return std::make_pair(const_iterator(range.first, this), const_iterator(range.second, this));
+}
+
+/**
+* Heterogeneous versions of the three above, only there when Compare is
+* transparent.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::lower_bound(const K& key)
+{
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_FINDS, STAT_FIND_VISITS);
+    return iterator(lower_bound_node(key, root_, treeStats().count(comp_), treeStats()), this);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::lower_bound(const K& key) const
+{
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_FINDS, STAT_FIND_VISITS);
+    return const_iterator(lower_bound_node(key, root_, treeStats().count(comp_), treeStats()), this);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::upper_bound(const K& key)
+{
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_FINDS, STAT_FIND_VISITS);
+    return iterator(upper_bound_node(key, root_, treeStats().count(comp_), treeStats()), this);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::upper_bound(const K& key) const
+{
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_FINDS, STAT_FIND_VISITS);
+    return const_iterator(upper_bound_node(key, root_, treeStats().count(comp_), treeStats()), this);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename K, typename C, typename>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator,
+          typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator>
+BinarySearchTree<Key, Value, Compare, Alloc>::equal_range(const K& key)
+{
+    std::pair<Node<Key, Value>*, Node<Key, Value>*> range = equal_range_nodes(key);
+    return std::make_pair(iterator(range.first, this), iterator(range.second, this));
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename K, typename C, typename>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator,
+          typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator>
+BinarySearchTree<Key, Value, Compare, Alloc>::equal_range(const K& key) const
+{
+    std::pair<Node<Key, Value>*, Node<Key, Value>*> range = equal_range_nodes(key);
+    return std::make_pair(const_iterator(range.first, this), const_iterator(range.second, this));
+}
+
+/**
+* The nodes bounding the items equal to key, for both equal_ranges
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename K>
+std::pair<Node<Key, Value>*, Node<Key, Value>*>
+BinarySearchTree<Key, Value, Compare, Alloc>::equal_range_nodes(const K& key) const
+{
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_FINDS, STAT_FIND_VISITS);
+    Node<Key, Value>* first = lower_bound_node(key, root_, treeStats().count(comp_), treeStats());
+    Node<Key, Value>* last = first;
+    if (first != nullptr && !treeStats().count(comp_)(key, first->getKey())) last = successor(first);
+    return std::make_pair(first, last);
+}
+
+/**
+* Calls fn on every item with lo <= key < hi, in order. Finds lo in one
+* descent and then steps with successor, so it costs O(log n + items).
+* fn gets a std::pair<const Key, Value>& and may change the value, but
+* must not insert into or remove from the tree.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Fn>
+void BinarySearchTree<Key, Value, Compare, Alloc>::for_each_in_range(const Key& lo, const Key& hi, Fn fn)
+{
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_FINDS, STAT_FIND_VISITS);
+    for (Node<Key, Value>* node = lower_bound_node(lo, root_, treeStats().count(comp_), treeStats());
+         node != nullptr && treeStats().count(comp_)(node->getKey(), hi); node = successor(node)) {
+        fn(node->getItem());
+    }
+}
+
+/**
+* Same as above, but fn only gets a const item
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Fn>
+void BinarySearchTree<Key, Value, Compare, Alloc>::for_each_in_range(const Key& lo, const Key& hi, Fn fn) const
+{
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_FINDS, STAT_FIND_VISITS);
+    for (Node<Key, Value>* node = lower_bound_node(lo, root_, treeStats().count(comp_), treeStats());
+         node != nullptr && treeStats().count(comp_)(node->getKey(), hi); node = successor(node)) {
+        const std::pair<const Key, Value>& item = node->getItem();
+        fn(item);
+    }
+}
+
+/**
+* Looks up a batch of keys faster than calling find on each. Every find
+* is a chain of cache misses, one per level, each waiting on the last;
+* this runs up to FIND_BATCH_LANES of them in lockstep, one level at a
+* time, and prefetches each lane's next node so those misses overlap.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename KeyRange, typename OutputIt>
+void BinarySearchTree<Key, Value, Compare, Alloc>::find_batch(const KeyRange& keys, OutputIt out)
+{
+    find_batch_nodes(std::begin(keys), std::end(keys),
+                     [this, &out](Node<Key, Value>* node) { *out++ = iterator(node, this); });
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename KeyRange, typename OutputIt>
+void BinarySearchTree<Key, Value, Compare, Alloc>::find_batch(const KeyRange& keys, OutputIt out) const
+{
+    find_batch_nodes(std::begin(keys), std::end(keys),
+                     [this, &out](Node<Key, Value>* node) { *out++ = const_iterator(node, this); });
+}
+
+/**
+* Does the batched descent for both find_batches, calling emit with each
+* key's node (or null) in key order. Each lane does the same one
+* comparison per level as find_node.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename KeyIt, typename Emit>
+void BinarySearchTree<Key, Value, Compare, Alloc>::find_batch_nodes(KeyIt first, KeyIt last, Emit emit) const
+{
+    // enough lookups in flight to cover memory latency, few enough
+    // that the lanes stay in registers and L1
+    const std::size_t FIND_BATCH_LANES = 16;
+    const Key* lane_key[FIND_BATCH_LANES];
+    Node<Key, Value>* lane_node[FIND_BATCH_LANES];
+    Node<Key, Value>* lane_not_less[FIND_BATCH_LANES];
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_FINDS, STAT_FIND_VISITS, 0);
+
+    while (first != last) {
+        std::size_t lanes = 0;
+        for (; lanes < FIND_BATCH_LANES && first != last; ++lanes, ++first) {
+            lane_key[lanes] = &*first;
+            lane_node[lanes] = root_;
+            lane_not_less[lanes] = nullptr;
+        }
+
+        // step every unfinished lane down one level until all reach the bottom
+        bool descending = true;
+        while (descending) {
+            descending = false;
+            for (std::size_t i = 0; i < lanes; i++) {
+                Node<Key, Value>* node = lane_node[i];
+                if (node == nullptr) continue;
+                treeStats().visit();
+                if (treeStats().count(comp_)(node->getKey(), *lane_key[i])) {
+                    node = node->getRight();
+                } else {
+                    lane_not_less[i] = node;
+                    node = node->getLeft();
+                }
+                if (node != nullptr) {
+                    BST_PREFETCH(node);
+                    descending = true;
+                }
+                lane_node[i] = node;
+            }
+        }
+
+        for (std::size_t i = 0; i < lanes; i++) {
+            Node<Key, Value>* found = lane_not_less[i];
+            if (found != nullptr && treeStats().count(comp_)(*lane_key[i], found->getKey())) found = nullptr;
+            op.add();
+            emit(found);
+        }
+    }
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template<class Key, class Value, class Compare, class Alloc>
+Value& BinarySearchTree<Key, Value, Compare, Alloc>::operator[](const Key& key)
+{
+    Node<Key, Value> *curr = internalFind(key);
+    if(curr == NULL) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+template<class Key, class Value, class Compare, class Alloc>
+Value const & BinarySearchTree<Key, Value, Compare, Alloc>::operator[](const Key& key) const
+{
+    Node<Key, Value> *curr = internalFind(key);
+    if(curr == NULL) throw std::out_of_range("Invalid key");
+    return curr->getValue();
 }
 
+template<class Key, class Value>
+Node<Key, Value>* get_leaf(Node<Key, Value>* root) {
+    if (root == nullptr) return nullptr;
 
+    // keep stepping down, preferring the left child, until no children
+    while (root->getLeft() != nullptr || root->getRight() != nullptr) {
+        if (root->getLeft() == nullptr) root = root->getRight();
+        else root = root->getLeft();
+    }
+    return root;
+}
 
 /**
 * An insert method to insert into a Binary Search Tree.
@@ -540,23 +1608,188 @@ void insert_node(Node<Key, Value>* parent, Node<Key, Value>* n) {
 * Recall: If key is already in the tree, you should
 * overwrite the current value with the updated value.
 */
-template<class Key, class Value>
-void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &keyValuePair)
+template<class Key, class Value, class Compare, class Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::insert(const std::pair<const Key, Value> &keyValuePair)
 {
     // TODO
 
+    // single descent: overwrite in place, or remember the leaf to attach under
+    Node<Key, Value>* parent;
+    bool go_left;
+    Node<Key, Value>* curr = findInsertPos(keyValuePair.first, parent, go_left);
+    if (curr != nullptr) {
+        curr->setValue(keyValuePair.second);
+        return;
+    }
+
     // convert pair into a node
-    Node<Key, Value>* node = new Node<Key, Value>(keyValuePair.first, keyValuePair.second, nullptr);
+    linkNode(createNode(keyValuePair.first, keyValuePair.second, parent), parent, go_left);
+}
+
+/**
+* Same as insert above, but moves the value out of keyValuePair
+* instead of copying it. The key is const in the pair so it is copied.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::insert(std::pair<const Key, Value>&& keyValuePair)
+{
+    Node<Key, Value>* parent;
+    bool go_left;
+    Node<Key, Value>* curr = findInsertPos(keyValuePair.first, parent, go_left);
+    if (curr != nullptr) {
+        curr->setValue(std::move(keyValuePair.second));
+        return;
+    }
+    linkNode(constructNode(parent, std::move(keyValuePair)), parent, go_left);
+}
+
+/**
+* Builds the item from args, the way std::pair<const Key, Value> would,
+* and inserts it if its key is not in the tree yet. Otherwise the item is
+* thrown away and the tree is left as it was. The item is built as a
+* std::pair<Key, Value> first, so the key is known before any node is,
+* and then moved into a node of the tree's own type by createNodeFrom.
+* Returns an iterator to the item with that key and whether it was inserted.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::emplace(Args&&... args)
+{
+    std::pair<Key, Value> item(std::forward<Args>(args)...);
+
+    Node<Key, Value>* parent;
+    bool go_left;
+    Node<Key, Value>* curr = findInsertPos(item.first, parent, go_left);
+    if (curr != nullptr) return std::make_pair(iterator(curr, this), false);
+
+    Node<Key, Value>* node = createNodeFrom(std::move(item), parent);
+    linkNode(node, parent, go_left);
+    insertFixup(parent);
+    return std::make_pair(iterator(node, this), true);
+}
+
+/**
+* Inserts an item with the given key and a value built from args, only
+* if the key is not in the tree yet. When it is, nothing is built and
+* args are left untouched.
+* Returns an iterator to the item with that key and whether it was inserted.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::try_emplace(const Key& key, Args&&... args)
+{
+    return try_emplace_helper(key, std::forward<Args>(args)...);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::try_emplace(Key&& key, Args&&... args)
+{
+    return try_emplace_helper(std::move(key), std::forward<Args>(args)...);
+}
+
+/**
+* Both try_emplaces, key is a const Key& or a Key&&.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename K, typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::try_emplace_helper(K&& key, Args&&... args)
+{
+    Node<Key, Value>* parent;
+    bool go_left;
+    Node<Key, Value>* curr = findInsertPos(key, parent, go_left);
+    if (curr != nullptr) return std::make_pair(iterator(curr, this), false);
+
+    Node<Key, Value>* node = createNodeFrom(
+        std::pair<Key, Value>(std::piecewise_construct, std::forward_as_tuple(std::forward<K>(key)),
+                              std::forward_as_tuple(std::forward<Args>(args)...)),
+        parent);
+    linkNode(node, parent, go_left);
+    insertFixup(parent);
+    return std::make_pair(iterator(node, this), true);
+}
+
+/**
+* Descends from the root looking for key. Returns its node if it is in the
+* tree, otherwise returns null with parent and go_left set to where a node
+* for key would be attached (parent is null if the tree is empty).
+* Always walks down to a leaf so it compares only once per level.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::findInsertPos(
+    const Key& key, Node<Key, Value>*& parent, bool& go_left) const
+{
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_INSERTS, STAT_INSERT_VISITS);
+    const auto& comp = treeStats().count(comp_);
+
+    // one comparison per level; the last node we went right from is the
+    // greatest key <= key, so it holds key if anything does
+    parent = nullptr;
+    go_left = false;
+    Node<Key, Value>* not_greater = nullptr;
+    Node<Key, Value>* curr = root_;
+    while (curr != nullptr) {
+        parent = curr;
+        treeStats().visit();
+        go_left = comp(key, curr->getKey());
+        if (go_left) {
+            curr = curr->getLeft();
+        } else {
+            not_greater = curr;
+            curr = curr->getRight();
+        }
+    }
+    if (not_greater != nullptr && !comp(not_greater->getKey(), key)) return not_greater;
+    return nullptr;
+}
 
+/**
+* Hangs a new node under parent on the side findInsertPos picked,
+* or makes it the root if parent is null.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::linkNode(
+    Node<Key, Value>* node, Node<Key, Value>* parent, bool go_left)
+{
     // make a new node if root is null
-    if (this->root_ == nullptr) {
+    if (parent == nullptr) {
         root_ = node;
         return;
     }
 
-    // overwrite if parent equals value
-    insert_node(root_, node);
+    if (go_left) parent->setLeft(node);
+    else parent->setRight(node);
+}
+
+/**
+* Called after a new node was linked under parent (null for a new root),
+* for trees that rebalance. A plain tree has nothing to do.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::insertFixup(Node<Key, Value>*)
+{
+
+}
+
+/**
+* Lets derived trees hand out iterators to their nodes.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::iteratorAt(Node<Key, Value>* node)
+{
+    return iterator(node, this);
+}
 
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::iteratorAt(Node<Key, Value>* node) const
+{
+    return const_iterator(node, this);
 }
 
 
@@ -566,10 +1799,11 @@ void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &key
 * Recall: The writeup specifies that if a node has 2 children you
 * should swap with the predecessor and then remove.
 */
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::remove(const Key& key)
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::remove(const Key& key)
 {
     // TODO
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_REMOVES, STAT_REMOVE_VISITS);
 
     // first find node
     Node<Key, Value>* node = internalFind(key);
@@ -583,14 +1817,8 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
             Node<Key, Value>* parent = node->getParent();
             if (parent->getRight() == node) parent->setRight(nullptr);
             else parent->setLeft(nullptr);
-
-            // Update the height of the current node after removal
-            int left_height = (parent->getLeft()) ? parent->getLeft()->get_height() : 0;
-            int right_height = (parent->getRight()) ? parent->getRight()->get_height() : 0;
-            parent->set_height(1 + std::max(left_height, right_height));
-
         }
-        delete node;
+        destroyNode(node);
 
     } else if (node->getRight() == nullptr || node->getLeft() == nullptr) {  // only one child
         Node<Key, Value>* child;
@@ -614,7 +1842,7 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
             // update child parent pointer
             child->setParent(parent);
         }
-        delete node;
+        destroyNode(node);
 
     } else {  // swap with predecessor
         Node<Key, Value>* pred = predecessor(node);
@@ -638,7 +1866,7 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
 
         // update child pointer and delete node
         if (child) child->setParent(parent);
-        delete node;
+        destroyNode(node);
 
     }
 
@@ -647,19 +1875,18 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
 
 // helper to get node farthest right in subtree
 template<typename Key, typename Value>
-Node<Key, Value>* recursive_find_largest(Node<Key, Value>* parent) {
+Node<Key, Value>* find_largest(Node<Key, Value>* parent) {
     if (parent == nullptr) return nullptr;
 
-    // base case check if left child is null (assuming lowest on left)
-    if (parent->getRight() == nullptr) return parent;
-
-    return recursive_find_largest(parent->getRight());
+    // largest is always down the right spine
+    while (parent->getRight() != nullptr) parent = parent->getRight();
+    return parent;
 }
 
 
-template<class Key, class Value>
+template<class Key, class Value, class Compare, class Alloc>
 Node<Key, Value>*
-BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
+BinarySearchTree<Key, Value, Compare, Alloc>::predecessor(Node<Key, Value>* current)
 {
     // TODO
 
@@ -668,7 +1895,7 @@ BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
 
     // case 1: left subtree exists
     if (current->getLeft()) {
-        return recursive_find_largest(current->getLeft());
+        return find_largest(current->getLeft());
     }
 
     // case 2: no left subtree, move up to find predecessor
@@ -687,20 +1914,32 @@ BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
 }
 
 
-// helper function to recursively delete nodes
-template<typename Key, typename Value>
-void recursive_clear(Node<Key, Value>* parent) {
+// helper function to delete every node in a subtree without recursing,
+// uses the parent pointers to climb back up after deleting each leaf
+template<typename Key, typename Value, typename Deleter>
+void clear_nodes(Node<Key, Value>* parent, Deleter destroy) {
     // check if parent is null
     if (parent == nullptr) return;
 
-    // head recursion to find leaf nodes
-    recursive_clear(parent->getLeft());
-    recursive_clear(parent->getRight());
-
-    // delete after recursing
-    delete parent;
-
-
+    Node<Key, Value>* stop = parent->getParent();
+    Node<Key, Value>* curr = parent;
+    while (curr != stop) {
+        // walk down until we reach a leaf
+        if (curr->getLeft()) {
+            curr = curr->getLeft();
+        } else if (curr->getRight()) {
+            curr = curr->getRight();
+        } else {
+            // unlink the leaf from its parent, then delete it
+            Node<Key, Value>* up = curr->getParent();
+            if (up != stop) {
+                if (up->getLeft() == curr) up->setLeft(nullptr);
+                else up->setRight(nullptr);
+            }
+            destroy(curr);
+            curr = up;
+        }
+    }
 }
 
 
@@ -708,64 +1947,158 @@ void recursive_clear(Node<Key, Value>* parent) {
 * A method to remove all contents of the tree and
 * reset the values in the tree for use again.
 */
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::clear()
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::clear()
 {
     // TODO
 
-    recursive_clear(root_);  // call helper function to recursively clear
+    destroyAllNodes();  // hand every node back to the allocator
 
     // set root to nullptr
     root_ = nullptr;
+    size_ = 0;
+
+}
+
+/**
+* Allocates and constructs a node from the tree's allocator.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::createNode(
+    const Key& key, const Value& value, Node<Key, Value>* parent)
+{
+    return constructNode(parent, key, value);
+}
+
+/**
+* Allocates a node and moves item into it, for the base emplace and
+* try_emplace, which can't pick the node type themselves.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::createNodeFrom(
+    std::pair<Key, Value>&& item, Node<Key, Value>* parent)
+{
+    return constructNode(parent, std::move(item.first), std::move(item.second));
+}
+
+/**
+* Allocates a node and builds its item in place from item_args.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename... ItemArgs>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::constructNode(
+    Node<Key, Value>* parent, ItemArgs&&... item_args)
+{
+    Node<Key, Value>* node = NodeAllocTraits::allocate(nodeAlloc_, 1);
+    try {
+        NodeAllocTraits::construct(nodeAlloc_, node, in_place_item_t(), parent,
+                                   std::forward<ItemArgs>(item_args)...);
+    } catch (...) {
+        NodeAllocTraits::deallocate(nodeAlloc_, node, 1);
+        throw;
+    }
+    treeStats().add(STAT_ALLOCATIONS);
+    size_++;
+    return node;
+}
+
+/**
+* Destroys a single node and hands its storage back to the allocator.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::destroyNode(Node<Key, Value>* node)
+{
+    NodeAllocTraits::destroy(nodeAlloc_, node);
+    NodeAllocTraits::deallocate(nodeAlloc_, node, 1);
+    treeStats().add(STAT_DEALLOCATIONS);
+    size_--;
+}
 
+/**
+* Frees every node in the tree. If the allocator can drop everything it
+* handed out and the items need no destructor, that is done in one go
+* without visiting the nodes at all.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::destroyAllNodes()
+{
+    if (!std::is_trivially_destructible<std::pair<const Key, Value> >::value ||
+        !release_all(nodeAlloc_)) {
+        clear_nodes(root_, [this](Node<Key, Value>* n) { this->destroyNode(n); });
+    } else {
+        treeStats().add(STAT_DEALLOCATIONS, size_);
+    }
 }
 
 template<typename Key, typename Value>
-Node<Key, Value>* recursive_find_smallest(Node<Key, Value>* parent) {
+Node<Key, Value>* find_smallest(Node<Key, Value>* parent) {
     if (parent == nullptr) return nullptr;
 
-    // base case check if left child is null (assuming lowest on left)
-    if (parent->getLeft() == nullptr) return parent;
-
-    return recursive_find_smallest(parent->getLeft());
+    // smallest is always down the left spine
+    while (parent->getLeft() != nullptr) parent = parent->getLeft();
+    return parent;
 }
 
 
 /**
 * A helper function to find the smallest node in the tree.
 */
-template<typename Key, typename Value>
+template<typename Key, typename Value, typename Compare, typename Alloc>
 Node<Key, Value>*
-BinarySearchTree<Key, Value>::getSmallestNode() const
+BinarySearchTree<Key, Value, Compare, Alloc>::getSmallestNode() const
 {
     // TODO
 
     // if root is null, return
-    return recursive_find_smallest(root_);
+    return find_smallest(root_);
 
 }
 
-// helper function to recursively find node based on key
-template<typename Key, typename Value>
-Node<Key, Value>* recursive_find(const Key& key, Node<Key, Value>* parent) {
-    // return if no parent
-    if (parent == nullptr) return nullptr;
-
-    // check if parent has correct val
-    if (parent->getKey() == key) {
-        return parent;
-    }
-
-    // search left subtree if value less than parent
-    if (key < parent->getKey()) {
-        return recursive_find(key, parent->getLeft());
+// helper function to find the first node whose key is not less than key,
+// or null if there is none; stats counts the nodes looked at
+template<typename K, typename Key, typename Value, typename Compare, typename Stats = NoTreeStats>
+Node<Key, Value>* lower_bound_node(const K& key, Node<Key, Value>* parent, const Compare& comp,
+                                   const Stats& stats = Stats()) {
+    Node<Key, Value>* not_less = nullptr;
+    while (parent != nullptr) {
+        stats.visit();
+        if (comp(parent->getKey(), key)) {
+            parent = parent->getRight();
+        } else {
+            not_less = parent;
+            parent = parent->getLeft();
+        }
     }
+    return not_less;
+}
 
-    // search right subtree if value greater than parent
-    if (key > parent->getKey()) {
-        return recursive_find(key, parent->getRight());
+// helper function to find the first node whose key is greater than key,
+// or null if there is none; stats counts the nodes looked at
+template<typename K, typename Key, typename Value, typename Compare, typename Stats = NoTreeStats>
+Node<Key, Value>* upper_bound_node(const K& key, Node<Key, Value>* parent, const Compare& comp,
+                                   const Stats& stats = Stats()) {
+    Node<Key, Value>* greater = nullptr;
+    while (parent != nullptr) {
+        stats.visit();
+        if (comp(key, parent->getKey())) {
+            greater = parent;
+            parent = parent->getLeft();
+        } else {
+            parent = parent->getRight();
+        }
     }
+    return greater;
+}
 
+// helper function to walk down from parent to the node with key, doing one
+// comparison per level: find the smallest node not less than key, and
+// only at the bottom check whether it is actually equal
+template<typename K, typename Key, typename Value, typename Compare, typename Stats = NoTreeStats>
+Node<Key, Value>* find_node(const K& key, Node<Key, Value>* parent, const Compare& comp,
+                            const Stats& stats = Stats()) {
+    Node<Key, Value>* not_less = lower_bound_node(key, parent, comp, stats);
+    if (not_less != nullptr && !comp(key, not_less->getKey())) return not_less;
+    return nullptr;
 }
 
 /**
@@ -773,93 +2106,241 @@ Node<Key, Value>* recursive_find(const Key& key, Node<Key, Value>* parent) {
 * return a pointer to it or NULL if no item with that key
 * exists
 */
-template<typename Key, typename Value>
-Node<Key, Value>* BinarySearchTree<Key, Value>::internalFind(const Key& key) const
+template<typename Key, typename Value, typename Compare, typename Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::internalFind(const Key& key) const
 {
     // TODO
 
     // base case if root i
-    Node<Key, Value>* n = recursive_find(key, root_);  // use helper to recurse tree
+    typename TreeStatsPolicy::Operation op(treeStats(), STAT_FINDS, STAT_FIND_VISITS);
+    Node<Key, Value>* n = find_node(key, root_, treeStats().count(comp_), treeStats());  // use helper to walk the tree
     return n;
 
 }
 
+// helper to visit every node of a subtree in pre-order along with its depth
+// (the subtree root has depth 0). Climbs back up with the parent pointers
+// instead of recursing, so degenerate trees can't overflow the stack.
+template<typename Key, typename Value, typename Visitor>
+void walk_preorder(Node<Key, Value>* node, Visitor visit) {
+    if (!node) return;
+
+    Node<Key, Value>* stop = node->getParent();
+    Node<Key, Value>* prev = stop;
+    int depth = 0;
+    while (node != stop) {
+        Node<Key, Value>* next;
+        if (prev == node->getParent()) {
+            // first time here, coming down from the parent
+            visit(node, depth);
+            if (node->getLeft()) next = node->getLeft();
+            else if (node->getRight()) next = node->getRight();
+            else next = node->getParent();
+        } else if (prev == node->getLeft() && node->getRight()) {
+            // finished the left subtree, go do the right one
+            next = node->getRight();
+        } else {
+            // finished both subtrees
+            next = node->getParent();
+        }
+
+        depth += (next == node->getParent()) ? -1 : 1;
+        prev = node;
+        node = next;
+    }
+}
+
 // helper function to calculate height of subtree
 template<typename Key, typename Value>
 int tree_height(Node<Key, Value>* node) {
-    if (!node) {
-        return 0;
-    }
+    // height is one more than the deepest depth reached
+    int height = 0;
+    walk_preorder(node, [&height](Node<Key, Value>*, int depth) {
+        if (depth + 1 > height) height = depth + 1;
+    });
+    return height;
+}
 
-    // calc height of left and right sub trees
-    int l_height = tree_height(node->getLeft());
-    int r_height = tree_height(node->getRight());
 
-    // return max height + 1
-    if (l_height > r_height) {
-        return l_height + 1;
-    }
-    return r_height + 1;
+/**
+ * Names a node by its key in validate() messages when the key is a
+ * number or a string, keys of other types just get "a node".
+ */
+template<typename Key>
+typename std::enable_if<std::is_arithmetic<Key>::value, std::string>::type
+describe_key(const Key& key)
+{
+    return "node " + std::to_string(key);
+}
 
+template<typename Key>
+typename std::enable_if<!std::is_arithmetic<Key>::value &&
+                        std::is_convertible<const Key&, std::string>::value, std::string>::type
+describe_key(const Key& key)
+{
+    return "node " + std::string(key);
 }
 
+template<typename Key>
+typename std::enable_if<!std::is_arithmetic<Key>::value &&
+                        !std::is_convertible<const Key&, std::string>::value, std::string>::type
+describe_key(const Key&)
+{
+    return "a node";
+}
 
-// helper function to recursively check if is balanced
-template<typename Key, typename Value>
-bool is_balanced_helper(Node<Key, Value>* node) {
-    // null root is balanced
-    if (!node) return true;
+/**
+ * One post-order pass over the whole tree. Sets balanced to whether the
+ * subtree heights of every node differ by at most one, and returns a
+ * description of the first broken invariant, or "" if there is none:
+ * parent back-pointers, strictly increasing keys in order, whatever
+ * checkNode() checks for each node, and the node count against size().
+ * With balance_only set it skips the rest and stops at the first
+ * unbalanced node.
+ *
+ * Walks with an explicit stack and the child pointers only, so a broken
+ * parent pointer can't send it astray and deep trees can't overflow.
+ */
+template<typename Key, typename Value, typename Compare, typename Alloc>
+std::string BinarySearchTree<Key, Value, Compare, Alloc>::checkTree(bool balance_only, bool& balanced) const
+{
+    balanced = true;
+    if (!root_) return size_ == 0 ? "" : "tree is empty but size() is " + std::to_string(size_);
+    if (!balance_only && root_->getParent() != nullptr) return "root has a parent";
+
+    // stage 0: just arrived, 1: left subtree done, 2: both subtrees done
+    struct Frame {
+        Node<Key, Value>* node;
+        int stage;
+        int left_height;
+    };
+    std::vector<Frame> stack;
+    stack.push_back(Frame{root_, 0, 0});
+
+    const Node<Key, Value>* prev = nullptr;
+    std::size_t count = 0;
+    int height = 0;  // height of the subtree finished last
+    while (!stack.empty()) {
+        Frame& frame = stack.back();
+        Node<Key, Value>* node = frame.node;
+
+        if (frame.stage == 0) {
+            frame.stage = 1;
+            Node<Key, Value>* left = node->getLeft();
+            if (left) {
+                if (!balance_only && left->getParent() != node) {
+                    return describe_key(node->getKey()) + ": left child's parent pointer is wrong";
+                }
+                stack.push_back(Frame{left, 0, 0});
+                continue;
+            }
+            height = 0;
+        }
+
+        if (frame.stage == 1) {
+            frame.stage = 2;
+            frame.left_height = height;
+
+            // in-order visit
+            if (!balance_only) {
+                if (prev && !comp_(prev->getKey(), node->getKey())) {
+                    return describe_key(node->getKey()) + ": key is not greater than the key before it";
+                }
+                prev = node;
+                if (++count > size_) {
+                    return "tree has more nodes than size() says (" + std::to_string(size_) + ")";
+                }
+            }
+
+            Node<Key, Value>* right = node->getRight();
+            if (right) {
+                if (!balance_only && right->getParent() != node) {
+                    return describe_key(node->getKey()) + ": right child's parent pointer is wrong";
+                }
+                stack.push_back(Frame{right, 0, 0});
+                continue;
+            }
+            height = 0;
+        }
+
+        // both subtree heights known
+        int left_height = frame.left_height;
+        int right_height = height;
+        if (std::abs(left_height - right_height) > 1) {
+            balanced = false;
+            if (balance_only) return "";
+        }
+        if (!balance_only) {
+            std::string problem = checkNode(node, left_height, right_height);
+            if (!problem.empty()) return describe_key(node->getKey()) + ": " + problem;
+        }
 
-    // get heights of root sub trees
-    int l_height = tree_height(node->getLeft());
-    int r_height = tree_height(node->getRight());
+        height = 1 + std::max(left_height, right_height);
+        stack.pop_back();
+    }
 
-    // get diff by subtracting larger from smaller
-    int diff = std::abs(r_height - l_height);
-    if (diff > 1) return false;
+    if (!balance_only && count != size_) {
+        return "tree has " + std::to_string(count) + " nodes but size() is " + std::to_string(size_);
+    }
+    return "";
+}
 
-    return is_balanced_helper(node->getLeft()) && is_balanced_helper(node->getRight());
+/**
+ * Per-node invariants on top of the BST ones. A plain BST keeps nothing else.
+ */
+template<typename Key, typename Value, typename Compare, typename Alloc>
+std::string BinarySearchTree<Key, Value, Compare, Alloc>::checkNode(const Node<Key, Value>*, int, int) const
+{
+    return "";
 }
 
 
 /**
  * Return true iff the BST is balanced.
  */
-template<typename Key, typename Value>
-bool BinarySearchTree<Key, Value>::isBalanced() const
+template<typename Key, typename Value, typename Compare, typename Alloc>
+bool BinarySearchTree<Key, Value, Compare, Alloc>::isBalanced() const
 {
     // TODO
 
-    // use recursive helper function to determine if tree is balanced
-    return is_balanced_helper(root_);
+    // single post-order pass that stops at the first unbalanced node
+    bool balanced;
+    checkTree(true, balanced);
+    return balanced;
 }
 
-template<typename Key, typename Value>
-void recursive_print(Node<Key, Value>* n, int depth) {
-    if (!n) return;
-
-    for (size_t i = 0; i < depth; i++) {
-        std::cout << " ";
-    }
-    std::cout << n->getValue() << std::endl;
-
-    recursive_print(n->getLeft(), depth + 1);
-    recursive_print(n->getRight(), depth + 1);
+/**
+ * Checks every structural invariant of the tree in one pass, returns a
+ * description of the first violation found or an empty string if the
+ * tree is consistent.
+ */
+template<typename Key, typename Value, typename Compare, typename Alloc>
+std::string BinarySearchTree<Key, Value, Compare, Alloc>::validate() const
+{
+    bool balanced;
+    return checkTree(false, balanced);
 }
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::print_tree() const {
-    recursive_print(root_, 0);
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::print_tree() const {
+    // indent each value by its depth
+    walk_preorder(root_, [](Node<Key, Value>* n, int depth) {
+        for (int i = 0; i < depth; i++) {
+            std::cout << " ";
+        }
+        std::cout << n->getValue() << std::endl;
+    });
 }
 
 
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2)
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2)
 {
     if((n1 == n2) || (n1 == NULL) || (n2 == NULL) ) {
         return;
     }
+    treeStats().add(STAT_NODE_SWAPS);
     Node<Key, Value>* n1p = n1->getParent();
     Node<Key, Value>* n1r = n1->getRight();
     Node<Key, Value>* n1lt = n1->getLeft();
@@ -0,0 +1,1069 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <iostream>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <iterator>
+#include <tuple>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/**
+* Finds where key goes among the sorted keys[0, n) of a B-tree node:
+* returns how many of them are less than key. Any Key and Compare work
+* with the default, a binary search. For signed integer keys with
+* std::less, the specializations below compare key against the whole
+* node with SIMD instead.
+*/
+template<typename Key, typename Compare, int N, typename Enable = void>
+struct btree_node_search
+{
+    static int rank(const Key* keys, int n, const Key& key, const Compare& comp)
+    {
+        return static_cast<int>(std::lower_bound(keys, keys + n, key, comp) - keys);
+    }
+};
+
+#if defined(__SSE2__)
+
+// keeps only the lanes for the node's first n keys
+inline int btree_count_mask(uint64_t mask, int n)
+{
+    if (n < 64) mask &= (uint64_t(1) << n) - 1;
+    return __builtin_popcountll(mask);
+}
+
+/**
+* SIMD rank for 32-bit keys: one compare per 8 (AVX2) or 4 (SSE2) keys,
+* over all N slots, so the loop has a fixed length and no branches on
+* the data. The movemask bits of the lanes below key are collected into
+* one mask, and the slots past n are masked off before counting (they
+* hold stale keys, but are never uninitialized since nodes are value
+* initialized).
+*/
+template<typename Key, int N>
+struct btree_node_search<Key, std::less<Key>, N,
+    typename std::enable_if<std::is_integral<Key>::value && std::is_signed<Key>::value &&
+                            sizeof(Key) == 4>::type>
+{
+    static int rank(const Key* keys, int n, const Key& key, const std::less<Key>&)
+    {
+        uint64_t mask = 0;
+#if defined(__AVX2__)
+        const __m256i target = _mm256_set1_epi32(key);
+        for (int i = 0; i < N; i += 8) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+            __m256i less = _mm256_cmpgt_epi32(target, block);
+            mask |= uint64_t(uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(less)))) << i;
+        }
+#else
+        const __m128i target = _mm_set1_epi32(key);
+        for (int i = 0; i < N; i += 4) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+            __m128i less = _mm_cmpgt_epi32(target, block);
+            mask |= uint64_t(uint32_t(_mm_movemask_ps(_mm_castsi128_ps(less)))) << i;
+        }
+#endif
+        return btree_count_mask(mask, n);
+    }
+};
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+/**
+* SIMD rank for 64-bit keys, same as above. The 64-bit compare needs
+* SSE4.2, so without it these keys use the binary search.
+*/
+template<typename Key, int N>
+struct btree_node_search<Key, std::less<Key>, N,
+    typename std::enable_if<std::is_integral<Key>::value && std::is_signed<Key>::value &&
+                            sizeof(Key) == 8>::type>
+{
+    static int rank(const Key* keys, int n, const Key& key, const std::less<Key>&)
+    {
+        uint64_t mask = 0;
+#if defined(__AVX2__)
+        const __m256i target = _mm256_set1_epi64x(key);
+        for (int i = 0; i < N; i += 4) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+            __m256i less = _mm256_cmpgt_epi64(target, block);
+            mask |= uint64_t(uint32_t(_mm256_movemask_pd(_mm256_castsi256_pd(less)))) << i;
+        }
+#else
+        const __m128i target = _mm_set1_epi64x(key);
+        for (int i = 0; i < N; i += 2) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+            __m128i less = _mm_cmpgt_epi64(target, block);
+            mask |= uint64_t(uint32_t(_mm_movemask_pd(_mm_castsi128_pd(less)))) << i;
+        }
+#endif
+        return btree_count_mask(mask, n);
+    }
+};
+#endif
+
+#endif
+
+/**
+* An ordered map stored as a B+ tree with up to NodeKeys keys per node,
+* for when one cache miss per level of a binary tree is too much: a
+* node's keys sit together in one array, and a tree of 10^7 keys is
+* about 5 levels deep instead of about 30.
+*
+* All entries live in the leaves, which are linked in key order for the
+* iterators. Inner nodes only hold separator keys: every key under
+* children[i] is <= keys[i], and every key under children[i + 1] is
+* greater. So searching an inner node and a leaf is the same question,
+* how many keys are less than the target (see btree_node_search).
+*
+* It offers the same operations as BinarySearchTree (insert overwrites,
+* remove, find, operator[] throws on a missing key) so the two can be
+* swapped in code templated on the tree type, including the rvalue
+* insert, emplace and try_emplace, and const_iterator for const trees.
+* The differences: Key and Value must be default constructible and
+* movable, and the iterators give out a pair of references, since keys
+* and values are stored in separate arrays. Insert and remove invalidate
+* iterators.
+*/
+template <typename Key, typename Value,
+          typename Compare = std::less<Key>,
+          int NodeKeys = 32>
+class BTreeMap
+{
+    static_assert(NodeKeys >= 8 && NodeKeys <= 64 && NodeKeys % 8 == 0,
+                  "NodeKeys must be a multiple of 8 up to 64");
+
+protected:
+    // a leaf or inner node, told apart by leaf; nodes are value
+    // initialized, so the SIMD search never reads garbage past count
+    struct NodeBase {
+        int count;
+        bool leaf;
+        Key keys[NodeKeys];
+    };
+    struct Leaf : NodeBase {
+        Value values[NodeKeys];
+        Leaf* prev;
+        Leaf* next;
+    };
+    struct Inner : NodeBase {
+        NodeBase* children[NodeKeys + 1];
+    };
+
+public:
+    BTreeMap();
+    explicit BTreeMap(const Compare& comp);
+    ~BTreeMap();
+
+    void remove(const Key& key);
+    void clear();
+    template<typename ForwardIt>
+    void assign(ForwardIt first, ForwardIt last);
+    bool empty() const;
+    std::size_t size() const;
+    std::string validate() const;
+    Compare key_comp() const;
+
+    /**
+    * Bidirectional iterator over the entries in key order. ItemValue is
+    * Value for iterator and const Value for const_iterator, and an
+    * iterator converts to a const_iterator.
+    */
+    template<typename ItemValue>
+    class tree_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key&, ItemValue&> reference;
+
+        // operator-> needs something to point at, the pair of references
+        struct pointer
+        {
+            reference ref;
+            reference* operator->() { return &ref; }
+        };
+
+        tree_iterator();
+        template<typename OtherValue, typename = typename std::enable_if<
+                     std::is_convertible<OtherValue*, ItemValue*>::value>::type>
+        tree_iterator(const tree_iterator<OtherValue>& other);
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        template<typename OtherValue>
+        bool operator==(const tree_iterator<OtherValue>& rhs) const;
+        template<typename OtherValue>
+        bool operator!=(const tree_iterator<OtherValue>& rhs) const;
+
+        tree_iterator& operator++();
+        tree_iterator operator++(int);
+        tree_iterator& operator--();
+        tree_iterator operator--(int);
+
+    protected:
+        friend class BTreeMap<Key, Value, Compare, NodeKeys>;
+        template<typename OtherValue> friend class tree_iterator;
+        tree_iterator(const BTreeMap<Key, Value, Compare, NodeKeys>* tree, Leaf* leaf, int index);
+        const BTreeMap<Key, Value, Compare, NodeKeys>* tree_;
+        Leaf* leaf_;  // null at the end
+        int index_;
+    };
+
+    typedef tree_iterator<Value> iterator;
+    typedef tree_iterator<const Value> const_iterator;
+
+    void insert(const std::pair<const Key, Value>& new_item);
+    void insert(std::pair<const Key, Value>&& new_item);
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args);
+
+    iterator begin();
+    const_iterator begin() const;
+    iterator end();
+    const_iterator end() const;
+    const_iterator cbegin() const;
+    const_iterator cend() const;
+    iterator find(const Key& key);
+    const_iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key);
+    const_iterator lower_bound(const Key& key) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+protected:
+    // a node fixed up before remove descends into it keeps more than MIN
+    // keys, so it can lose one; splits leave at least MIN in each half
+    static const int MIN = NodeKeys / 2 - 1;
+
+    int rank(const NodeBase* node, const Key& key) const;
+    Leaf* findLeaf(const Key& key, int& index) const;
+    Leaf* findInsertLeaf(const Key& key, int& index, bool& found);
+    template<typename K, typename V>
+    iterator placeAt(Leaf* leaf, int index, K&& key, V&& value);
+    template<typename K, typename... Args>
+    std::pair<iterator, bool> try_emplace_helper(K&& key, Args&&... args);
+    Leaf* lowerBoundLeaf(const Key& key, int& index) const;
+    Leaf* firstLeaf() const;
+    Leaf* lastLeaf() const;
+    Leaf* newLeaf();
+    Inner* newInner();
+    void splitChild(Inner* parent, int i);
+    void fixChild(Inner* parent, int i);
+    void mergeChildren(Inner* parent, int i);
+    void destroy(NodeBase* node);
+    std::string checkNode(const NodeBase* node, const Key* low, const Key* high,
+                          int depth, int& leaf_depth, std::size_t& count) const;
+
+    NodeBase* root_;
+    std::size_t size_;
+    Compare comp_;
+
+private:
+    // whole tree copies aren't supported
+    BTreeMap(const BTreeMap&);
+    BTreeMap& operator=(const BTreeMap&);
+};
+
+/*
+-----------------------------------------------------------
+Begin implementations for the BTreeMap::iterator class.
+-----------------------------------------------------------
+*/
+
+/**
+* A default constructor that initializes the iterator to the end.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename ItemValue>
+BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>::tree_iterator() :
+    tree_(nullptr), leaf_(nullptr), index_(0)
+{
+
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename ItemValue>
+BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>::tree_iterator(
+    const BTreeMap<Key, Value, Compare, NodeKeys>* tree, Leaf* leaf, int index) :
+    tree_(tree), leaf_(leaf), index_(index)
+{
+
+}
+
+/**
+* Converts an iterator to a const_iterator.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename ItemValue>
+template<typename OtherValue, typename>
+BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>::tree_iterator(const tree_iterator<OtherValue>& other) :
+    tree_(other.tree_), leaf_(other.leaf_), index_(other.index_)
+{
+
+}
+
+/**
+* The key and value of the current entry.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename ItemValue>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>::reference
+BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>::operator*() const
+{
+    return reference(leaf_->keys[index_], leaf_->values[index_]);
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename ItemValue>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>::pointer
+BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>::operator->() const
+{
+    pointer p = { **this };
+    return p;
+}
+
+/**
+* Two iterators are equal when they are at the same entry, or both at the end.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename ItemValue>
+template<typename OtherValue>
+bool BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>::operator==(const tree_iterator<OtherValue>& rhs) const
+{
+    return leaf_ == rhs.leaf_ && index_ == rhs.index_;
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename ItemValue>
+template<typename OtherValue>
+bool BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>::operator!=(const tree_iterator<OtherValue>& rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+* Moves to the next entry, stepping to the next leaf after a leaf's last one.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename ItemValue>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>&
+BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>::operator++()
+{
+    if (++index_ == leaf_->count) {
+        leaf_ = leaf_->next;
+        index_ = 0;
+    }
+    return *this;
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename ItemValue>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>
+BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>::operator++(int)
+{
+    tree_iterator old = *this;
+    ++*this;
+    return old;
+}
+
+/**
+* Moves to the previous entry. Decrementing end() gives the last entry.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename ItemValue>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>&
+BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>::operator--()
+{
+    if (leaf_ == nullptr) {
+        leaf_ = tree_->lastLeaf();
+        index_ = leaf_->count - 1;
+    } else if (index_ == 0) {
+        leaf_ = leaf_->prev;
+        index_ = leaf_->count - 1;
+    } else {
+        index_--;
+    }
+    return *this;
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename ItemValue>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>
+BTreeMap<Key, Value, Compare, NodeKeys>::tree_iterator<ItemValue>::operator--(int)
+{
+    tree_iterator old = *this;
+    --*this;
+    return old;
+}
+
+/*
+---------------------------------------------------------
+End implementations for the BTreeMap::iterator class.
+---------------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare, int NodeKeys>
+BTreeMap<Key, Value, Compare, NodeKeys>::BTreeMap() :
+    root_(nullptr), size_(0), comp_()
+{
+
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+BTreeMap<Key, Value, Compare, NodeKeys>::BTreeMap(const Compare& comp) :
+    root_(nullptr), size_(0), comp_(comp)
+{
+
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+BTreeMap<Key, Value, Compare, NodeKeys>::~BTreeMap()
+{
+    clear();
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+void BTreeMap<Key, Value, Compare, NodeKeys>::clear()
+{
+    destroy(root_);
+    root_ = nullptr;
+    size_ = 0;
+}
+
+/**
+* Replaces the contents with the key/value pairs in [first, last). For
+* repeated keys the last one wins, same as calling insert on each pair.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename ForwardIt>
+void BTreeMap<Key, Value, Compare, NodeKeys>::assign(ForwardIt first, ForwardIt last)
+{
+    clear();
+    for (; first != last; ++first) insert(std::pair<const Key, Value>(first->first, first->second));
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+bool BTreeMap<Key, Value, Compare, NodeKeys>::empty() const
+{
+    return size_ == 0;
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+std::size_t BTreeMap<Key, Value, Compare, NodeKeys>::size() const
+{
+    return size_;
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+Compare BTreeMap<Key, Value, Compare, NodeKeys>::key_comp() const
+{
+    return comp_;
+}
+
+/**
+* Inserts new_item, or overwrites the value if the key is already there.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+void BTreeMap<Key, Value, Compare, NodeKeys>::insert(const std::pair<const Key, Value>& new_item)
+{
+    int i;
+    bool found;
+    Leaf* leaf = findInsertLeaf(new_item.first, i, found);
+    if (found) leaf->values[i] = new_item.second;
+    else placeAt(leaf, i, new_item.first, new_item.second);
+}
+
+/**
+* Same as insert above, but moves the value out of new_item instead of
+* copying it. The key is const in the pair so it is copied.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+void BTreeMap<Key, Value, Compare, NodeKeys>::insert(std::pair<const Key, Value>&& new_item)
+{
+    int i;
+    bool found;
+    Leaf* leaf = findInsertLeaf(new_item.first, i, found);
+    if (found) leaf->values[i] = std::move(new_item.second);
+    else placeAt(leaf, i, new_item.first, std::move(new_item.second));
+}
+
+/**
+* Builds the entry from args, the way std::pair<Key, Value> would, and
+* inserts it if its key is not in the tree yet; otherwise the tree is
+* left as it was. Returns an iterator to the entry with that key and
+* whether it was inserted.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename... Args>
+std::pair<typename BTreeMap<Key, Value, Compare, NodeKeys>::iterator, bool>
+BTreeMap<Key, Value, Compare, NodeKeys>::emplace(Args&&... args)
+{
+    // the key isn't known until the item is built
+    std::pair<Key, Value> item(std::forward<Args>(args)...);
+    int i;
+    bool found;
+    Leaf* leaf = findInsertLeaf(item.first, i, found);
+    if (found) return std::make_pair(iterator(this, leaf, i), false);
+    return std::make_pair(placeAt(leaf, i, std::move(item.first), std::move(item.second)), true);
+}
+
+/**
+* Inserts an entry with the given key and a value built from args, only
+* if the key is not in the tree yet. When it is, nothing is built and
+* args are left untouched.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename... Args>
+std::pair<typename BTreeMap<Key, Value, Compare, NodeKeys>::iterator, bool>
+BTreeMap<Key, Value, Compare, NodeKeys>::try_emplace(const Key& key, Args&&... args)
+{
+    return try_emplace_helper(key, std::forward<Args>(args)...);
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename... Args>
+std::pair<typename BTreeMap<Key, Value, Compare, NodeKeys>::iterator, bool>
+BTreeMap<Key, Value, Compare, NodeKeys>::try_emplace(Key&& key, Args&&... args)
+{
+    return try_emplace_helper(std::move(key), std::forward<Args>(args)...);
+}
+
+/**
+* Both try_emplaces, key is a const Key& or a Key&&.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename K, typename... Args>
+std::pair<typename BTreeMap<Key, Value, Compare, NodeKeys>::iterator, bool>
+BTreeMap<Key, Value, Compare, NodeKeys>::try_emplace_helper(K&& key, Args&&... args)
+{
+    int i;
+    bool found;
+    Leaf* leaf = findInsertLeaf(key, i, found);
+    if (found) return std::make_pair(iterator(this, leaf, i), false);
+    return std::make_pair(placeAt(leaf, i, std::forward<K>(key), Value(std::forward<Args>(args)...)), true);
+}
+
+/**
+* Descends to the leaf for key and returns it, with index set to key's
+* slot in it and found to whether key is already there.
+*
+* Full nodes are split on the way down, before stepping into them, so
+* there is always room in the parent for the separator a split pushes up,
+* the leaf has room for one more key, and an insert never has to walk
+* back up.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::Leaf*
+BTreeMap<Key, Value, Compare, NodeKeys>::findInsertLeaf(const Key& key, int& index, bool& found)
+{
+    if (root_ == nullptr) root_ = newLeaf();
+    if (root_->count == NodeKeys) {
+        Inner* root = newInner();
+        root->children[0] = root_;
+        root_ = root;
+        splitChild(root, 0);
+    }
+
+    NodeBase* node = root_;
+    while (!node->leaf) {
+        Inner* inner = static_cast<Inner*>(node);
+        int i = rank(inner, key);
+        if (inner->children[i]->count == NodeKeys) {
+            splitChild(inner, i);
+            if (comp_(inner->keys[i], key)) i++;
+        }
+        node = inner->children[i];
+    }
+
+    Leaf* leaf = static_cast<Leaf*>(node);
+    index = rank(leaf, key);
+    found = index < leaf->count && !comp_(key, leaf->keys[index]);
+    return leaf;
+}
+
+// helper to put a new entry into slot index of a leaf findInsertLeaf returned
+template<class Key, class Value, class Compare, int NodeKeys>
+template<typename K, typename V>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::iterator
+BTreeMap<Key, Value, Compare, NodeKeys>::placeAt(Leaf* leaf, int index, K&& key, V&& value)
+{
+    std::move_backward(leaf->keys + index, leaf->keys + leaf->count, leaf->keys + leaf->count + 1);
+    std::move_backward(leaf->values + index, leaf->values + leaf->count, leaf->values + leaf->count + 1);
+    leaf->keys[index] = std::forward<K>(key);
+    leaf->values[index] = std::forward<V>(value);
+    leaf->count++;
+    size_++;
+    return iterator(this, leaf, index);
+}
+
+/**
+* Removes key if it is there.
+*
+* Like insert, this fixes nodes on the way down: a child with only MIN
+* keys borrows one from a sibling or is merged with it before remove
+* steps into it, so taking a key out of the leaf never leaves a node
+* too small.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+void BTreeMap<Key, Value, Compare, NodeKeys>::remove(const Key& key)
+{
+    if (root_ == nullptr) return;
+
+    NodeBase* node = root_;
+    while (!node->leaf) {
+        Inner* inner = static_cast<Inner*>(node);
+        int i = rank(inner, key);
+        if (inner->children[i]->count <= MIN) {
+            fixChild(inner, i);
+            i = rank(inner, key);
+        }
+        node = inner->children[i];
+
+        // a merge can take the root's last separator
+        if (inner == root_ && inner->count == 0) {
+            root_ = node;
+            delete inner;
+        }
+    }
+
+    Leaf* leaf = static_cast<Leaf*>(node);
+    int i = rank(leaf, key);
+    if (i == leaf->count || comp_(key, leaf->keys[i])) return;
+    std::move(leaf->keys + i + 1, leaf->keys + leaf->count, leaf->keys + i);
+    std::move(leaf->values + i + 1, leaf->values + leaf->count, leaf->values + i);
+    leaf->count--;
+    size_--;
+
+    if (size_ == 0) {
+        delete leaf;
+        root_ = nullptr;
+    }
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::iterator
+BTreeMap<Key, Value, Compare, NodeKeys>::begin()
+{
+    return iterator(this, firstLeaf(), 0);
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::const_iterator
+BTreeMap<Key, Value, Compare, NodeKeys>::begin() const
+{
+    return const_iterator(this, firstLeaf(), 0);
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::iterator
+BTreeMap<Key, Value, Compare, NodeKeys>::end()
+{
+    return iterator(this, nullptr, 0);
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::const_iterator
+BTreeMap<Key, Value, Compare, NodeKeys>::end() const
+{
+    return const_iterator(this, nullptr, 0);
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::const_iterator
+BTreeMap<Key, Value, Compare, NodeKeys>::cbegin() const
+{
+    return begin();
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::const_iterator
+BTreeMap<Key, Value, Compare, NodeKeys>::cend() const
+{
+    return end();
+}
+
+/**
+* Returns an iterator to the entry with key, or end() if there is none.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::iterator
+BTreeMap<Key, Value, Compare, NodeKeys>::find(const Key& key)
+{
+    int i;
+    Leaf* leaf = findLeaf(key, i);
+    if (leaf == nullptr || i == leaf->count || comp_(key, leaf->keys[i])) return end();
+    return iterator(this, leaf, i);
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::const_iterator
+BTreeMap<Key, Value, Compare, NodeKeys>::find(const Key& key) const
+{
+    int i;
+    Leaf* leaf = findLeaf(key, i);
+    if (leaf == nullptr || i == leaf->count || comp_(key, leaf->keys[i])) return end();
+    return const_iterator(this, leaf, i);
+}
+
+/**
+* Returns an iterator to the first entry whose key is not less than key.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::iterator
+BTreeMap<Key, Value, Compare, NodeKeys>::lower_bound(const Key& key)
+{
+    int i;
+    Leaf* leaf = lowerBoundLeaf(key, i);
+    return iterator(this, leaf, i);
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::const_iterator
+BTreeMap<Key, Value, Compare, NodeKeys>::lower_bound(const Key& key) const
+{
+    int i;
+    Leaf* leaf = lowerBoundLeaf(key, i);
+    return const_iterator(this, leaf, i);
+}
+
+// helper for lower_bound, the leaf and slot of the first key not less
+// than key, or a null leaf at the end
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::Leaf*
+BTreeMap<Key, Value, Compare, NodeKeys>::lowerBoundLeaf(const Key& key, int& index) const
+{
+    Leaf* leaf = findLeaf(key, index);
+    if (leaf == nullptr) {
+        index = 0;
+        return nullptr;
+    }
+    // key is past the end of this leaf, so the answer starts the next one
+    if (index == leaf->count) {
+        index = 0;
+        return leaf->next;
+    }
+    return leaf;
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+Value& BTreeMap<Key, Value, Compare, NodeKeys>::operator[](const Key& key)
+{
+    iterator it = find(key);
+    if (it == end()) throw std::out_of_range("Invalid key");
+    return it->second;
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+Value const & BTreeMap<Key, Value, Compare, NodeKeys>::operator[](const Key& key) const
+{
+    const_iterator it = find(key);
+    if (it == end()) throw std::out_of_range("Invalid key");
+    return it->second;
+}
+
+/**
+* Checks every B+ tree invariant and returns a description of the first
+* broken one, or an empty string if the tree is valid. Same role as
+* BinarySearchTree::validate, for tests.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+std::string BTreeMap<Key, Value, Compare, NodeKeys>::validate() const
+{
+    if (root_ == nullptr) return size_ == 0 ? "" : "empty tree with a nonzero size";
+
+    int leaf_depth = -1;
+    std::size_t count = 0;
+    std::string error = checkNode(root_, nullptr, nullptr, 0, leaf_depth, count);
+    if (!error.empty()) return error;
+    if (count != size_) return "size does not match the number of keys";
+
+    // the leaf chain has to visit the same keys in order, both ways
+    std::size_t forward = 0;
+    Leaf* prev = nullptr;
+    for (Leaf* leaf = firstLeaf(); leaf != nullptr; leaf = leaf->next) {
+        if (leaf->prev != prev) return "leaf has a wrong prev link";
+        if (prev != nullptr && !comp_(prev->keys[prev->count - 1], leaf->keys[0])) {
+            return "leaf chain out of order";
+        }
+        forward += leaf->count;
+        prev = leaf;
+    }
+    if (prev != lastLeaf()) return "leaf chain does not end at the last leaf";
+    if (forward != size_) return "leaf chain misses keys";
+    return "";
+}
+
+/*
+-----------------------------------------------------------
+Begin helper functions for the BTreeMap class.
+-----------------------------------------------------------
+*/
+
+// how many keys in node are less than key
+template<class Key, class Value, class Compare, int NodeKeys>
+int BTreeMap<Key, Value, Compare, NodeKeys>::rank(const NodeBase* node, const Key& key) const
+{
+    return btree_node_search<Key, Compare, NodeKeys>::rank(node->keys, node->count, key, comp_);
+}
+
+// the leaf where key is or would go, with its slot in index
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::Leaf*
+BTreeMap<Key, Value, Compare, NodeKeys>::findLeaf(const Key& key, int& index) const
+{
+    NodeBase* node = root_;
+    if (node == nullptr) return nullptr;
+    while (!node->leaf) node = static_cast<Inner*>(node)->children[rank(node, key)];
+    index = rank(node, key);
+    return static_cast<Leaf*>(node);
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::Leaf*
+BTreeMap<Key, Value, Compare, NodeKeys>::firstLeaf() const
+{
+    NodeBase* node = root_;
+    if (node == nullptr) return nullptr;
+    while (!node->leaf) node = static_cast<Inner*>(node)->children[0];
+    return static_cast<Leaf*>(node);
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::Leaf*
+BTreeMap<Key, Value, Compare, NodeKeys>::lastLeaf() const
+{
+    NodeBase* node = root_;
+    if (node == nullptr) return nullptr;
+    while (!node->leaf) node = static_cast<Inner*>(node)->children[node->count];
+    return static_cast<Leaf*>(node);
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::Leaf*
+BTreeMap<Key, Value, Compare, NodeKeys>::newLeaf()
+{
+    Leaf* leaf = new Leaf();
+    leaf->leaf = true;
+    return leaf;
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+typename BTreeMap<Key, Value, Compare, NodeKeys>::Inner*
+BTreeMap<Key, Value, Compare, NodeKeys>::newInner()
+{
+    Inner* inner = new Inner();
+    inner->leaf = false;
+    return inner;
+}
+
+/**
+* Splits the full child i of parent in two and adds the separator to
+* parent, which must not be full. A leaf keeps a copy of its largest key
+* as the separator; an inner node moves its middle key up.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+void BTreeMap<Key, Value, Compare, NodeKeys>::splitChild(Inner* parent, int i)
+{
+    NodeBase* child = parent->children[i];
+    NodeBase* right;
+    const int half = NodeKeys / 2;
+
+    if (child->leaf) {
+        Leaf* left_leaf = static_cast<Leaf*>(child);
+        Leaf* right_leaf = newLeaf();
+        std::move(left_leaf->keys + half, left_leaf->keys + NodeKeys, right_leaf->keys);
+        std::move(left_leaf->values + half, left_leaf->values + NodeKeys, right_leaf->values);
+        right_leaf->count = NodeKeys - half;
+        left_leaf->count = half;
+
+        right_leaf->prev = left_leaf;
+        right_leaf->next = left_leaf->next;
+        if (left_leaf->next != nullptr) left_leaf->next->prev = right_leaf;
+        left_leaf->next = right_leaf;
+        right = right_leaf;
+    } else {
+        Inner* left_inner = static_cast<Inner*>(child);
+        Inner* right_inner = newInner();
+        std::move(left_inner->keys + half + 1, left_inner->keys + NodeKeys, right_inner->keys);
+        std::copy(left_inner->children + half + 1, left_inner->children + NodeKeys + 1,
+                  right_inner->children);
+        right_inner->count = NodeKeys - half - 1;
+        left_inner->count = half;
+        right = right_inner;
+    }
+
+    // the separator is the left half's largest key (for an inner node,
+    // the middle key, which is no longer counted in the left half)
+    std::move_backward(parent->keys + i, parent->keys + parent->count, parent->keys + parent->count + 1);
+    std::copy_backward(parent->children + i + 1, parent->children + parent->count + 1,
+                       parent->children + parent->count + 2);
+    parent->keys[i] = child->leaf ? child->keys[half - 1] : child->keys[half];
+    parent->children[i + 1] = right;
+    parent->count++;
+}
+
+/**
+* Gives child i of parent more than MIN keys: borrows one through the
+* parent from a sibling that can spare it, or else merges it with one.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+void BTreeMap<Key, Value, Compare, NodeKeys>::fixChild(Inner* parent, int i)
+{
+    NodeBase* child = parent->children[i];
+    NodeBase* left = i > 0 ? parent->children[i - 1] : nullptr;
+    NodeBase* right = i < parent->count ? parent->children[i + 1] : nullptr;
+
+    if (left != nullptr && left->count > MIN) {
+        // the left sibling's last key moves to the front of child
+        std::move_backward(child->keys, child->keys + child->count, child->keys + child->count + 1);
+        if (child->leaf) {
+            Leaf* c = static_cast<Leaf*>(child);
+            Leaf* l = static_cast<Leaf*>(left);
+            std::move_backward(c->values, c->values + c->count, c->values + c->count + 1);
+            c->keys[0] = std::move(l->keys[l->count - 1]);
+            c->values[0] = std::move(l->values[l->count - 1]);
+            parent->keys[i - 1] = l->keys[l->count - 2];
+        } else {
+            Inner* c = static_cast<Inner*>(child);
+            Inner* l = static_cast<Inner*>(left);
+            std::copy_backward(c->children, c->children + c->count + 1, c->children + c->count + 2);
+            c->keys[0] = std::move(parent->keys[i - 1]);
+            c->children[0] = l->children[l->count];
+            parent->keys[i - 1] = std::move(l->keys[l->count - 1]);
+        }
+        left->count--;
+        child->count++;
+    } else if (right != nullptr && right->count > MIN) {
+        // the right sibling's first key moves to the end of child
+        if (child->leaf) {
+            Leaf* c = static_cast<Leaf*>(child);
+            Leaf* r = static_cast<Leaf*>(right);
+            c->keys[c->count] = std::move(r->keys[0]);
+            c->values[c->count] = std::move(r->values[0]);
+            parent->keys[i] = c->keys[c->count];
+            std::move(r->values + 1, r->values + r->count, r->values);
+        } else {
+            Inner* c = static_cast<Inner*>(child);
+            Inner* r = static_cast<Inner*>(right);
+            c->keys[c->count] = std::move(parent->keys[i]);
+            c->children[c->count + 1] = r->children[0];
+            parent->keys[i] = std::move(r->keys[0]);
+            std::copy(r->children + 1, r->children + r->count + 1, r->children);
+        }
+        std::move(right->keys + 1, right->keys + right->count, right->keys);
+        right->count--;
+        child->count++;
+    } else if (right != nullptr) {
+        mergeChildren(parent, i);
+    } else {
+        mergeChildren(parent, i - 1);
+    }
+}
+
+/**
+* Merges child i + 1 of parent into child i, both with at most MIN keys,
+* and drops their separator from parent.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+void BTreeMap<Key, Value, Compare, NodeKeys>::mergeChildren(Inner* parent, int i)
+{
+    NodeBase* left = parent->children[i];
+    NodeBase* right = parent->children[i + 1];
+
+    if (left->leaf) {
+        Leaf* l = static_cast<Leaf*>(left);
+        Leaf* r = static_cast<Leaf*>(right);
+        std::move(r->keys, r->keys + r->count, l->keys + l->count);
+        std::move(r->values, r->values + r->count, l->values + l->count);
+        l->count += r->count;
+        l->next = r->next;
+        if (r->next != nullptr) r->next->prev = l;
+        delete r;
+    } else {
+        // the separator comes down between the two halves
+        Inner* l = static_cast<Inner*>(left);
+        Inner* r = static_cast<Inner*>(right);
+        l->keys[l->count] = std::move(parent->keys[i]);
+        std::move(r->keys, r->keys + r->count, l->keys + l->count + 1);
+        std::copy(r->children, r->children + r->count + 1, l->children + l->count + 1);
+        l->count += r->count + 1;
+        delete r;
+    }
+
+    std::move(parent->keys + i + 1, parent->keys + parent->count, parent->keys + i);
+    std::copy(parent->children + i + 2, parent->children + parent->count + 1, parent->children + i + 1);
+    parent->count--;
+}
+
+template<class Key, class Value, class Compare, int NodeKeys>
+void BTreeMap<Key, Value, Compare, NodeKeys>::destroy(NodeBase* node)
+{
+    if (node == nullptr) return;
+    if (node->leaf) {
+        delete static_cast<Leaf*>(node);
+        return;
+    }
+    Inner* inner = static_cast<Inner*>(node);
+    for (int i = 0; i <= inner->count; i++) destroy(inner->children[i]);
+    delete inner;
+}
+
+/**
+* Checks the subtree at node, whose keys must all be greater than *low
+* and at most *high (null for no bound). The recursion is only as deep
+* as the tree, a handful of levels.
+*/
+template<class Key, class Value, class Compare, int NodeKeys>
+std::string BTreeMap<Key, Value, Compare, NodeKeys>::checkNode(
+    const NodeBase* node, const Key* low, const Key* high,
+    int depth, int& leaf_depth, std::size_t& count) const
+{
+    if (node->count > NodeKeys) return "node over capacity";
+    if (node != root_ && node->count < MIN) return "node under the minimum";
+    for (int i = 0; i < node->count; i++) {
+        if (i > 0 && !comp_(node->keys[i - 1], node->keys[i])) return "keys out of order in a node";
+        if (low != nullptr && !comp_(*low, node->keys[i])) return "key not above its separator";
+        if (high != nullptr && comp_(*high, node->keys[i])) return "key above its separator";
+    }
+
+    if (node->leaf) {
+        if (leaf_depth == -1) leaf_depth = depth;
+        if (depth != leaf_depth) return "leaves at different depths";
+        if (node->count == 0) return "empty leaf";
+        count += node->count;
+        return "";
+    }
+
+    const Inner* inner = static_cast<const Inner*>(node);
+    if (inner->count == 0) return "inner node with one child";
+    for (int i = 0; i <= inner->count; i++) {
+        const Key* child_low = i == 0 ? low : &inner->keys[i - 1];
+        const Key* child_high = i == inner->count ? high : &inner->keys[i];
+        std::string error = checkNode(inner->children[i], child_low, child_high,
+                                      depth + 1, leaf_depth, count);
+        if (!error.empty()) return error;
+    }
+    return "";
+}
+
+/*
+---------------------------------------------------------
+End helper functions for the BTreeMap class.
+---------------------------------------------------------
+*/
+
+#endif
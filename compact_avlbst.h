@@ -0,0 +1,789 @@
+#ifndef COMPACT_AVLBST_H
+#define COMPACT_AVLBST_H
+
+#include <iostream>
+#include <exception>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+#include <functional>
+
+/**
+* A compact storage mode for AVL trees with very many small entries.
+*
+* Instead of one heap node per entry with three pointers, a height and a
+* balance, every node lives in one contiguous array, links to its parent
+* and children with 32-bit indices, and keeps only its balance factor
+* (left height - right height, same sign convention as AVLNode). The
+* rebalancing is done with the classic balance-factor rules, so heights
+* are never stored.
+*
+* Nodes are kept densely packed: removing a node moves the last node of
+* the array into its slot. So, like std::vector, insert and remove
+* invalidate iterators (an iterator is a tree/index pair, so growing the
+* array alone does not).
+*
+* Keys and values are stored as separate non-const members so nodes can
+* be moved when the array grows or a hole is filled, and like BTreeMap
+* the iterators give out a pair of references.
+*/
+template <typename Key, typename Value,
+          typename Compare = std::less<Key> >
+class CompactAVLTree
+{
+public:
+    CompactAVLTree();
+    explicit CompactAVLTree(const Compare& comp);
+    ~CompactAVLTree();
+
+    void insert(const std::pair<const Key, Value>& new_item);
+    void remove(const Key& key);
+    void clear();
+    void reserve(std::size_t count);
+    bool isBalanced() const;
+    bool empty() const;
+    std::size_t size() const;
+
+    /**
+    * Forward iterator over the entries in key order. ItemValue is Value,
+    * or const Value for a const_iterator; an iterator converts to one.
+    */
+    template<typename ItemValue>
+    class tree_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key&, ItemValue&> reference;
+
+        // operator-> needs something to point at, the pair of references
+        struct pointer
+        {
+            reference ref;
+            reference* operator->() { return &ref; }
+        };
+
+        tree_iterator();
+        template<typename OtherValue, typename = typename std::enable_if<
+                     std::is_convertible<OtherValue*, ItemValue*>::value>::type>
+        tree_iterator(const tree_iterator<OtherValue>& other);
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        template<typename OtherValue>
+        bool operator==(const tree_iterator<OtherValue>& rhs) const;
+        template<typename OtherValue>
+        bool operator!=(const tree_iterator<OtherValue>& rhs) const;
+
+        tree_iterator& operator++();
+        tree_iterator operator++(int);
+
+    protected:
+        friend class CompactAVLTree<Key, Value, Compare>;
+        template<typename OtherValue> friend class tree_iterator;
+        tree_iterator(const CompactAVLTree<Key, Value, Compare>* tree, uint32_t index);
+        const CompactAVLTree<Key, Value, Compare>* tree_;
+        uint32_t index_;
+    };
+
+    typedef tree_iterator<Value> iterator;
+    typedef tree_iterator<const Value> const_iterator;
+
+    iterator begin();
+    const_iterator begin() const;
+    iterator end();
+    const_iterator end() const;
+    const_iterator cbegin() const;
+    const_iterator cend() const;
+    iterator find(const Key& key);
+    const_iterator find(const Key& key) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+    // index used for "no node"
+    static const uint32_t NIL = 0xffffffffu;
+
+protected:
+    struct CompactNode {
+        Key key;
+        Value value;
+        uint32_t parent;
+        uint32_t left;
+        uint32_t right;
+        int8_t balance;
+    };
+
+    uint32_t internalFind(const Key& key) const;
+    uint32_t leftmost(uint32_t index) const;
+    uint32_t successor(uint32_t index) const;
+    uint32_t predecessor(uint32_t index) const;
+
+    void grow();
+    void replaceChild(uint32_t parent, uint32_t old_child, uint32_t new_child);
+    void moveNode(uint32_t from, uint32_t to);
+    void swapItems(uint32_t a, uint32_t b);
+    uint32_t rotate_left(uint32_t index);
+    uint32_t rotate_right(uint32_t index);
+    uint32_t balance_avl(uint32_t index);
+    void insert_retrace(uint32_t index);
+    void remove_retrace(uint32_t parent, bool left_shrank);
+
+    Compare comp_;
+    CompactNode* nodes_;
+    uint32_t size_;
+    uint32_t capacity_;
+    uint32_t root_;
+
+private:
+    // owns raw node storage, copying would need a deep copy
+    CompactAVLTree(const CompactAVLTree&);
+    CompactAVLTree& operator=(const CompactAVLTree&);
+};
+
+/*
+------------------------------------------------------------
+Begin implementations for the CompactAVLTree::iterator class.
+------------------------------------------------------------
+*/
+
+/**
+* A default constructor that initializes the iterator to the end.
+*/
+template<class Key, class Value, class Compare>
+template<typename ItemValue>
+CompactAVLTree<Key, Value, Compare>::tree_iterator<ItemValue>::tree_iterator() :
+    tree_(nullptr), index_(NIL)
+{
+
+}
+
+/**
+* Converts an iterator to a const_iterator.
+*/
+template<class Key, class Value, class Compare>
+template<typename ItemValue>
+template<typename OtherValue, typename>
+CompactAVLTree<Key, Value, Compare>::tree_iterator<ItemValue>::tree_iterator(const tree_iterator<OtherValue>& other) :
+    tree_(other.tree_), index_(other.index_)
+{
+
+}
+
+/**
+* Explicit constructor for an iterator at a given node index.
+*/
+template<class Key, class Value, class Compare>
+template<typename ItemValue>
+CompactAVLTree<Key, Value, Compare>::tree_iterator<ItemValue>::tree_iterator(const CompactAVLTree<Key, Value, Compare>* tree, uint32_t index) :
+    tree_(tree), index_(index)
+{
+
+}
+
+/**
+* The key and value of the current entry.
+*/
+template<class Key, class Value, class Compare>
+template<typename ItemValue>
+typename CompactAVLTree<Key, Value, Compare>::template tree_iterator<ItemValue>::reference
+CompactAVLTree<Key, Value, Compare>::tree_iterator<ItemValue>::operator*() const
+{
+    CompactNode& node = tree_->nodes_[index_];
+    return reference(node.key, node.value);
+}
+
+template<class Key, class Value, class Compare>
+template<typename ItemValue>
+typename CompactAVLTree<Key, Value, Compare>::template tree_iterator<ItemValue>::pointer
+CompactAVLTree<Key, Value, Compare>::tree_iterator<ItemValue>::operator->() const
+{
+    pointer p = { **this };
+    return p;
+}
+
+/**
+* Iterators are equal if they point at the same index (all end iterators are equal).
+*/
+template<class Key, class Value, class Compare>
+template<typename ItemValue>
+template<typename OtherValue>
+bool CompactAVLTree<Key, Value, Compare>::tree_iterator<ItemValue>::operator==(const tree_iterator<OtherValue>& rhs) const
+{
+    return index_ == rhs.index_;
+}
+
+template<class Key, class Value, class Compare>
+template<typename ItemValue>
+template<typename OtherValue>
+bool CompactAVLTree<Key, Value, Compare>::tree_iterator<ItemValue>::operator!=(const tree_iterator<OtherValue>& rhs) const
+{
+    return index_ != rhs.index_;
+}
+
+/**
+* Advances to the in-order successor.
+*/
+template<class Key, class Value, class Compare>
+template<typename ItemValue>
+typename CompactAVLTree<Key, Value, Compare>::template tree_iterator<ItemValue>&
+CompactAVLTree<Key, Value, Compare>::tree_iterator<ItemValue>::operator++()
+{
+    if (index_ != NIL) index_ = tree_->successor(index_);
+    return *this;
+}
+
+/**
+* Advances the iterator and returns where it was before
+*/
+template<class Key, class Value, class Compare>
+template<typename ItemValue>
+typename CompactAVLTree<Key, Value, Compare>::template tree_iterator<ItemValue>
+CompactAVLTree<Key, Value, Compare>::tree_iterator<ItemValue>::operator++(int)
+{
+    tree_iterator before = *this;
+    ++*this;
+    return before;
+}
+
+/*
+----------------------------------------------------------
+End implementations for the CompactAVLTree::iterator class.
+----------------------------------------------------------
+*/
+
+/*
+---------------------------------------------------
+Begin implementations for the CompactAVLTree class.
+---------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+CompactAVLTree<Key, Value, Compare>::CompactAVLTree() :
+    comp_(), nodes_(nullptr), size_(0), capacity_(0), root_(NIL)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+CompactAVLTree<Key, Value, Compare>::CompactAVLTree(const Compare& comp) :
+    comp_(comp), nodes_(nullptr), size_(0), capacity_(0), root_(NIL)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+CompactAVLTree<Key, Value, Compare>::~CompactAVLTree()
+{
+    clear();
+    ::operator delete(nodes_);
+}
+
+template<class Key, class Value, class Compare>
+bool CompactAVLTree<Key, Value, Compare>::empty() const
+{
+    return size_ == 0;
+}
+
+template<class Key, class Value, class Compare>
+std::size_t CompactAVLTree<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+/**
+* Destroys every entry, keeping the array around for reuse.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::clear()
+{
+    for (uint32_t i = 0; i < size_; i++) {
+        nodes_[i].~CompactNode();
+    }
+    size_ = 0;
+    root_ = NIL;
+}
+
+/**
+* Makes room for count entries without growing again. Nodes are moved
+* over if that cannot throw and copied otherwise, and the old array is
+* only torn down once the new one is complete, so a throwing copy leaves
+* the tree as it was.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::reserve(std::size_t count)
+{
+    if (count >= NIL) throw std::length_error("CompactAVLTree is limited to 2^32 - 1 entries");
+    if (count <= capacity_) return;
+
+    CompactNode* bigger = static_cast<CompactNode*>(::operator new(count * sizeof(CompactNode)));
+    uint32_t built = 0;
+    try {
+        for (; built < size_; built++) {
+            new (&bigger[built]) CompactNode(std::move_if_noexcept(nodes_[built]));
+        }
+    } catch (...) {
+        for (uint32_t i = 0; i < built; i++) bigger[i].~CompactNode();
+        ::operator delete(bigger);
+        throw;
+    }
+
+    for (uint32_t i = 0; i < size_; i++) nodes_[i].~CompactNode();
+    ::operator delete(nodes_);
+    nodes_ = bigger;
+    capacity_ = static_cast<uint32_t>(count);
+}
+
+/**
+* Doubles the array when it is full.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::grow()
+{
+    std::size_t wanted = capacity_ ? 2 * std::size_t(capacity_) : 16;
+    if (wanted >= NIL) wanted = NIL - 1;
+    if (wanted <= size_) throw std::length_error("CompactAVLTree is limited to 2^32 - 1 entries");
+    reserve(wanted);
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::iterator
+CompactAVLTree<Key, Value, Compare>::begin()
+{
+    return iterator(this, leftmost(root_));
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::begin() const
+{
+    return const_iterator(this, leftmost(root_));
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::iterator
+CompactAVLTree<Key, Value, Compare>::end()
+{
+    return iterator(this, NIL);
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::end() const
+{
+    return const_iterator(this, NIL);
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::cbegin() const
+{
+    return begin();
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::cend() const
+{
+    return end();
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::iterator
+CompactAVLTree<Key, Value, Compare>::find(const Key& key)
+{
+    return iterator(this, internalFind(key));
+}
+
+template<class Key, class Value, class Compare>
+typename CompactAVLTree<Key, Value, Compare>::const_iterator
+CompactAVLTree<Key, Value, Compare>::find(const Key& key) const
+{
+    return const_iterator(this, internalFind(key));
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template<class Key, class Value, class Compare>
+Value& CompactAVLTree<Key, Value, Compare>::operator[](const Key& key)
+{
+    uint32_t index = internalFind(key);
+    if (index == NIL) throw std::out_of_range("Invalid key");
+    return nodes_[index].value;
+}
+
+template<class Key, class Value, class Compare>
+Value const & CompactAVLTree<Key, Value, Compare>::operator[](const Key& key) const
+{
+    uint32_t index = internalFind(key);
+    if (index == NIL) throw std::out_of_range("Invalid key");
+    return nodes_[index].value;
+}
+
+/**
+* Walks down from the root to the index holding key, or NIL. One
+* comparison per level: remember the last node not less than key and
+* check it for equality at the bottom.
+*/
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::internalFind(const Key& key) const
+{
+    uint32_t candidate = NIL;
+    uint32_t curr = root_;
+    while (curr != NIL) {
+        const CompactNode& node = nodes_[curr];
+        if (comp_(node.key, key)) {
+            curr = node.right;
+        } else {
+            candidate = curr;
+            curr = node.left;
+        }
+    }
+    if (candidate != NIL && !comp_(key, nodes_[candidate].key)) return candidate;
+    return NIL;
+}
+
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::leftmost(uint32_t index) const
+{
+    if (index == NIL) return NIL;
+    while (nodes_[index].left != NIL) index = nodes_[index].left;
+    return index;
+}
+
+/**
+* Left most node of the right subtree, or else the first ancestor we are left of.
+*/
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::successor(uint32_t index) const
+{
+    if (nodes_[index].right != NIL) return leftmost(nodes_[index].right);
+
+    uint32_t parent = nodes_[index].parent;
+    while (parent != NIL && nodes_[parent].right == index) {
+        index = parent;
+        parent = nodes_[parent].parent;
+    }
+    return parent;
+}
+
+/**
+* Right most node of the left subtree, or else the first ancestor we are right of.
+*/
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::predecessor(uint32_t index) const
+{
+    if (nodes_[index].left != NIL) {
+        index = nodes_[index].left;
+        while (nodes_[index].right != NIL) index = nodes_[index].right;
+        return index;
+    }
+
+    uint32_t parent = nodes_[index].parent;
+    while (parent != NIL && nodes_[parent].left == index) {
+        index = parent;
+        parent = nodes_[parent].parent;
+    }
+    return parent;
+}
+
+/**
+* Points parent (or the root if parent is NIL) at new_child instead of old_child.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::replaceChild(uint32_t parent, uint32_t old_child, uint32_t new_child)
+{
+    if (parent == NIL) root_ = new_child;
+    else if (nodes_[parent].left == old_child) nodes_[parent].left = new_child;
+    else nodes_[parent].right = new_child;
+}
+
+/**
+* Swaps the keys and values of two slots, leaving their links alone.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::swapItems(uint32_t a, uint32_t b)
+{
+    using std::swap;
+    swap(nodes_[a].key, nodes_[b].key);
+    swap(nodes_[a].value, nodes_[b].value);
+}
+
+/**
+* Moves the node at index from into the unlinked slot to, fixing every
+* index that pointed at it. Both slots stay constructed: to takes the
+* entry and links of from, and from is left holding whatever entry was
+* in to, for the caller to destroy.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::moveNode(uint32_t from, uint32_t to)
+{
+    swapItems(from, to);
+    nodes_[to].parent = nodes_[from].parent;
+    nodes_[to].left = nodes_[from].left;
+    nodes_[to].right = nodes_[from].right;
+    nodes_[to].balance = nodes_[from].balance;
+
+    CompactNode& node = nodes_[to];
+    replaceChild(node.parent, from, to);
+    if (node.left != NIL) nodes_[node.left].parent = to;
+    if (node.right != NIL) nodes_[node.right].parent = to;
+}
+
+/**
+* Rotates index down to the left, returns the new root of the subtree.
+* The balance updates follow from the heights without storing any.
+*/
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::rotate_left(uint32_t index)
+{
+    CompactNode& node = nodes_[index];
+    uint32_t n1_index = node.right;
+    CompactNode& n1 = nodes_[n1_index];
+    uint32_t t1 = n1.left;
+
+    // point at grandchild
+    node.right = t1;
+    if (t1 != NIL) nodes_[t1].parent = index;
+
+    // swap node with right child
+    n1.parent = node.parent;
+    replaceChild(node.parent, index, n1_index);
+    n1.left = index;
+    node.parent = n1_index;
+
+    node.balance = node.balance + 1 - std::min<int8_t>(n1.balance, 0);
+    n1.balance = n1.balance + 1 + std::max<int8_t>(node.balance, 0);
+    return n1_index;
+}
+
+/**
+* Rotates index down to the right, returns the new root of the subtree.
+*/
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::rotate_right(uint32_t index)
+{
+    CompactNode& node = nodes_[index];
+    uint32_t n1_index = node.left;
+    CompactNode& n1 = nodes_[n1_index];
+    uint32_t t1 = n1.right;
+
+    // point at grandchild
+    node.left = t1;
+    if (t1 != NIL) nodes_[t1].parent = index;
+
+    // swap node with left child
+    n1.parent = node.parent;
+    replaceChild(node.parent, index, n1_index);
+    n1.right = index;
+    node.parent = n1_index;
+
+    node.balance = node.balance - 1 - std::max<int8_t>(n1.balance, 0);
+    n1.balance = n1.balance - 1 + std::min<int8_t>(node.balance, 0);
+    return n1_index;
+}
+
+/**
+* Fixes a node with balance +-2, returns the new root of the subtree.
+*/
+template<class Key, class Value, class Compare>
+uint32_t CompactAVLTree<Key, Value, Compare>::balance_avl(uint32_t index)
+{
+    if (nodes_[index].balance > 1) {  // left heavy tree
+        if (nodes_[nodes_[index].left].balance < 0) rotate_left(nodes_[index].left);
+        return rotate_right(index);
+    } else if (nodes_[index].balance < -1) { // right heavy
+        if (nodes_[nodes_[index].right].balance > 0) rotate_right(nodes_[index].right);
+        return rotate_left(index);
+    }
+    return index;
+}
+
+/**
+* Walks up from a freshly attached leaf. A parent that ends up level did
+* not get taller, and a rotation always restores the old height, so both
+* stop the walk.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::insert_retrace(uint32_t index)
+{
+    uint32_t parent = nodes_[index].parent;
+    while (parent != NIL) {
+        CompactNode& p = nodes_[parent];
+        p.balance += (p.left == index) ? 1 : -1;
+
+        if (p.balance == 0) return;
+        if (p.balance > 1 || p.balance < -1) {
+            balance_avl(parent);
+            return;
+        }
+
+        index = parent;
+        parent = p.parent;
+    }
+}
+
+/**
+* Walks up from the parent of a removed node. A parent that went from level
+* to leaning did not get shorter, and neither did a subtree whose rotation
+* left its new root leaning, so both stop the walk.
+*/
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::remove_retrace(uint32_t parent, bool left_shrank)
+{
+    while (parent != NIL) {
+        nodes_[parent].balance += left_shrank ? -1 : 1;
+        int8_t balance = nodes_[parent].balance;
+
+        if (balance == 1 || balance == -1) return;
+        if (balance > 1 || balance < -1) {
+            parent = balance_avl(parent);
+            if (nodes_[parent].balance != 0) return;
+        }
+
+        // this subtree got shorter, tell its parent
+        uint32_t up = nodes_[parent].parent;
+        left_shrank = (up != NIL && nodes_[up].left == parent);
+        parent = up;
+    }
+}
+
+/*
+ * If key is already in the tree, the value is overwritten.
+ */
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::insert(const std::pair<const Key, Value>& new_item)
+{
+    // single descent: overwrite in place, or remember the leaf to attach under
+    uint32_t parent = NIL;
+    uint32_t curr = root_;
+    bool go_left = false;
+    while (curr != NIL) {
+        parent = curr;
+        CompactNode& node = nodes_[curr];
+        if (comp_(new_item.first, node.key)) {
+            go_left = true;
+            curr = node.left;
+        } else if (comp_(node.key, new_item.first)) {
+            go_left = false;
+            curr = node.right;
+        } else {
+            node.value = new_item.second;
+            return;
+        }
+    }
+
+    if (size_ == capacity_) grow();
+
+    // built straight in its slot, so the item is copied once
+    uint32_t index = size_;
+    new (&nodes_[index]) CompactNode{ new_item.first, new_item.second, parent, NIL, NIL, 0 };
+    size_++;
+
+    if (parent == NIL) {
+        root_ = index;
+        return;
+    }
+
+    if (go_left) nodes_[parent].left = index;
+    else nodes_[parent].right = index;
+
+    insert_retrace(index);
+}
+
+/*
+ * A node with 2 children swaps entries with its predecessor, and the
+ * predecessor's slot is the one unlinked. Entries only ever change slots
+ * by swapping, so every slot stays constructed until the unlinked one is
+ * destroyed at the end.
+ */
+template<class Key, class Value, class Compare>
+void CompactAVLTree<Key, Value, Compare>::remove(const Key& key)
+{
+    uint32_t index = internalFind(key);
+    if (index == NIL) return;
+
+    // swap with predecessor
+    if (nodes_[index].left != NIL && nodes_[index].right != NIL) {
+        uint32_t pred = predecessor(index);
+        swapItems(index, pred);
+        index = pred;
+    }
+
+    // now at most one child, splice it into our place
+    CompactNode& node = nodes_[index];
+    uint32_t child = (node.left != NIL) ? node.left : node.right;
+    uint32_t parent = node.parent;
+    bool left_shrank = (parent != NIL && nodes_[parent].left == index);
+    replaceChild(parent, index, child);
+    if (child != NIL) nodes_[child].parent = parent;
+
+    // keep the array dense by moving the last node into the hole, which
+    // hands the removed entry to the last slot
+    uint32_t last = size_ - 1;
+    if (index != last) {
+        moveNode(last, index);
+        if (parent == last) parent = index;
+    }
+    nodes_[last].~CompactNode();
+    size_--;
+
+    remove_retrace(parent, left_shrank);
+}
+
+/**
+ * Return true iff every stored balance factor matches the real heights
+ * and is within one.
+ */
+template<class Key, class Value, class Compare>
+bool CompactAVLTree<Key, Value, Compare>::isBalanced() const
+{
+    // post-order walk using the parent indices, heights kept in a side array
+    if (root_ == NIL) return true;
+
+    uint32_t* heights = new uint32_t[size_];
+    bool ok = true;
+    uint32_t prev = NIL;
+    uint32_t curr = root_;
+    while (curr != NIL && ok) {
+        const CompactNode& node = nodes_[curr];
+        if (prev == node.parent) {
+            prev = curr;
+            if (node.left != NIL) { curr = node.left; continue; }
+            if (node.right != NIL) { curr = node.right; continue; }
+        } else if (prev == node.left && node.right != NIL) {
+            prev = curr;
+            curr = node.right;
+            continue;
+        }
+
+        // both children done
+        uint32_t lh = (node.left != NIL) ? heights[node.left] : 0;
+        uint32_t rh = (node.right != NIL) ? heights[node.right] : 0;
+        heights[curr] = 1 + std::max(lh, rh);
+        int diff = int(lh) - int(rh);
+        if (diff != node.balance || diff > 1 || diff < -1) ok = false;
+
+        prev = curr;
+        curr = node.parent;
+    }
+
+    delete [] heights;
+    return ok;
+}
+
+/*
+-------------------------------------------------
+End implementations for the CompactAVLTree class.
+-------------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,1092 @@
+#ifndef CONCURRENT_AVLBST_H
+#define CONCURRENT_AVLBST_H
+
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <type_traits>
+
+/**
+* A thread-safe ordered map: an AVL tree with one lock per node and
+* optimistic, lock-free lookups, after Bronson, Casper, Chafi and
+* Olukotun, "A Practical Concurrent Binary Search Tree" (PPoPP 2010).
+*
+* Every node has a version number. A rotation bumps the version of the
+* node it moves down (and marks it as changing while it runs), so a
+* reader can walk down hand over hand: read a child, then check that the
+* parent's version hasn't moved, which proves the child still covers
+* the key range the reader expects. If it has moved, the reader backs
+* up one level and tries again. Lookups never lock, and the only shared
+* memory they write is their epoch pin (see below).
+*
+* Writers lock only the nodes they change: an insert locks the new
+* leaf's parent, and a rotation locks the parent, the node and the child
+* being rotated. Balance is relaxed while writers race and restored as
+* each writer walks back up (fixHeightAndRebalance), so a tree with no
+* writers running is a regular AVL tree. A removed node with two
+* children stays in the tree as a routing node with no value until a
+* later rebalance can unlink it.
+*
+* Readers can still be looking at a node that was just unlinked, so
+* unlinked nodes are freed by epochs, after Fraser's epoch-based
+* reclamation. Every find and update pins the global epoch for as long
+* as it runs, by counting itself in the epoch's slot of its thread's
+* stripe. An unlinked node is retired to its thread's stripe tagged with
+* the epoch, and the epoch only moves on once nobody is pinned in the one
+* before it. So once it is two past a node's tag, every operation that
+* could have reached the node has finished, and the node is freed. The
+* stripes spread the pins and the retire lists over their own cache
+* lines and locks, so threads don't all meet on one counter or mutex.
+* Values are read and written whole without a lock, so Value must be
+* trivially copyable (store big values by pointer or index).
+*/
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class ConcurrentAVLTree
+{
+    static_assert(std::is_trivially_copyable<Value>::value,
+                  "ConcurrentAVLTree values must be trivially copyable");
+
+public:
+    ConcurrentAVLTree();
+    explicit ConcurrentAVLTree(const Compare& comp);
+    ~ConcurrentAVLTree();
+
+    void insert(const std::pair<const Key, Value>& new_item);
+    void remove(const Key& key);
+    bool find(const Key& key, Value& value) const;
+    bool contains(const Key& key) const;
+    bool empty() const;
+    std::size_t size() const;
+    // unlinked nodes not freed yet, a few per thread even under churn
+    std::size_t retired() const;
+
+    // only meaningful while no other thread is writing
+    template<typename Fn>
+    void for_each(Fn fn) const;
+    std::string validate() const;
+
+protected:
+    struct CNode;
+
+    // the links and lock shared by the nodes and the root holder, a
+    // sentinel whose right child is the root, so the root can be
+    // rotated like any other child
+    struct CLink {
+        std::atomic<CNode*> left;
+        std::atomic<CNode*> right;
+        std::atomic<CLink*> parent;
+        std::atomic<int> height;
+        std::atomic<long long> version;
+        std::mutex lock;
+
+        explicit CLink(CLink* parent);
+        CNode* child(int dir) const;
+        void setChild(int dir, CNode* node);
+    };
+
+    struct CNode : CLink {
+        const Key key;
+        std::atomic<bool> present;  // false for a routing node
+        std::atomic<Value> value;
+
+        CNode(const Key& key, const Value& value, CLink* parent);
+    };
+
+    // version bits: UNLINKED alone means the node left the tree, CHANGING
+    // means a rotation is moving the node down, and the rest counts rotations
+    static const long long UNLINKED = 1;
+    static const long long CHANGING = 2;
+    static const long long COUNT_INCR = 4;
+
+    // results of the attempt* functions
+    enum Attempt { NOT_FOUND, FOUND, RETRY };
+
+    // nodeCondition results that aren't a new height
+    static const int UNLINK_REQUIRED = -1;
+    static const int REBALANCE_REQUIRED = -2;
+    static const int NOTHING_REQUIRED = -3;
+
+    int compare(const Key& a, const Key& b) const;
+    static int height(const CNode* node);
+    static void waitUntilChanged(const CNode* node, long long version);
+
+    Attempt attemptGet(const Key& key, const CNode* node, int dir, long long node_version, Value& value) const;
+    void update(const Key& key, const Value* new_value);
+    Attempt attemptInsertIntoEmpty(const Key& key, const Value& value);
+    Attempt attemptUpdate(const Key& key, const Value* new_value, CLink* parent, CNode* node, long long node_version);
+    Attempt attemptNodeUpdate(const Value* new_value, CLink* parent, CNode* node);
+    bool attemptUnlink_nl(CLink* parent, CNode* node);
+    bool unlinkIfRouting_nl(CLink* parent, CNode* node);
+    void retire(CNode* node);
+
+    // epoch-based reclamation: Pin holds an epoch for an operation's
+    // lifetime, retired nodes are freed two epochs after they left
+    class Pin;
+    static unsigned threadStripe();
+    void freeRetired_nl(unsigned stripe, unsigned long long epoch);
+    void tryAdvanceEpoch(unsigned long long epoch);
+
+    int nodeCondition(CNode* node) const;
+    void fixHeightAndRebalance(CLink* link);
+    CLink* fixHeight_nl(CLink* link);
+    CLink* rebalance_nl(CLink* parent, CNode* n);
+    CLink* rebalanceToRight_nl(CLink* parent, CNode* n, CNode* nL, int hR0);
+    CLink* rebalanceToLeft_nl(CLink* parent, CNode* n, CNode* nR, int hL0);
+    CLink* rotateRight_nl(CLink* parent, CNode* n, CNode* nL, int hR, int hLL, CNode* nLR, int hLR);
+    CLink* rotateLeft_nl(CLink* parent, CNode* n, int hL, CNode* nR, CNode* nRL, int hRL, int hRR);
+    CLink* rotateRightOverLeft_nl(CLink* parent, CNode* n, CNode* nL, int hR, int hLL, CNode* nLR, int hLRL);
+    CLink* rotateLeftOverRight_nl(CLink* parent, CNode* n, int hL, CNode* nR, CNode* nRL, int hRR, int hRLR);
+
+    CLink holder_;
+    std::atomic<std::size_t> size_;
+    Compare comp_;
+
+    // how many stripes threads are spread over, and how many nodes a
+    // stripe holds before it tries to move the epoch on
+    static const unsigned STRIPES = 32;
+    static const std::size_t RETIRE_BATCH = 64;
+
+    // one thread's share of the pins and the retired nodes; threads are
+    // given stripes in turn, so up to STRIPES threads have one each
+    struct alignas(64) Stripe {
+        std::atomic<long> pins[3];            // by epoch % 3
+        std::mutex lock;
+        std::vector<CNode*> retired[3];       // by tag % 3
+        unsigned long long retiredEpoch[3];   // the tag of each list
+        std::size_t pending;                  // nodes in the three lists
+
+        Stripe();
+    };
+
+    std::atomic<unsigned long long> epoch_;
+    mutable Stripe stripes_[STRIPES];  // lookups pin through a const tree
+
+private:
+    ConcurrentAVLTree(const ConcurrentAVLTree&);
+    ConcurrentAVLTree& operator=(const ConcurrentAVLTree&);
+};
+
+template<class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::CLink::CLink(CLink* parent) :
+    left(nullptr), right(nullptr), parent(parent), height(1), version(0)
+{
+
+}
+
+// dir < 0 for the left child, otherwise the right
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::CNode*
+ConcurrentAVLTree<Key, Value, Compare>::CLink::child(int dir) const
+{
+    return dir < 0 ? left.load() : right.load();
+}
+
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::CLink::setChild(int dir, CNode* node)
+{
+    if (dir < 0) left = node;
+    else right = node;
+}
+
+template<class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::CNode::CNode(const Key& key, const Value& value, CLink* parent) :
+    CLink(parent), key(key), present(true), value(value)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::Stripe::Stripe() :
+    pending(0)
+{
+    for (int i = 0; i < 3; i++) {
+        pins[i] = 0;
+        retiredEpoch[i] = 0;
+    }
+}
+
+/**
+* Counts the calling thread as pinned in the current epoch until it goes
+* out of scope. The epoch is read again after the count goes up, so the
+* pin is in an epoch that was current while it was held; otherwise the
+* epoch could move twice between reading it and counting in it.
+*/
+template<class Key, class Value, class Compare>
+class ConcurrentAVLTree<Key, Value, Compare>::Pin
+{
+public:
+    explicit Pin(const ConcurrentAVLTree& tree) :
+        pins_(tree.stripes_[threadStripe()].pins)
+    {
+        while (true) {
+            epoch_ = tree.epoch_.load();
+            pins_[epoch_ % 3]++;
+            if (tree.epoch_.load() == epoch_) return;
+            pins_[epoch_ % 3]--;
+        }
+    }
+    ~Pin() { pins_[epoch_ % 3]--; }
+
+private:
+    std::atomic<long>* pins_;
+    unsigned long long epoch_;
+};
+
+template<class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::ConcurrentAVLTree() :
+    holder_(nullptr), size_(0), comp_(), epoch_(0)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::ConcurrentAVLTree(const Compare& comp) :
+    holder_(nullptr), size_(0), comp_(comp), epoch_(0)
+{
+
+}
+
+/**
+* Frees the nodes still in the tree and every unlinked one not freed yet.
+* No other thread may be using the tree.
+*/
+template<class Key, class Value, class Compare>
+ConcurrentAVLTree<Key, Value, Compare>::~ConcurrentAVLTree()
+{
+    std::vector<CNode*> stack;
+    if (holder_.right.load() != nullptr) stack.push_back(holder_.right.load());
+    while (!stack.empty()) {
+        CNode* node = stack.back();
+        stack.pop_back();
+        if (node->left.load() != nullptr) stack.push_back(node->left.load());
+        if (node->right.load() != nullptr) stack.push_back(node->right.load());
+        delete node;
+    }
+    for (unsigned stripe = 0; stripe < STRIPES; stripe++) {
+        for (int i = 0; i < 3; i++) {
+            std::vector<CNode*>& retired = stripes_[stripe].retired[i];
+            for (size_t j = 0; j < retired.size(); j++) delete retired[j];
+        }
+    }
+}
+
+/**
+* Inserts new_item, or replaces the value if the key is already there.
+*/
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::insert(const std::pair<const Key, Value>& new_item)
+{
+    update(new_item.first, &new_item.second);
+}
+
+/**
+* Removes key if it is there.
+*/
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::remove(const Key& key)
+{
+    update(key, nullptr);
+}
+
+/**
+* Copies key's value into value and returns true, or returns false if key
+* isn't there. Never blocks on a writer's lock.
+*/
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::find(const Key& key, Value& value) const
+{
+    Pin pin(*this);
+    while (true) {
+        const CNode* right = holder_.right.load();
+        if (right == nullptr) return false;
+
+        int dir = compare(key, right->key);
+        if (dir == 0) {
+            if (!right->present.load()) return false;
+            value = right->value.load();
+            return true;
+        }
+        long long version = right->version.load();
+        if (version & (CHANGING | UNLINKED)) {
+            waitUntilChanged(right, version);
+        } else if (right == holder_.right.load()) {
+            Attempt result = attemptGet(key, right, dir, version, value);
+            if (result != RETRY) return result == FOUND;
+        }
+    }
+}
+
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::contains(const Key& key) const
+{
+    Value value;
+    return find(key, value);
+}
+
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::empty() const
+{
+    return size_.load() == 0;
+}
+
+template<class Key, class Value, class Compare>
+std::size_t ConcurrentAVLTree<Key, Value, Compare>::size() const
+{
+    return size_.load();
+}
+
+template<class Key, class Value, class Compare>
+std::size_t ConcurrentAVLTree<Key, Value, Compare>::retired() const
+{
+    std::size_t count = 0;
+    for (unsigned stripe = 0; stripe < STRIPES; stripe++) {
+        std::lock_guard<std::mutex> guard(stripes_[stripe].lock);
+        count += stripes_[stripe].pending;
+    }
+    return count;
+}
+
+/**
+* Calls fn(key, value) for each entry in key order.
+*/
+template<class Key, class Value, class Compare>
+template<typename Fn>
+void ConcurrentAVLTree<Key, Value, Compare>::for_each(Fn fn) const
+{
+    std::vector<const CNode*> stack;
+    for (const CNode* node = holder_.right.load(); node != nullptr || !stack.empty(); ) {
+        if (node != nullptr) {
+            stack.push_back(node);
+            node = node->left.load();
+            continue;
+        }
+        node = stack.back();
+        stack.pop_back();
+        if (node->present.load()) fn(node->key, node->value.load());
+        node = node->right.load();
+    }
+}
+
+/**
+* Checks ordering, parent links, heights, balance and the size, and
+* returns a description of the first problem, or an empty string. Only
+* meaningful while no other thread is writing.
+*/
+template<class Key, class Value, class Compare>
+std::string ConcurrentAVLTree<Key, Value, Compare>::validate() const
+{
+    // post-order, so children are checked before the heights above them
+    struct Frame { const CNode* node; bool children_done; };
+    std::vector<Frame> stack;
+    const CNode* prev = nullptr;
+    std::size_t present = 0;
+
+    // in-order pass for the ordering and the count
+    std::vector<const CNode*> path;
+    for (const CNode* node = holder_.right.load(); node != nullptr || !path.empty(); ) {
+        if (node != nullptr) {
+            path.push_back(node);
+            node = node->left.load();
+            continue;
+        }
+        node = path.back();
+        path.pop_back();
+        if (prev != nullptr && compare(prev->key, node->key) >= 0) return "keys out of order";
+        if (node->present.load()) present++;
+        prev = node;
+        node = node->right.load();
+    }
+    if (present != size_.load()) return "size does not match the entries";
+
+    if (holder_.right.load() != nullptr) stack.push_back(Frame{holder_.right.load(), false});
+    while (!stack.empty()) {
+        Frame& frame = stack.back();
+        const CNode* node = frame.node;
+        const CNode* left = node->left.load();
+        const CNode* right = node->right.load();
+        if (!frame.children_done) {
+            frame.children_done = true;
+            if (left != nullptr) stack.push_back(Frame{left, false});
+            if (right != nullptr) stack.push_back(Frame{right, false});
+            continue;
+        }
+        stack.pop_back();
+
+        if (node->version.load() & (CHANGING | UNLINKED)) return "linked node marked changing or unlinked";
+        if ((left != nullptr && left->parent.load() != node) ||
+            (right != nullptr && right->parent.load() != node)) {
+            return "wrong parent link";
+        }
+        int lh = height(left);
+        int rh = height(right);
+        if (node->height.load() != 1 + std::max(lh, rh)) return "wrong height";
+        if (lh - rh > 1 || rh - lh > 1) return "unbalanced node";
+        if (!node->present.load() && (left == nullptr || right == nullptr)) {
+            return "routing node that should have been unlinked";
+        }
+    }
+    return "";
+}
+
+/*
+-----------------------------------------------------------
+Begin helper functions for the ConcurrentAVLTree class.
+-----------------------------------------------------------
+*/
+
+// < 0, 0 or > 0 as a is before, equal to or after b
+template<class Key, class Value, class Compare>
+int ConcurrentAVLTree<Key, Value, Compare>::compare(const Key& a, const Key& b) const
+{
+    if (comp_(a, b)) return -1;
+    return comp_(b, a) ? 1 : 0;
+}
+
+template<class Key, class Value, class Compare>
+int ConcurrentAVLTree<Key, Value, Compare>::height(const CNode* node)
+{
+    return node == nullptr ? 0 : node->height.load();
+}
+
+/**
+* Spins until a rotation moving node down finishes. Rotations are short
+* and done under locks readers never take, so readers just yield.
+*/
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::waitUntilChanged(const CNode* node, long long version)
+{
+    if (!(version & CHANGING)) return;
+    while (node->version.load() == version) std::this_thread::yield();
+}
+
+/**
+* Looks for key below node, going dir from it, where node_version is the
+* version node had when the caller reached it. Returns RETRY if node was
+* rotated since, so the caller has to look again from its own node.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Attempt
+ConcurrentAVLTree<Key, Value, Compare>::attemptGet(
+    const Key& key, const CNode* node, int dir, long long node_version, Value& value) const
+{
+    while (true) {
+        const CNode* child = node->child(dir);
+        if (child == nullptr) {
+            // the missing child proves key is absent only if node
+            // still covers key's range
+            if (node->version.load() != node_version) return RETRY;
+            return NOT_FOUND;
+        }
+
+        int child_dir = compare(key, child->key);
+        if (child_dir == 0) {
+            if (!child->present.load()) return NOT_FOUND;
+            value = child->value.load();
+            return FOUND;
+        }
+
+        long long child_version = child->version.load();
+        if (child_version & (CHANGING | UNLINKED)) {
+            waitUntilChanged(child, child_version);
+            if (node->version.load() != node_version) return RETRY;
+        } else if (child != node->child(dir)) {
+            // the child changed before its version was read
+            if (node->version.load() != node_version) return RETRY;
+        } else {
+            if (node->version.load() != node_version) return RETRY;
+            // the step into child is valid, from here child's version
+            // protects the rest of the walk
+            Attempt result = attemptGet(key, child, child_dir, child_version, value);
+            if (result != RETRY) return result;
+        }
+    }
+}
+
+/**
+* Inserts or replaces key's value, or removes key when new_value is null.
+*/
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::update(const Key& key, const Value* new_value)
+{
+    Pin pin(*this);
+    while (true) {
+        CNode* right = holder_.right.load();
+        if (right == nullptr) {
+            if (new_value == nullptr || attemptInsertIntoEmpty(key, *new_value) != RETRY) return;
+            continue;
+        }
+
+        long long version = right->version.load();
+        if (version & (CHANGING | UNLINKED)) {
+            waitUntilChanged(right, version);
+        } else if (right == holder_.right.load()) {
+            if (attemptUpdate(key, new_value, &holder_, right, version) != RETRY) return;
+        }
+    }
+}
+
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Attempt
+ConcurrentAVLTree<Key, Value, Compare>::attemptInsertIntoEmpty(const Key& key, const Value& value)
+{
+    std::lock_guard<std::mutex> guard(holder_.lock);
+    if (holder_.right.load() != nullptr) return RETRY;
+    holder_.right = new CNode(key, value, &holder_);
+    size_++;
+    return FOUND;
+}
+
+/**
+* The update counterpart of attemptGet. A missing key is inserted as a
+* new leaf under node, with node locked and its version checked again,
+* so no rotation can have moved node's range in between.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Attempt
+ConcurrentAVLTree<Key, Value, Compare>::attemptUpdate(
+    const Key& key, const Value* new_value, CLink* parent, CNode* node, long long node_version)
+{
+    int dir = compare(key, node->key);
+    if (dir == 0) return attemptNodeUpdate(new_value, parent, node);
+
+    while (true) {
+        CNode* child = node->child(dir);
+        if (node->version.load() != node_version) return RETRY;
+
+        if (child == nullptr) {
+            // nothing to remove
+            if (new_value == nullptr) return NOT_FOUND;
+
+            CLink* damaged = nullptr;
+            bool inserted = false;
+            {
+                std::lock_guard<std::mutex> guard(node->lock);
+                if (node->version.load() != node_version) return RETRY;
+                // otherwise another insert got here first, look again
+                if (node->child(dir) == nullptr) {
+                    node->setChild(dir, new CNode(key, *new_value, node));
+                    size_++;
+                    damaged = fixHeight_nl(node);
+                    inserted = true;
+                }
+            }
+            if (inserted) {
+                fixHeightAndRebalance(damaged);
+                return FOUND;
+            }
+        } else {
+            long long child_version = child->version.load();
+            if (child_version & (CHANGING | UNLINKED)) {
+                waitUntilChanged(child, child_version);
+            } else if (child == node->child(dir)) {
+                if (node->version.load() != node_version) return RETRY;
+                Attempt result = attemptUpdate(key, new_value, node, child, child_version);
+                if (result != RETRY) return result;
+            }
+        }
+    }
+}
+
+/**
+* Changes node, which holds the key. A removal unlinks node if it has at
+* most one child (locking parent, then node), otherwise it just turns
+* node into a routing node. parent is only used for the unlink, so a
+* plain update doesn't care if it is stale.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Attempt
+ConcurrentAVLTree<Key, Value, Compare>::attemptNodeUpdate(const Value* new_value, CLink* parent, CNode* node)
+{
+    if (new_value == nullptr && !node->present.load()) return NOT_FOUND;
+
+    if (new_value == nullptr && (node->left.load() == nullptr || node->right.load() == nullptr)) {
+        CLink* damaged;
+        {
+            std::lock_guard<std::mutex> parent_guard(parent->lock);
+            if (parent->version.load() == UNLINKED || node->parent.load() != parent) return RETRY;
+            {
+                std::lock_guard<std::mutex> node_guard(node->lock);
+                if (!node->present.load()) return NOT_FOUND;
+                if (!attemptUnlink_nl(parent, node)) return RETRY;
+            }
+            size_--;
+            damaged = fixHeight_nl(parent);
+        }
+        retire(node);
+        fixHeightAndRebalance(damaged);
+        return FOUND;
+    }
+
+    std::lock_guard<std::mutex> guard(node->lock);
+    if (node->version.load() == UNLINKED) return RETRY;
+    if (new_value == nullptr) {
+        // it lost a child since the check above, so it can be unlinked now
+        if (node->left.load() == nullptr || node->right.load() == nullptr) return RETRY;
+        if (node->present.exchange(false)) size_--;
+        return FOUND;
+    }
+    node->value = *new_value;
+    if (!node->present.exchange(true)) size_++;
+    return FOUND;
+}
+
+/**
+* Splices node, which has at most one child, out from under parent. Both
+* are locked. Returns false if the tree changed so that this is no
+* longer possible. Doesn't fix any heights.
+*/
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::attemptUnlink_nl(CLink* parent, CNode* node)
+{
+    CNode* parent_left = parent->left.load();
+    CNode* parent_right = parent->right.load();
+    if (parent_left != node && parent_right != node) return false;
+
+    CNode* left = node->left.load();
+    CNode* right = node->right.load();
+    if (left != nullptr && right != nullptr) return false;
+
+    CNode* splice = left != nullptr ? left : right;
+    if (parent_left == node) parent->left = splice;
+    else parent->right = splice;
+    if (splice != nullptr) splice->parent = parent;
+
+    node->version = UNLINKED;
+    node->present = false;
+    return true;
+}
+
+/**
+* Unlinks node if a rotation left it a routing node with a free child
+* slot. Both parent and node are locked.
+*/
+template<class Key, class Value, class Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::unlinkIfRouting_nl(CLink* parent, CNode* node)
+{
+    if (node->present.load() || (node->left.load() != nullptr && node->right.load() != nullptr)) return false;
+    if (!attemptUnlink_nl(parent, node)) return false;
+    retire(node);
+    return true;
+}
+
+/**
+* Hands over a node that was just unlinked, to be freed once no pinned
+* operation can still be on it. The epoch is read after the unlink, so
+* anyone pinned in a later epoch started after the node was gone.
+*/
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::retire(CNode* node)
+{
+    unsigned stripe = threadStripe();
+    Stripe& mine = stripes_[stripe];
+    unsigned long long epoch;
+    bool full;
+    {
+        // read under the lock, so the stripe's tags only ever go up
+        std::lock_guard<std::mutex> guard(mine.lock);
+        epoch = epoch_.load();
+        freeRetired_nl(stripe, epoch);
+        // the list for this epoch's slot is empty or already this epoch's
+        mine.retired[epoch % 3].push_back(node);
+        mine.retiredEpoch[epoch % 3] = epoch;
+        mine.pending++;
+        full = mine.pending >= RETIRE_BATCH;
+    }
+    if (full) tryAdvanceEpoch(epoch);
+}
+
+// the stripe of the calling thread, handed out round robin on first use
+template<class Key, class Value, class Compare>
+unsigned ConcurrentAVLTree<Key, Value, Compare>::threadStripe()
+{
+    static std::atomic<unsigned> next(0);
+    static thread_local unsigned stripe = next++ % STRIPES;
+    return stripe;
+}
+
+// helper to free a stripe's nodes retired two or more epochs before
+// epoch, with the stripe locked
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::freeRetired_nl(unsigned stripe, unsigned long long epoch)
+{
+    Stripe& s = stripes_[stripe];
+    for (int i = 0; i < 3; i++) {
+        if (s.retired[i].empty() || s.retiredEpoch[i] + 2 > epoch) continue;
+        for (size_t j = 0; j < s.retired[i].size(); j++) delete s.retired[i][j];
+        s.pending -= s.retired[i].size();
+        s.retired[i].clear();
+    }
+}
+
+/**
+* Moves the epoch on from epoch if nobody is still pinned in the one
+* before it, then frees what that made safe in the calling thread's
+* stripe. Other stripes free theirs on their next retire.
+*/
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::tryAdvanceEpoch(unsigned long long epoch)
+{
+    if (epoch > 0) {
+        for (unsigned stripe = 0; stripe < STRIPES; stripe++) {
+            if (stripes_[stripe].pins[(epoch - 1) % 3].load() != 0) return;
+        }
+    }
+    epoch_.compare_exchange_strong(epoch, epoch + 1);
+
+    unsigned stripe = threadStripe();
+    std::lock_guard<std::mutex> guard(stripes_[stripe].lock);
+    freeRetired_nl(stripe, epoch_.load());
+}
+
+/**
+* What node needs, judged from racy reads: UNLINK_REQUIRED for a routing
+* node with a free child slot, REBALANCE_REQUIRED, its corrected height,
+* or NOTHING_REQUIRED.
+*/
+template<class Key, class Value, class Compare>
+int ConcurrentAVLTree<Key, Value, Compare>::nodeCondition(CNode* node) const
+{
+    CNode* left = node->left.load();
+    CNode* right = node->right.load();
+    if ((left == nullptr || right == nullptr) && !node->present.load()) return UNLINK_REQUIRED;
+
+    int h = node->height.load();
+    int hL = height(left);
+    int hR = height(right);
+    int h_repl = 1 + std::max(hL, hR);
+    if (hL - hR < -1 || hL - hR > 1) return REBALANCE_REQUIRED;
+    return h != h_repl ? h_repl : NOTHING_REQUIRED;
+}
+
+/**
+* Walks up from link fixing heights, rotating and unlinking routing
+* nodes, until nothing is left to fix. Every step locks only what it
+* changes, and the walk stops at the root holder.
+*/
+template<class Key, class Value, class Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::fixHeightAndRebalance(CLink* link)
+{
+    while (link != nullptr && link->parent.load() != nullptr) {
+        CNode* node = static_cast<CNode*>(link);
+        int condition = nodeCondition(node);
+        if (condition == NOTHING_REQUIRED || node->version.load() == UNLINKED) return;
+
+        if (condition != UNLINK_REQUIRED && condition != REBALANCE_REQUIRED) {
+            std::lock_guard<std::mutex> guard(node->lock);
+            link = fixHeight_nl(node);
+        } else {
+            CLink* parent = node->parent.load();
+            std::lock_guard<std::mutex> parent_guard(parent->lock);
+            if (parent->version.load() != UNLINKED && node->parent.load() == parent) {
+                std::lock_guard<std::mutex> node_guard(node->lock);
+                link = rebalance_nl(parent, node);
+            }
+            // otherwise try again with the new parent
+        }
+    }
+}
+
+/**
+* Fixes the height of link, which is locked, and returns the next node
+* that may need fixing: its parent, link itself if it needs more than a
+* height change, or null if nothing does.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::CLink*
+ConcurrentAVLTree<Key, Value, Compare>::fixHeight_nl(CLink* link)
+{
+    // the root holder has no height to fix
+    if (link->parent.load() == nullptr) return nullptr;
+
+    CNode* node = static_cast<CNode*>(link);
+    int condition = nodeCondition(node);
+    switch (condition) {
+        case REBALANCE_REQUIRED:
+        case UNLINK_REQUIRED:
+            return node;
+        case NOTHING_REQUIRED:
+            return nullptr;
+        default:
+            node->height = condition;
+            return node->parent.load();
+    }
+}
+
+/**
+* Unlinks or rotates n, with parent and n locked. Returns the next node
+* that may need fixing, or null.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::CLink*
+ConcurrentAVLTree<Key, Value, Compare>::rebalance_nl(CLink* parent, CNode* n)
+{
+    CNode* nL = n->left.load();
+    CNode* nR = n->right.load();
+
+    if ((nL == nullptr || nR == nullptr) && !n->present.load()) {
+        if (!attemptUnlink_nl(parent, n)) return n;
+        retire(n);
+        return fixHeight_nl(parent);
+    }
+
+    int hN = n->height.load();
+    int hL0 = height(nL);
+    int hR0 = height(nR);
+    int h_repl = 1 + std::max(hL0, hR0);
+    int balance = hL0 - hR0;
+
+    if (balance > 1) return rebalanceToRight_nl(parent, n, nL, hR0);
+    if (balance < -1) return rebalanceToLeft_nl(parent, n, nR, hL0);
+    if (h_repl != hN) {
+        n->height = h_repl;
+        return fixHeight_nl(parent);
+    }
+    return nullptr;
+}
+
+/**
+* n's left side is too tall: rotate right, first rotating nL left if its
+* inner child is the taller one. Locks nL, and nLR for a double rotation.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::CLink*
+ConcurrentAVLTree<Key, Value, Compare>::rebalanceToRight_nl(CLink* parent, CNode* n, CNode* nL, int hR0)
+{
+    std::lock_guard<std::mutex> left_guard(nL->lock);
+    int hL = nL->height.load();
+    if (hL - hR0 <= 1) return n;  // retry
+
+    CNode* nLR = nL->right.load();
+    int hLL0 = height(nL->left.load());
+    int hLR0 = height(nLR);
+    if (hLL0 >= hLR0) return rotateRight_nl(parent, n, nL, hR0, hLL0, nLR, hLR0);
+
+    {
+        std::lock_guard<std::mutex> left_right_guard(nLR->lock);
+        // our hLR0 may be stale, a single rotation may be enough
+        int hLR = nLR->height.load();
+        if (hLL0 >= hLR) return rotateRight_nl(parent, n, nL, hR0, hLL0, nLR, hLR);
+
+        // only do the double rotation if it leaves nL balanced,
+        // otherwise fix nL on its own first
+        int hLRL = height(nLR->left.load());
+        int b = hLL0 - hLRL;
+        if (b >= -1 && b <= 1) return rotateRightOverLeft_nl(parent, n, nL, hR0, hLL0, nLR, hLRL);
+    }
+    return rebalanceToLeft_nl(n, nL, nLR, hLL0);
+}
+
+/**
+* The mirror image of rebalanceToRight_nl.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::CLink*
+ConcurrentAVLTree<Key, Value, Compare>::rebalanceToLeft_nl(CLink* parent, CNode* n, CNode* nR, int hL0)
+{
+    std::lock_guard<std::mutex> right_guard(nR->lock);
+    int hR = nR->height.load();
+    if (hL0 - hR >= -1) return n;  // retry
+
+    CNode* nRL = nR->left.load();
+    int hRL0 = height(nRL);
+    int hRR0 = height(nR->right.load());
+    if (hRR0 >= hRL0) return rotateLeft_nl(parent, n, hL0, nR, nRL, hRL0, hRR0);
+
+    {
+        std::lock_guard<std::mutex> right_left_guard(nRL->lock);
+        int hRL = nRL->height.load();
+        if (hRR0 >= hRL) return rotateLeft_nl(parent, n, hL0, nR, nRL, hRL, hRR0);
+
+        int hRLR = height(nRL->right.load());
+        int b = hRR0 - hRLR;
+        if (b >= -1 && b <= 1) return rotateLeftOverRight_nl(parent, n, hL0, nR, nRL, hRR0, hRLR);
+    }
+    return rebalanceToRight_nl(n, nR, nRL, hRR0);
+}
+
+/**
+* Rotates n down to the right under nL. n is marked as changing for the
+* duration, and the links from n are changed before the links to it, so
+* a reader that still reaches n sees the mark or the new version.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::CLink*
+ConcurrentAVLTree<Key, Value, Compare>::rotateRight_nl(
+    CLink* parent, CNode* n, CNode* nL, int hR, int hLL, CNode* nLR, int hLR)
+{
+    long long node_version = n->version.load();
+    CNode* parent_left = parent->left.load();
+
+    n->version = node_version | CHANGING;
+
+    n->left = nLR;
+    if (nLR != nullptr) nLR->parent = n;
+    nL->right = n;
+    n->parent = nL;
+    if (parent_left == n) parent->left = nL;
+    else parent->right = nL;
+    nL->parent = parent;
+
+    int hN_repl = 1 + std::max(hLR, hR);
+    n->height = hN_repl;
+    nL->height = 1 + std::max(hLL, hN_repl);
+
+    n->version = node_version + COUNT_INCR;
+
+    // a routing n that lost its left child is spliced out right away
+    bool n_gone = unlinkIfRouting_nl(nL, n);
+    if (n_gone) {
+        hN_repl = hR;
+        nL->height = 1 + std::max(hLL, hN_repl);
+    }
+
+    // n is the deepest damaged node, then nL, then parent
+    if (!n_gone && (hLR - hR < -1 || hLR - hR > 1)) return n;
+    if (hLL - hN_repl < -1 || hLL - hN_repl > 1) return nL;
+    return fixHeight_nl(parent);
+}
+
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::CLink*
+ConcurrentAVLTree<Key, Value, Compare>::rotateLeft_nl(
+    CLink* parent, CNode* n, int hL, CNode* nR, CNode* nRL, int hRL, int hRR)
+{
+    long long node_version = n->version.load();
+    CNode* parent_left = parent->left.load();
+
+    n->version = node_version | CHANGING;
+
+    n->right = nRL;
+    if (nRL != nullptr) nRL->parent = n;
+    nR->left = n;
+    n->parent = nR;
+    if (parent_left == n) parent->left = nR;
+    else parent->right = nR;
+    nR->parent = parent;
+
+    int hN_repl = 1 + std::max(hL, hRL);
+    n->height = hN_repl;
+    nR->height = 1 + std::max(hN_repl, hRR);
+
+    n->version = node_version + COUNT_INCR;
+
+    bool n_gone = unlinkIfRouting_nl(nR, n);
+    if (n_gone) {
+        hN_repl = hL;
+        nR->height = 1 + std::max(hN_repl, hRR);
+    }
+
+    if (!n_gone && (hRL - hL < -1 || hRL - hL > 1)) return n;
+    if (hRR - hN_repl < -1 || hRR - hN_repl > 1) return nR;
+    return fixHeight_nl(parent);
+}
+
+/**
+* The double rotation: nLR comes up over both nL and n, which both move
+* down and so are both marked as changing.
+*/
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::CLink*
+ConcurrentAVLTree<Key, Value, Compare>::rotateRightOverLeft_nl(
+    CLink* parent, CNode* n, CNode* nL, int hR, int hLL, CNode* nLR, int hLRL)
+{
+    long long node_version = n->version.load();
+    long long left_version = nL->version.load();
+    CNode* parent_left = parent->left.load();
+    CNode* nLRL = nLR->left.load();
+    CNode* nLRR = nLR->right.load();
+    int hLRR = height(nLRR);
+
+    n->version = node_version | CHANGING;
+    nL->version = left_version | CHANGING;
+
+    n->left = nLRR;
+    if (nLRR != nullptr) nLRR->parent = n;
+    nL->right = nLRL;
+    if (nLRL != nullptr) nLRL->parent = nL;
+    nLR->left = nL;
+    nL->parent = nLR;
+    nLR->right = n;
+    n->parent = nLR;
+    if (parent_left == n) parent->left = nLR;
+    else parent->right = nLR;
+    nLR->parent = parent;
+
+    int hN_repl = 1 + std::max(hLRR, hR);
+    n->height = hN_repl;
+    int hL_repl = 1 + std::max(hLL, hLRL);
+    nL->height = hL_repl;
+    nLR->height = 1 + std::max(hL_repl, hN_repl);
+
+    n->version = node_version + COUNT_INCR;
+    nL->version = left_version + COUNT_INCR;
+
+    bool n_gone = unlinkIfRouting_nl(nLR, n);
+    if (n_gone) hN_repl = hR;
+    if (unlinkIfRouting_nl(nLR, nL)) hL_repl = hLL;
+    nLR->height = 1 + std::max(hL_repl, hN_repl);
+
+    if (!n_gone && (hLRR - hR < -1 || hLRR - hR > 1)) return n;
+    if (hL_repl - hN_repl < -1 || hL_repl - hN_repl > 1) return nLR;
+    return fixHeight_nl(parent);
+}
+
+template<class Key, class Value, class Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::CLink*
+ConcurrentAVLTree<Key, Value, Compare>::rotateLeftOverRight_nl(
+    CLink* parent, CNode* n, int hL, CNode* nR, CNode* nRL, int hRR, int hRLR)
+{
+    long long node_version = n->version.load();
+    long long right_version = nR->version.load();
+    CNode* parent_left = parent->left.load();
+    CNode* nRLL = nRL->left.load();
+    CNode* nRLR = nRL->right.load();
+    int hRLL = height(nRLL);
+
+    n->version = node_version | CHANGING;
+    nR->version = right_version | CHANGING;
+
+    n->right = nRLL;
+    if (nRLL != nullptr) nRLL->parent = n;
+    nR->left = nRLR;
+    if (nRLR != nullptr) nRLR->parent = nR;
+    nRL->right = nR;
+    nR->parent = nRL;
+    nRL->left = n;
+    n->parent = nRL;
+    if (parent_left == n) parent->left = nRL;
+    else parent->right = nRL;
+    nRL->parent = parent;
+
+    int hN_repl = 1 + std::max(hL, hRLL);
+    n->height = hN_repl;
+    int hR_repl = 1 + std::max(hRLR, hRR);
+    nR->height = hR_repl;
+    nRL->height = 1 + std::max(hN_repl, hR_repl);
+
+    n->version = node_version + COUNT_INCR;
+    nR->version = right_version + COUNT_INCR;
+
+    bool n_gone = unlinkIfRouting_nl(nRL, n);
+    if (n_gone) hN_repl = hL;
+    if (unlinkIfRouting_nl(nRL, nR)) hR_repl = hRR;
+    nRL->height = 1 + std::max(hN_repl, hR_repl);
+
+    if (!n_gone && (hRLL - hL < -1 || hRLL - hL > 1)) return n;
+    if (hR_repl - hN_repl < -1 || hR_repl - hN_repl > 1) return nRL;
+    return fixHeight_nl(parent);
+}
+
+/*
+---------------------------------------------------------
+End helper functions for the ConcurrentAVLTree class.
+---------------------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,445 @@
+#ifndef DURABLE_BST_H
+#define DURABLE_BST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <utility>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <type_traits>
+#include <functional>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bst.h"
+#include "frozen_bst.h"
+
+/**
+* A search tree whose inserts and removes survive a crash once they
+* return, by way of a write-ahead log.
+*
+* Every mutation is applied to the in-memory Tree (a BinarySearchTree by
+* default, or anything with the same insert/remove/find/assign) and
+* appended to the log, and only returns once the log is synced to disk.
+* With group commit, writers that arrive while a sync is in flight queue
+* their records, and the next sync covers all of them: one thread writes
+* and fdatasyncs the whole batch while the others wait for it, so N
+* concurrent writers pay for about one sync instead of N. Without it
+* every mutation is written and synced on its own, under the lock.
+*
+* checkpoint() saves the tree as a FrozenTree snapshot file and empties
+* the log. Opening a DurableTree loads the last snapshot, if there is
+* one, and replays the log on top of it. Records are checked one by one
+* and the log is cut at the first torn or corrupt record, which can only
+* be the tail left by a crash mid-write. Replaying records the snapshot
+* already has is harmless, since they are applied in order, so a crash
+* between saving the snapshot and emptying the log loses nothing.
+*
+* Keys and values must be trivially copyable; records are their bytes:
+*
+*   log header, 32 bytes: magic, version, byte order, key size, value size
+*   each record: 'I' key value checksum, or 'R' key checksum
+*
+* where checksum is fnv1a_words of the record's other bytes. Writers see
+* each other's mutations as soon as they are applied, before they are
+* durable; a mutation whose sync fails throws, but stays in the tree.
+* A failed write may leave part of a record in the log, and replay stops
+* there, so from then on every insert, remove and checkpoint throws
+* (fail-stop) instead of appending records no restart would see. Opening
+* the log again cuts the partial record off and carries on from there.
+* All operations take one lock, the tree itself is not thread safe.
+*/
+template <typename Key, typename Value,
+          typename Compare = std::less<Key>,
+          typename Tree = BinarySearchTree<Key, Value, Compare> >
+class DurableTree
+{
+public:
+    typedef Tree tree_type;
+
+    DurableTree(const std::string& log_path, const std::string& snapshot_path, bool group_commit = true);
+    ~DurableTree();
+
+    void insert(const std::pair<const Key, Value>& new_item);
+    void remove(const Key& key);
+    bool find(const Key& key, Value& value) const;
+    std::size_t size() const;
+
+    // saves a snapshot and empties the log
+    void checkpoint();
+
+    // runs fn on the tree with the lock held, for anything else that reads it
+    template<typename Fn>
+    void read(Fn fn) const;
+
+protected:
+    // the first 32 bytes of a log file
+    struct LogHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint32_t keySize;
+        uint32_t valueSize;
+        char padding[8];
+    };
+    static const uint32_t LOG_VERSION = 1;
+    static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+    static const unsigned char INSERT_RECORD = 'I';
+    static const unsigned char REMOVE_RECORD = 'R';
+
+    void checkWritable() const;
+    void append(unsigned char type, const Key& key, const Value* value);
+    void commit(std::unique_lock<std::mutex>& guard, uint64_t record);
+    void writeAndSync(const std::vector<unsigned char>& bytes);
+    void recover();
+    std::size_t replay(const std::vector<unsigned char>& log);
+    void resetLog();
+    void syncDirectory(const std::string& path);
+
+private:
+    DurableTree(const DurableTree&);
+    DurableTree& operator=(const DurableTree&);
+
+    Tree tree_;
+    std::string logPath_;
+    std::string snapshotPath_;
+    bool groupCommit_;
+    int fd_;
+
+    mutable std::mutex lock_;
+    std::condition_variable synced_;
+    std::vector<unsigned char> pending_;  // appended records not written yet
+    uint64_t appended_;                   // records appended so far
+    uint64_t durable_;                    // records known to be on disk
+    bool syncing_;                        // a thread is writing a batch
+    std::string error_;                   // why a write failed, if one did
+};
+
+/*
+-----------------------------------------------
+Begin implementations for the DurableTree class.
+-----------------------------------------------
+*/
+
+/**
+* Opens (or creates) the log, loads the snapshot if there is one and
+* replays the log on top of it. Throws std::runtime_error if the log or
+* snapshot can't be read or was written for other key or value types.
+*/
+template<class Key, class Value, class Compare, class Tree>
+DurableTree<Key, Value, Compare, Tree>::DurableTree(const std::string& log_path, const std::string& snapshot_path,
+                                                    bool group_commit) :
+    logPath_(log_path), snapshotPath_(snapshot_path), groupCommit_(group_commit), fd_(-1),
+    appended_(0), durable_(0), syncing_(false)
+{
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+                  "log records need trivially copyable keys and values");
+    static_assert(sizeof(LogHeader) == 32, "the log header is 32 bytes");
+    recover();
+}
+
+/**
+* Everything that returned is already on disk, so this just closes the log.
+*/
+template<class Key, class Value, class Compare, class Tree>
+DurableTree<Key, Value, Compare, Tree>::~DurableTree()
+{
+    if (fd_ >= 0) ::close(fd_);
+}
+
+/**
+* Inserts new_item, or overwrites the value if the key is already there,
+* and returns once the change is on disk.
+*/
+template<class Key, class Value, class Compare, class Tree>
+void DurableTree<Key, Value, Compare, Tree>::insert(const std::pair<const Key, Value>& new_item)
+{
+    std::unique_lock<std::mutex> guard(lock_);
+    checkWritable();
+    tree_.insert(new_item);
+    append(INSERT_RECORD, new_item.first, &new_item.second);
+    commit(guard, appended_);
+}
+
+/**
+* Removes key if it is there, and returns once the change is on disk.
+*/
+template<class Key, class Value, class Compare, class Tree>
+void DurableTree<Key, Value, Compare, Tree>::remove(const Key& key)
+{
+    std::unique_lock<std::mutex> guard(lock_);
+    checkWritable();
+    tree_.remove(key);
+    append(REMOVE_RECORD, key, nullptr);
+    commit(guard, appended_);
+}
+
+/**
+* Copies the value for key into value, returns false if key is not there.
+*/
+template<class Key, class Value, class Compare, class Tree>
+bool DurableTree<Key, Value, Compare, Tree>::find(const Key& key, Value& value) const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    typename Tree::const_iterator it = tree_.find(key);
+    if (it == tree_.end()) return false;
+    value = it->second;
+    return true;
+}
+
+template<class Key, class Value, class Compare, class Tree>
+std::size_t DurableTree<Key, Value, Compare, Tree>::size() const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    return tree_.size();
+}
+
+template<class Key, class Value, class Compare, class Tree>
+template<typename Fn>
+void DurableTree<Key, Value, Compare, Tree>::read(Fn fn) const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    fn(static_cast<const Tree&>(tree_));
+}
+
+/**
+* Saves the whole tree as a snapshot and empties the log. The snapshot
+* goes to a temporary file that is synced and then renamed over the old
+* one, so there is a complete snapshot on disk at every moment. The
+* directory is synced after the rename, before the log is emptied, or a
+* power cut could keep the empty log but not the new snapshot. Writers
+* wait until it is done. If emptying the log fails, the tree refuses
+* writes from then on, as after any other failed write.
+*/
+template<class Key, class Value, class Compare, class Tree>
+void DurableTree<Key, Value, Compare, Tree>::checkpoint()
+{
+    std::unique_lock<std::mutex> guard(lock_);
+    checkWritable();
+    commit(guard, appended_);
+    while (syncing_) synced_.wait(guard);
+
+    const std::string temp_path = snapshotPath_ + ".tmp";
+    FrozenTree<Key, Value, Compare>(tree_.begin(), tree_.end(), tree_.key_comp()).save(temp_path);
+    int fd = ::open(temp_path.c_str(), O_RDONLY);
+    bool ok = fd >= 0 && ::fsync(fd) == 0;
+    if (fd >= 0) ::close(fd);
+    if (!ok || std::rename(temp_path.c_str(), snapshotPath_.c_str()) != 0) {
+        throw std::runtime_error("can't save snapshot " + snapshotPath_);
+    }
+    syncDirectory(snapshotPath_);
+    resetLog();
+}
+
+// helper to refuse any more writes once one has failed
+template<class Key, class Value, class Compare, class Tree>
+void DurableTree<Key, Value, Compare, Tree>::checkWritable() const
+{
+    if (!error_.empty()) throw std::runtime_error("log " + logPath_ + " is closed after a failed write: " + error_);
+}
+
+// helper to add one record to the pending batch
+template<class Key, class Value, class Compare, class Tree>
+void DurableTree<Key, Value, Compare, Tree>::append(unsigned char type, const Key& key, const Value* value)
+{
+    std::size_t start = pending_.size();
+    pending_.push_back(type);
+    const unsigned char* key_bytes = reinterpret_cast<const unsigned char*>(&key);
+    pending_.insert(pending_.end(), key_bytes, key_bytes + sizeof(Key));
+    if (value) {
+        const unsigned char* value_bytes = reinterpret_cast<const unsigned char*>(value);
+        pending_.insert(pending_.end(), value_bytes, value_bytes + sizeof(Value));
+    }
+    uint64_t checksum = fnv1a_words(pending_.data() + start, pending_.size() - start);
+    const unsigned char* checksum_bytes = reinterpret_cast<const unsigned char*>(&checksum);
+    pending_.insert(pending_.end(), checksum_bytes, checksum_bytes + sizeof(checksum));
+    appended_++;
+}
+
+/**
+* Waits until the first record records are on disk. With group commit the
+* first thread to find no sync running takes every pending record and
+* syncs them with the lock released, while later writers keep appending;
+* whoever is still waiting when it is done either finds its record
+* covered or starts the next batch. Throws std::runtime_error if the
+* write or sync failed, then or in an earlier batch still ahead of record.
+*/
+template<class Key, class Value, class Compare, class Tree>
+void DurableTree<Key, Value, Compare, Tree>::commit(std::unique_lock<std::mutex>& guard, uint64_t record)
+{
+    if (!groupCommit_) {
+        std::vector<unsigned char> batch;
+        batch.swap(pending_);
+        try {
+            writeAndSync(batch);
+        } catch (const std::runtime_error& e) {
+            error_ = e.what();
+            throw;
+        }
+        durable_ = appended_;
+        return;
+    }
+
+    while (durable_ < record) {
+        checkWritable();
+        if (syncing_) {
+            synced_.wait(guard);
+            continue;
+        }
+
+        syncing_ = true;
+        std::vector<unsigned char> batch;
+        batch.swap(pending_);
+        uint64_t batch_end = appended_;
+        guard.unlock();
+        std::string error;
+        try {
+            writeAndSync(batch);
+        } catch (const std::runtime_error& e) {
+            error = e.what();
+        }
+        guard.lock();
+
+        syncing_ = false;
+        if (error.empty()) durable_ = batch_end;
+        else error_ = error;
+        synced_.notify_all();
+    }
+}
+
+// helper to append bytes to the log file and wait for them to reach the disk
+template<class Key, class Value, class Compare, class Tree>
+void DurableTree<Key, Value, Compare, Tree>::writeAndSync(const std::vector<unsigned char>& bytes)
+{
+    std::size_t written = 0;
+    while (written < bytes.size()) {
+        ssize_t got = ::write(fd_, bytes.data() + written, bytes.size() - written);
+        if (got < 0) throw std::runtime_error("can't write log " + logPath_);
+        written += static_cast<std::size_t>(got);
+    }
+    if (::fdatasync(fd_) != 0) throw std::runtime_error("can't sync log " + logPath_);
+}
+
+/**
+* Loads the snapshot, replays the log and cuts off any torn tail, leaving
+* the log open for appending. A missing or empty log gets a new header,
+* and the directory is synced so the new log's name is on disk too.
+*/
+template<class Key, class Value, class Compare, class Tree>
+void DurableTree<Key, Value, Compare, Tree>::recover()
+{
+    if (::access(snapshotPath_.c_str(), F_OK) == 0) {
+        FrozenTree<Key, Value, Compare> snapshot = FrozenTree<Key, Value, Compare>::open(snapshotPath_);
+        tree_.assign(snapshot.begin(), snapshot.end());
+    }
+
+    fd_ = ::open(logPath_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0) throw std::runtime_error("can't open log " + logPath_);
+    syncDirectory(logPath_);
+
+    std::vector<unsigned char> log;
+    unsigned char chunk[65536];
+    for (ssize_t got; (got = ::read(fd_, chunk, sizeof(chunk))) != 0;) {
+        if (got < 0) throw std::runtime_error("can't read log " + logPath_);
+        log.insert(log.end(), chunk, chunk + got);
+    }
+    if (log.empty()) {
+        resetLog();
+        return;
+    }
+
+    LogHeader header;
+    if (log.size() < sizeof(header)) throw std::runtime_error(logPath_ + " is not a log");
+    std::memcpy(&header, log.data(), sizeof(header));
+    if (std::memcmp(header.magic, "BSTWAL", 7) != 0 || header.version != LOG_VERSION ||
+        header.byteOrder != BYTE_ORDER_MARK) {
+        throw std::runtime_error(logPath_ + " is not a log of this version");
+    }
+    if (header.keySize != sizeof(Key) || header.valueSize != sizeof(Value)) {
+        throw std::runtime_error("log " + logPath_ + " holds other key or value types");
+    }
+
+    std::size_t good = replay(log);
+    if (good != log.size() && (::ftruncate(fd_, good) != 0 || ::fsync(fd_) != 0)) {
+        throw std::runtime_error("can't cut the torn tail off log " + logPath_);
+    }
+}
+
+// helper to apply the log's records to the tree in order, returns where
+// the last intact record ends
+template<class Key, class Value, class Compare, class Tree>
+std::size_t DurableTree<Key, Value, Compare, Tree>::replay(const std::vector<unsigned char>& log)
+{
+    std::size_t at = sizeof(LogHeader);
+    while (at < log.size()) {
+        unsigned char type = log[at];
+        std::size_t length = 1 + sizeof(Key) + (type == INSERT_RECORD ? sizeof(Value) : 0);
+        if ((type != INSERT_RECORD && type != REMOVE_RECORD) || log.size() - at < length + sizeof(uint64_t)) break;
+
+        uint64_t checksum;
+        std::memcpy(&checksum, log.data() + at + length, sizeof(checksum));
+        if (fnv1a_words(log.data() + at, length) != checksum) break;
+
+        Key key;
+        std::memcpy(&key, log.data() + at + 1, sizeof(Key));
+        if (type == INSERT_RECORD) {
+            Value value;
+            std::memcpy(&value, log.data() + at + 1 + sizeof(Key), sizeof(Value));
+            tree_.insert(std::pair<const Key, Value>(key, value));
+        } else {
+            tree_.remove(key);
+        }
+        at += length + sizeof(uint64_t);
+    }
+    return at;
+}
+
+// helper to empty the log down to a fresh header, synced. If that fails
+// the log may be left empty or without its header, so the tree refuses
+// any more writes rather than append records to it.
+template<class Key, class Value, class Compare, class Tree>
+void DurableTree<Key, Value, Compare, Tree>::resetLog()
+{
+    LogHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "BSTWAL", 7);
+    header.version = LOG_VERSION;
+    header.byteOrder = BYTE_ORDER_MARK;
+    header.keySize = sizeof(Key);
+    header.valueSize = sizeof(Value);
+
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&header);
+    try {
+        if (::ftruncate(fd_, 0) != 0) throw std::runtime_error("can't empty log " + logPath_);
+        writeAndSync(std::vector<unsigned char>(bytes, bytes + sizeof(header)));
+    } catch (const std::runtime_error& e) {
+        error_ = e.what();
+        throw;
+    }
+}
+
+// helper to fsync the directory holding path, which makes the names
+// created or renamed in it as durable as the files' contents
+template<class Key, class Value, class Compare, class Tree>
+void DurableTree<Key, Value, Compare, Tree>::syncDirectory(const std::string& path)
+{
+    std::string::size_type slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    bool ok = fd >= 0 && ::fsync(fd) == 0;
+    if (fd >= 0) ::close(fd);
+    if (!ok) throw std::runtime_error("can't sync directory " + directory);
+}
+
+/*
+---------------------------------------------
+End implementations for the DurableTree class.
+---------------------------------------------
+*/
+
+#endif
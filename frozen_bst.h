@@ -0,0 +1,526 @@
+#ifndef FROZEN_BST_H
+#define FROZEN_BST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <type_traits>
+#include <cstdio>
+#include <cstring>
+#include "bst.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define BST_HAVE_MMAP 1
+#endif
+
+// helper to continue a 64-bit FNV-1a hash over data, a word at a time so
+// a big file hashes at memory speed rather than a byte per multiply. The
+// checksum of snapshot files, and of write-ahead log records.
+inline uint64_t fnv1a_words(const unsigned char* data, std::size_t bytes,
+                            uint64_t hash = 14695981039346656037ull)
+{
+    const uint64_t PRIME = 1099511628211ull;
+    std::size_t i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * PRIME;
+    }
+    for (; i < bytes; i++) hash = (hash ^ data[i]) * PRIME;
+    return hash;
+}
+
+/**
+* An immutable, read-only snapshot of a search tree, made by
+* AVLTree::freeze().
+*
+* The keys are stored in one array in Eytzinger (BFS) order: the root at
+* index 1 and the children of index k at 2k and 2k + 1 (the array itself
+* is 0-based, so index k lives at keys_[k - 1]). The values are in a
+* parallel array in the same order, so searching only ever touches keys.
+* A search needs no pointers, and its only branch is the loop: every level
+* is k = 2k + (key at k < target), and the first levels share cache lines.
+* Each step also prefetches the cache line holding the node's descendants
+* a few levels down, so the misses for deep levels start early.
+*
+* Since the layout has no pointers, save() writes the two arrays to a file
+* as they are, and open() maps such a file and searches the mapped pages
+* directly, without reading or copying anything up front. Both need
+* trivially copyable keys and values. The file format is:
+*
+*   header, padded to 64 bytes (see SnapshotHeader)
+*   keys, Eytzinger order, padded to a multiple of 64 bytes
+*   values, same order
+*
+* The header records the format version, the byte order, the key and value
+* sizes and a checksum of everything after it. A file is only good for
+* the same Compare it was saved with.
+*/
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class FrozenTree
+{
+public:
+    FrozenTree();
+    template<typename ForwardIt>
+    FrozenTree(ForwardIt first, ForwardIt last, const Compare& comp = Compare());
+
+    // the snapshot file, see above. Without verify, open() skips the
+    // checksum, which reads the whole file.
+    void save(const std::string& path) const;
+    static FrozenTree open(const std::string& path, bool verify = true, const Compare& comp = Compare());
+
+    bool empty() const;
+    std::size_t size() const;
+
+    /**
+    * Forward iterator over the entries in key order. Keys and values
+    * live in separate arrays, so it gives them out one at a time
+    * instead of as a pair.
+    */
+    class const_iterator
+    {
+    public:
+        const_iterator();
+
+        const Key& key() const;
+        const Value& value() const;
+
+        // the entry as a pair of references, so the iterator also works
+        // where a tree iterator's it->first and it->second are expected
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key&, const Value&> reference;
+        struct pointer {
+            reference item;
+            const reference* operator->() const { return &item; }
+        };
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+
+    protected:
+        friend class FrozenTree<Key, Value, Compare>;
+        const_iterator(const FrozenTree<Key, Value, Compare>* tree, std::size_t index);
+        const FrozenTree<Key, Value, Compare>* tree_;
+        std::size_t index_;  // 1-based Eytzinger index, 0 is the end
+    };
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator find(const Key& key) const;
+    const_iterator lower_bound(const Key& key) const;
+
+protected:
+    std::size_t lower_bound_index(const Key& key) const;
+    static std::size_t successor(std::size_t index, std::size_t n);
+    static std::size_t leftmost(std::size_t index, std::size_t n);
+
+    // the arrays, in the vectors or in a mapped file
+    const Key* keyData() const;
+    const Value* valueData() const;
+
+    // the first 64 bytes of a snapshot file
+    struct SnapshotHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint32_t keySize;
+        uint32_t valueSize;
+        uint64_t count;
+        uint64_t checksum;
+        char padding[24];
+    };
+    static const uint32_t SNAPSHOT_VERSION = 1;
+    static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+    static const std::size_t SNAPSHOT_ALIGN = 64;
+    static std::size_t padded(std::size_t bytes);
+
+    std::vector<Key> keys_;
+    std::vector<Value> values_;
+    // a mapped snapshot instead, kept alive as long as any copy uses it
+    std::shared_ptr<const void> mapping_;
+    const Key* mappedKeys_ = nullptr;
+    const Value* mappedValues_ = nullptr;
+    std::size_t mappedSize_ = 0;
+    Compare comp_;
+};
+
+/*
+-----------------------------------------------------------
+Begin implementations for the FrozenTree::const_iterator class.
+-----------------------------------------------------------
+*/
+
+/**
+* A default constructor that initializes the iterator to the end.
+*/
+template<class Key, class Value, class Compare>
+FrozenTree<Key, Value, Compare>::const_iterator::const_iterator() :
+    tree_(nullptr), index_(0)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+FrozenTree<Key, Value, Compare>::const_iterator::const_iterator(
+    const FrozenTree<Key, Value, Compare>* tree, std::size_t index) :
+    tree_(tree), index_(index)
+{
+
+}
+
+/**
+* The key of the current entry.
+*/
+template<class Key, class Value, class Compare>
+const Key& FrozenTree<Key, Value, Compare>::const_iterator::key() const
+{
+    return tree_->keyData()[index_ - 1];
+}
+
+/**
+* The value of the current entry.
+*/
+template<class Key, class Value, class Compare>
+const Value& FrozenTree<Key, Value, Compare>::const_iterator::value() const
+{
+    return tree_->valueData()[index_ - 1];
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenTree<Key, Value, Compare>::const_iterator::reference
+FrozenTree<Key, Value, Compare>::const_iterator::operator*() const
+{
+    return reference(key(), value());
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenTree<Key, Value, Compare>::const_iterator::pointer
+FrozenTree<Key, Value, Compare>::const_iterator::operator->() const
+{
+    pointer p = { reference(key(), value()) };
+    return p;
+}
+
+/**
+* Two iterators are equal when they are at the same entry, or both at the end.
+*/
+template<class Key, class Value, class Compare>
+bool FrozenTree<Key, Value, Compare>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    return index_ == rhs.index_;
+}
+
+template<class Key, class Value, class Compare>
+bool FrozenTree<Key, Value, Compare>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return index_ != rhs.index_;
+}
+
+/**
+* Moves to the next entry in key order.
+*/
+template<class Key, class Value, class Compare>
+typename FrozenTree<Key, Value, Compare>::const_iterator&
+FrozenTree<Key, Value, Compare>::const_iterator::operator++()
+{
+    index_ = successor(index_, tree_->size());
+    return *this;
+}
+
+/*
+---------------------------------------------------------
+End implementations for the FrozenTree::const_iterator class.
+---------------------------------------------------------
+*/
+
+/**
+* An empty snapshot.
+*/
+template<class Key, class Value, class Compare>
+FrozenTree<Key, Value, Compare>::FrozenTree()
+{
+
+}
+
+/**
+* Builds a snapshot from key/value pairs that are already sorted by comp
+* with no repeated keys, such as a tree's begin() to end().
+*/
+template<class Key, class Value, class Compare>
+template<typename ForwardIt>
+FrozenTree<Key, Value, Compare>::FrozenTree(ForwardIt first, ForwardIt last, const Compare& comp) :
+    comp_(comp)
+{
+    std::vector<ForwardIt> sorted;
+    for (; first != last; ++first) sorted.push_back(first);
+    const std::size_t n = sorted.size();
+
+    // an in-order walk of the implicit tree gives each slot its rank
+    std::vector<std::size_t> rank_at(n);
+    std::size_t rank = 0;
+    for (std::size_t k = leftmost(1, n); k != 0; k = successor(k, n)) rank_at[k - 1] = rank++;
+
+    keys_.reserve(n);
+    values_.reserve(n);
+    for (std::size_t i = 0; i < n; i++) {
+        keys_.push_back(sorted[rank_at[i]]->first);
+        values_.push_back(sorted[rank_at[i]]->second);
+    }
+}
+
+template<class Key, class Value, class Compare>
+bool FrozenTree<Key, Value, Compare>::empty() const
+{
+    return size() == 0;
+}
+
+template<class Key, class Value, class Compare>
+std::size_t FrozenTree<Key, Value, Compare>::size() const
+{
+    return mapping_ ? mappedSize_ : keys_.size();
+}
+
+template<class Key, class Value, class Compare>
+const Key* FrozenTree<Key, Value, Compare>::keyData() const
+{
+    return mapping_ ? mappedKeys_ : keys_.data();
+}
+
+template<class Key, class Value, class Compare>
+const Value* FrozenTree<Key, Value, Compare>::valueData() const
+{
+    return mapping_ ? mappedValues_ : values_.data();
+}
+
+/**
+* The entry with the smallest key.
+*/
+template<class Key, class Value, class Compare>
+typename FrozenTree<Key, Value, Compare>::const_iterator
+FrozenTree<Key, Value, Compare>::begin() const
+{
+    return const_iterator(this, leftmost(1, size()));
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenTree<Key, Value, Compare>::const_iterator
+FrozenTree<Key, Value, Compare>::end() const
+{
+    return const_iterator(this, 0);
+}
+
+/**
+* Returns the entry with the given key, or end() if there is none.
+*/
+template<class Key, class Value, class Compare>
+typename FrozenTree<Key, Value, Compare>::const_iterator
+FrozenTree<Key, Value, Compare>::find(const Key& key) const
+{
+    std::size_t k = lower_bound_index(key);
+    if (k != 0 && comp_(key, keyData()[k - 1])) k = 0;
+    return const_iterator(this, k);
+}
+
+/**
+* Returns the first entry whose key is not less than key, or end().
+*/
+template<class Key, class Value, class Compare>
+typename FrozenTree<Key, Value, Compare>::const_iterator
+FrozenTree<Key, Value, Compare>::lower_bound(const Key& key) const
+{
+    return const_iterator(this, lower_bound_index(key));
+}
+
+/**
+* The branchless descent. Going right appends a 1 bit to k and going left
+* a 0 bit, so once k falls off the bottom, the answer is the node where
+* the search last went left: strip the trailing 1s and the 0 before them.
+* If the search never went left, nothing is that big and that leaves 0.
+*/
+template<class Key, class Value, class Compare>
+std::size_t FrozenTree<Key, Value, Compare>::lower_bound_index(const Key& key) const
+{
+    // how many keys fit in a cache line, the k * STRIDE'th key starts the
+    // line holding k's descendants log2(STRIDE) levels further down
+    const std::size_t STRIDE = sizeof(Key) >= 64 ? 1 : 64 / sizeof(Key);
+
+    const Key* keys = keyData();
+    const std::size_t n = size();
+    std::size_t k = 1;
+    while (k <= n) {
+        BST_PREFETCH(keys + (k * STRIDE - 1));
+        k = 2 * k + static_cast<std::size_t>(comp_(keys[k - 1], key));
+    }
+
+#if defined(__GNUC__) || defined(__clang__)
+    k >>= __builtin_ctzll(~static_cast<unsigned long long>(k)) + 1;
+#else
+    while (k & 1) k >>= 1;
+    k >>= 1;
+#endif
+    return k;
+}
+
+/**
+* Writes the snapshot to path in the format described above, replacing
+* the file if there is one. Throws std::runtime_error if it can't.
+*/
+template<class Key, class Value, class Compare>
+void FrozenTree<Key, Value, Compare>::save(const std::string& path) const
+{
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+                  "snapshot files need trivially copyable keys and values");
+    const std::size_t n = size();
+    const unsigned char* keys = reinterpret_cast<const unsigned char*>(keyData());
+    const unsigned char* values = reinterpret_cast<const unsigned char*>(valueData());
+    const std::size_t key_bytes = n * sizeof(Key);
+    const std::size_t value_bytes = n * sizeof(Value);
+    const char zeros[SNAPSHOT_ALIGN] = { 0 };
+
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "BSTSNAP", 8);
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = BYTE_ORDER_MARK;
+    header.keySize = sizeof(Key);
+    header.valueSize = sizeof(Value);
+    header.count = n;
+    header.checksum = fnv1a_words(values, value_bytes, fnv1a_words(keys, key_bytes));
+
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file) throw std::runtime_error("can't create snapshot " + path);
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+              (key_bytes == 0 || std::fwrite(keys, key_bytes, 1, file) == 1) &&
+              (padded(key_bytes) == key_bytes || std::fwrite(zeros, padded(key_bytes) - key_bytes, 1, file) == 1) &&
+              (value_bytes == 0 || std::fwrite(values, value_bytes, 1, file) == 1);
+    if (std::fclose(file) != 0) ok = false;
+    if (!ok) throw std::runtime_error("can't write snapshot " + path);
+}
+
+/**
+* Maps a file written by save() and serves lookups straight from it. Only
+* the header is read here, the pages holding keys and values are faulted
+* in by the searches that touch them, so the first query comes in O(1)
+* file reads however big the file is. With verify the whole file is read
+* once to check the checksum first. Throws std::runtime_error if the file
+* is missing, truncated, from another version, byte order or key/value
+* type, or fails the checksum. Where mmap is missing the file is read into
+* memory instead.
+*/
+template<class Key, class Value, class Compare>
+FrozenTree<Key, Value, Compare> FrozenTree<Key, Value, Compare>::open(const std::string& path, bool verify,
+                                                                      const Compare& comp)
+{
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+                  "snapshot files need trivially copyable keys and values");
+    static_assert(sizeof(SnapshotHeader) == SNAPSHOT_ALIGN, "the header fills the first 64 bytes");
+
+    std::shared_ptr<const void> mapping;
+    std::size_t file_bytes;
+#ifdef BST_HAVE_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("can't open snapshot " + path);
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        throw std::runtime_error("can't open snapshot " + path);
+    }
+    file_bytes = static_cast<std::size_t>(info.st_size);
+    void* start = file_bytes ? mmap(nullptr, file_bytes, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (start == MAP_FAILED) throw std::runtime_error("can't map snapshot " + path);
+    mapping.reset(start, [file_bytes](const void* p) { munmap(const_cast<void*>(p), file_bytes); });
+#else
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file) throw std::runtime_error("can't open snapshot " + path);
+    std::vector<unsigned char> contents;
+    unsigned char chunk[65536];
+    for (std::size_t got; (got = std::fread(chunk, 1, sizeof(chunk), file)) > 0;) {
+        contents.insert(contents.end(), chunk, chunk + got);
+    }
+    std::fclose(file);
+    file_bytes = contents.size();
+    mapping = std::make_shared<std::vector<unsigned char> >(std::move(contents));
+    const void* start = static_cast<const std::vector<unsigned char>*>(mapping.get())->data();
+    mapping = std::shared_ptr<const void>(mapping, start);
+#endif
+
+    const unsigned char* bytes = static_cast<const unsigned char*>(mapping.get());
+    SnapshotHeader header;
+    if (file_bytes < sizeof(header)) throw std::runtime_error("snapshot " + path + " is truncated");
+    std::memcpy(&header, bytes, sizeof(header));
+    if (std::memcmp(header.magic, "BSTSNAP", 8) != 0) throw std::runtime_error(path + " is not a snapshot");
+    if (header.version != SNAPSHOT_VERSION) throw std::runtime_error("snapshot " + path + " has an unknown version");
+    if (header.byteOrder != BYTE_ORDER_MARK) throw std::runtime_error("snapshot " + path + " has the wrong byte order");
+    if (header.keySize != sizeof(Key) || header.valueSize != sizeof(Value)) {
+        throw std::runtime_error("snapshot " + path + " holds other key or value types");
+    }
+
+    const std::size_t n = static_cast<std::size_t>(header.count);
+    const std::size_t values_at = sizeof(header) + padded(n * sizeof(Key));
+    if (n > file_bytes / (sizeof(Key) + sizeof(Value)) || file_bytes != values_at + n * sizeof(Value)) {
+        throw std::runtime_error("snapshot " + path + " is truncated");
+    }
+    if (verify && fnv1a_words(bytes + values_at, n * sizeof(Value),
+                              fnv1a_words(bytes + sizeof(header), n * sizeof(Key))) != header.checksum) {
+        throw std::runtime_error("snapshot " + path + " fails its checksum");
+    }
+
+    FrozenTree<Key, Value, Compare> tree;
+    tree.comp_ = comp;
+    tree.mapping_ = mapping;
+    tree.mappedKeys_ = reinterpret_cast<const Key*>(bytes + sizeof(header));
+    tree.mappedValues_ = reinterpret_cast<const Value*>(bytes + values_at);
+    tree.mappedSize_ = n;
+    return tree;
+}
+
+// helper for the size of a section rounded up to the alignment
+template<class Key, class Value, class Compare>
+std::size_t FrozenTree<Key, Value, Compare>::padded(std::size_t bytes)
+{
+    return (bytes + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+/**
+* The slot after index in key order among n slots, 0 after the last one.
+*/
+template<class Key, class Value, class Compare>
+std::size_t FrozenTree<Key, Value, Compare>::successor(std::size_t index, std::size_t n)
+{
+    // leftmost of the right subtree if there is one
+    if (2 * index + 1 <= n) return leftmost(2 * index + 1, n);
+
+    // otherwise climb while coming from a right child, then once more
+    while (index & 1) index >>= 1;
+    return index >> 1;
+}
+
+/**
+* The smallest slot in the subtree at index among n slots, 0 if the
+* subtree is empty.
+*/
+template<class Key, class Value, class Compare>
+std::size_t FrozenTree<Key, Value, Compare>::leftmost(std::size_t index, std::size_t n)
+{
+    if (index > n) return 0;
+    while (2 * index <= n) index *= 2;
+    return index;
+}
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef NODE_POOL_H
+#define NODE_POOL_H
+
+#include <cstddef>
+#include <new>
+#include <memory>
+#include <type_traits>
+
+/**
+* A slab/free-list allocator for tree nodes.
+*
+* Nodes are carved out of slabs that double in size (up to a cap), and a
+* deallocated node goes on a free list so the next allocate can reuse it
+* without touching malloc. release() hands every slab back at once, which
+* lets a tree drop all of its nodes without visiting them.
+*
+* Each pool owns its own slabs: copying or rebinding a pool gives a new,
+* empty pool. A tree rebinds its allocator once when it is constructed
+* and never copies it after that, so this is all it needs.
+*/
+template <typename T>
+class NodePool
+{
+public:
+    typedef T value_type;
+
+    NodePool();
+    NodePool(const NodePool& other);
+    template <typename U>
+    NodePool(const NodePool<U>& other);
+    ~NodePool();
+
+    T* allocate(std::size_t n);
+    void deallocate(T* p, std::size_t n);
+
+    void release();
+
+    // every pool owns different memory, so only a pool equals itself
+    bool operator==(const NodePool& rhs) const { return this == &rhs; }
+    bool operator!=(const NodePool& rhs) const { return this != &rhs; }
+
+private:
+    NodePool& operator=(const NodePool&);
+
+    // a free slot reuses the node's own storage as the list link
+    union Slot {
+        Slot* next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    // slabs are chained through a header placed in front of their slots
+    struct Slab {
+        Slab* next;
+    };
+
+    static const std::size_t FIRST_SLAB_SLOTS = 64;
+    static const std::size_t MAX_SLAB_SLOTS = 65536;
+
+    static Slot* slab_slots(Slab* slab);
+    void add_slab();
+
+    Slab* slabs_;
+    Slot* free_;       // recycled slots
+    Slot* next_;       // next never-used slot in the newest slab
+    Slot* end_;        // one past the last slot in the newest slab
+    std::size_t slab_slots_;
+};
+
+template <typename T>
+NodePool<T>::NodePool() :
+    slabs_(nullptr), free_(nullptr), next_(nullptr), end_(nullptr),
+    slab_slots_(FIRST_SLAB_SLOTS)
+{
+
+}
+
+template <typename T>
+NodePool<T>::NodePool(const NodePool&) :
+    slabs_(nullptr), free_(nullptr), next_(nullptr), end_(nullptr),
+    slab_slots_(FIRST_SLAB_SLOTS)
+{
+
+}
+
+template <typename T>
+template <typename U>
+NodePool<T>::NodePool(const NodePool<U>&) :
+    slabs_(nullptr), free_(nullptr), next_(nullptr), end_(nullptr),
+    slab_slots_(FIRST_SLAB_SLOTS)
+{
+
+}
+
+template <typename T>
+NodePool<T>::~NodePool()
+{
+    release();
+}
+
+/**
+* The slots start right after the header, rounded up to the slot alignment.
+*/
+template <typename T>
+typename NodePool<T>::Slot* NodePool<T>::slab_slots(Slab* slab)
+{
+    const std::size_t align = alignof(Slot);
+    const std::size_t offset = (sizeof(Slab) + align - 1) / align * align;
+    return reinterpret_cast<Slot*>(reinterpret_cast<char*>(slab) + offset);
+}
+
+/**
+* Grabs a new slab, twice as big as the last one until the cap.
+*/
+template <typename T>
+void NodePool<T>::add_slab()
+{
+    const std::size_t align = alignof(Slot);
+    const std::size_t offset = (sizeof(Slab) + align - 1) / align * align;
+    Slab* slab = static_cast<Slab*>(::operator new(offset + slab_slots_ * sizeof(Slot)));
+    slab->next = slabs_;
+    slabs_ = slab;
+
+    next_ = slab_slots(slab);
+    end_ = next_ + slab_slots_;
+    if (slab_slots_ < MAX_SLAB_SLOTS) slab_slots_ *= 2;
+}
+
+/**
+* Hands out a recycled slot if there is one, otherwise the next fresh one.
+* Arrays are not pooled and go straight to the global allocator.
+*/
+template <typename T>
+T* NodePool<T>::allocate(std::size_t n)
+{
+    if (n != 1) return static_cast<T*>(::operator new(n * sizeof(T)));
+
+    Slot* slot;
+    if (free_ != nullptr) {
+        slot = free_;
+        free_ = free_->next;
+    } else {
+        if (next_ == end_) add_slab();
+        slot = next_++;
+    }
+    return reinterpret_cast<T*>(slot);
+}
+
+/**
+* Puts a slot back on the free list for the next allocate.
+*/
+template <typename T>
+void NodePool<T>::deallocate(T* p, std::size_t n)
+{
+    if (n != 1) {
+        ::operator delete(p);
+        return;
+    }
+
+    Slot* slot = reinterpret_cast<Slot*>(p);
+    slot->next = free_;
+    free_ = slot;
+}
+
+/**
+* Frees every slab at once. Anything still allocated from the pool is gone
+* afterwards, and no destructors are run for it.
+*/
+template <typename T>
+void NodePool<T>::release()
+{
+    while (slabs_ != nullptr) {
+        Slab* next = slabs_->next;
+        ::operator delete(slabs_);
+        slabs_ = next;
+    }
+    free_ = next_ = end_ = nullptr;
+    slab_slots_ = FIRST_SLAB_SLOTS;
+}
+
+/**
+* Detects allocators that can free everything they handed out in one call.
+*/
+template <typename Alloc>
+class can_release_all
+{
+    template <typename A>
+    static char test(decltype(&A::release));
+    template <typename A>
+    static long test(...);
+public:
+    static const bool value = sizeof(test<Alloc>(0)) == 1;
+};
+
+/**
+* Drops everything alloc handed out if it knows how, returns false if it
+* doesn't (e.g. std::allocator), in which case nothing happened.
+*/
+template <typename Alloc>
+typename std::enable_if<can_release_all<Alloc>::value, bool>::type
+release_all(Alloc& alloc)
+{
+    alloc.release();
+    return true;
+}
+
+template <typename Alloc>
+typename std::enable_if<!can_release_all<Alloc>::value, bool>::type
+release_all(Alloc&)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,550 @@
+#ifndef PERSISTENT_AVLBST_H
+#define PERSISTENT_AVLBST_H
+
+#include <iostream>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+/**
+* An AVL tree whose nodes never change once built, so any number of
+* readers can hold on to a version of it while one writer keeps going.
+*
+* insert and remove copy only the nodes on the path they walk (and the
+* few a rotation touches) and share every other subtree with the
+* previous version. The root of the latest version is published with
+* an atomic store; snapshot() takes it with an atomic load and is O(1).
+* A Snapshot is read without any locking, from any thread, and keeps
+* its nodes alive through their reference counts: a node is freed when
+* the last version that uses it goes away.
+*
+* There can be one writer at a time (calls to insert, remove and clear
+* need outside synchronization), while snapshot() can be called from
+* any thread. Nodes have no parent pointers, since a node can be in
+* several versions, so iterators carry the path down from the root.
+*/
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class PersistentAVLTree
+{
+protected:
+    struct PNode {
+        std::pair<const Key, Value> item;
+        std::shared_ptr<const PNode> left;
+        std::shared_ptr<const PNode> right;
+        std::size_t size;
+        int8_t height;
+
+        PNode(const std::pair<const Key, Value>& item,
+              const std::shared_ptr<const PNode>& left,
+              const std::shared_ptr<const PNode>& right);
+    };
+    typedef std::shared_ptr<const PNode> NodePtr;
+
+public:
+    /**
+    * One immutable version of the tree.
+    */
+    class Snapshot
+    {
+    public:
+        Snapshot();
+
+        /**
+        * Forward iterator over the entries in key order, valid while
+        * the snapshot it came from is alive.
+        */
+        class const_iterator
+        {
+        public:
+            const_iterator();
+
+            const std::pair<const Key, Value>& operator*() const;
+            const std::pair<const Key, Value>* operator->() const;
+
+            bool operator==(const const_iterator& rhs) const;
+            bool operator!=(const const_iterator& rhs) const;
+
+            const_iterator& operator++();
+
+        protected:
+            friend class Snapshot;
+            // the current node on top, under it the ancestors whose
+            // left subtree holds it, i.e. the nodes still to visit
+            std::vector<const PNode*> path_;
+        };
+
+        bool empty() const;
+        std::size_t size() const;
+        const_iterator begin() const;
+        const_iterator end() const;
+        const_iterator find(const Key& key) const;
+        const_iterator lower_bound(const Key& key) const;
+        // lookups that don't build an iterator, and so never allocate
+        const Value* lookup(const Key& key) const;
+        bool contains(const Key& key) const;
+        std::string validate() const;
+
+    protected:
+        friend class PersistentAVLTree<Key, Value, Compare>;
+        Snapshot(const NodePtr& root, const Compare& comp);
+        const PNode* find_node(const Key& key) const;
+        NodePtr root_;
+        Compare comp_;
+    };
+
+    PersistentAVLTree();
+    explicit PersistentAVLTree(const Compare& comp);
+
+    void insert(const std::pair<const Key, Value>& new_item);
+    void remove(const Key& key);
+    void clear();
+    bool empty() const;
+    std::size_t size() const;
+    Snapshot snapshot() const;
+    std::string validate() const;
+
+protected:
+    static int8_t height(const NodePtr& node);
+    static std::size_t size(const NodePtr& node);
+    static NodePtr balance(const std::pair<const Key, Value>& item, const NodePtr& left, const NodePtr& right);
+    NodePtr insert_node(const NodePtr& node, const std::pair<const Key, Value>& new_item) const;
+    NodePtr remove_node(const NodePtr& node, const Key& key) const;
+    static NodePtr remove_min(const NodePtr& node, const PNode*& min);
+
+    // the latest version, read by snapshot() with atomic loads
+    NodePtr root_;
+    Compare comp_;
+
+private:
+    // versions are shared through snapshots, not tree copies
+    PersistentAVLTree(const PersistentAVLTree&);
+    PersistentAVLTree& operator=(const PersistentAVLTree&);
+};
+
+template<class Key, class Value, class Compare>
+PersistentAVLTree<Key, Value, Compare>::PNode::PNode(
+    const std::pair<const Key, Value>& item, const NodePtr& left, const NodePtr& right) :
+    item(item), left(left), right(right),
+    size(1 + PersistentAVLTree::size(left) + PersistentAVLTree::size(right)),
+    height(static_cast<int8_t>(1 + std::max(PersistentAVLTree::height(left), PersistentAVLTree::height(right))))
+{
+
+}
+
+/*
+-----------------------------------------------------------
+Begin implementations for the Snapshot::const_iterator class.
+-----------------------------------------------------------
+*/
+
+/**
+* A default constructor that initializes the iterator to the end.
+*/
+template<class Key, class Value, class Compare>
+PersistentAVLTree<Key, Value, Compare>::Snapshot::const_iterator::const_iterator()
+{
+
+}
+
+template<class Key, class Value, class Compare>
+const std::pair<const Key, Value>&
+PersistentAVLTree<Key, Value, Compare>::Snapshot::const_iterator::operator*() const
+{
+    return path_.back()->item;
+}
+
+template<class Key, class Value, class Compare>
+const std::pair<const Key, Value>*
+PersistentAVLTree<Key, Value, Compare>::Snapshot::const_iterator::operator->() const
+{
+    return &(path_.back()->item);
+}
+
+/**
+* Two iterators are equal when they are at the same node, or both at the end.
+*/
+template<class Key, class Value, class Compare>
+bool PersistentAVLTree<Key, Value, Compare>::Snapshot::const_iterator::operator==(
+    const const_iterator& rhs) const
+{
+    if (path_.empty() || rhs.path_.empty()) return path_.empty() == rhs.path_.empty();
+    return path_.back() == rhs.path_.back();
+}
+
+template<class Key, class Value, class Compare>
+bool PersistentAVLTree<Key, Value, Compare>::Snapshot::const_iterator::operator!=(
+    const const_iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+* The next node is the leftmost one in the right subtree, or if there is
+* no right subtree, the nearest ancestor still on the path.
+*/
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::Snapshot::const_iterator&
+PersistentAVLTree<Key, Value, Compare>::Snapshot::const_iterator::operator++()
+{
+    const PNode* node = path_.back()->right.get();
+    path_.pop_back();
+    for (; node != nullptr; node = node->left.get()) path_.push_back(node);
+    return *this;
+}
+
+/*
+---------------------------------------------------------
+End implementations for the Snapshot::const_iterator class.
+---------------------------------------------------------
+*/
+
+/*
+-----------------------------------------------------------
+Begin implementations for the Snapshot class.
+-----------------------------------------------------------
+*/
+
+/**
+* An empty snapshot.
+*/
+template<class Key, class Value, class Compare>
+PersistentAVLTree<Key, Value, Compare>::Snapshot::Snapshot() : comp_()
+{
+
+}
+
+template<class Key, class Value, class Compare>
+PersistentAVLTree<Key, Value, Compare>::Snapshot::Snapshot(const NodePtr& root, const Compare& comp) :
+    root_(root), comp_(comp)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+bool PersistentAVLTree<Key, Value, Compare>::Snapshot::empty() const
+{
+    return root_ == nullptr;
+}
+
+template<class Key, class Value, class Compare>
+std::size_t PersistentAVLTree<Key, Value, Compare>::Snapshot::size() const
+{
+    return PersistentAVLTree::size(root_);
+}
+
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::Snapshot::const_iterator
+PersistentAVLTree<Key, Value, Compare>::Snapshot::begin() const
+{
+    const_iterator it;
+    for (const PNode* node = root_.get(); node != nullptr; node = node->left.get()) it.path_.push_back(node);
+    return it;
+}
+
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::Snapshot::const_iterator
+PersistentAVLTree<Key, Value, Compare>::Snapshot::end() const
+{
+    return const_iterator();
+}
+
+/**
+* Returns an iterator to the entry with key, or end() if there is none.
+* The path an iterator carries is only built once the key is known to
+* be there, so a miss doesn't allocate.
+*/
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::Snapshot::const_iterator
+PersistentAVLTree<Key, Value, Compare>::Snapshot::find(const Key& key) const
+{
+    if (find_node(key) == nullptr) return end();
+    return lower_bound(key);
+}
+
+/**
+* Returns the value stored with key, or null if there is none. The
+* pointer is valid while the snapshot is alive.
+*/
+template<class Key, class Value, class Compare>
+const Value* PersistentAVLTree<Key, Value, Compare>::Snapshot::lookup(const Key& key) const
+{
+    const PNode* node = find_node(key);
+    return node != nullptr ? &node->item.second : nullptr;
+}
+
+template<class Key, class Value, class Compare>
+bool PersistentAVLTree<Key, Value, Compare>::Snapshot::contains(const Key& key) const
+{
+    return find_node(key) != nullptr;
+}
+
+/**
+* Walks down to the node with key doing one comparison per level, and
+* only checks for equality at the bottom. Null if there is none.
+*/
+template<class Key, class Value, class Compare>
+const typename PersistentAVLTree<Key, Value, Compare>::PNode*
+PersistentAVLTree<Key, Value, Compare>::Snapshot::find_node(const Key& key) const
+{
+    const PNode* not_less = nullptr;
+    const PNode* node = root_.get();
+    while (node != nullptr) {
+        if (comp_(node->item.first, key)) {
+            node = node->right.get();
+        } else {
+            not_less = node;
+            node = node->left.get();
+        }
+    }
+    if (not_less != nullptr && comp_(key, not_less->item.first)) return nullptr;
+    return not_less;
+}
+
+/**
+* Returns an iterator to the first entry whose key is not less than key.
+*/
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::Snapshot::const_iterator
+PersistentAVLTree<Key, Value, Compare>::Snapshot::lower_bound(const Key& key) const
+{
+    // keep the nodes where the walk went left, the last one is the answer
+    const_iterator it;
+    const PNode* node = root_.get();
+    while (node != nullptr) {
+        if (comp_(node->item.first, key)) {
+            node = node->right.get();
+        } else {
+            it.path_.push_back(node);
+            node = node->left.get();
+        }
+    }
+    return it;
+}
+
+/**
+* Checks ordering, heights, balance and sizes, returning a description
+* of the first problem found or an empty string.
+*/
+template<class Key, class Value, class Compare>
+std::string PersistentAVLTree<Key, Value, Compare>::Snapshot::validate() const
+{
+    const PNode* prev = nullptr;
+    std::vector<const PNode*> stack;
+    for (const PNode* node = root_.get(); node != nullptr || !stack.empty(); ) {
+        if (node != nullptr) {
+            stack.push_back(node);
+            node = node->left.get();
+            continue;
+        }
+        node = stack.back();
+        stack.pop_back();
+
+        if (prev != nullptr && !comp_(prev->item.first, node->item.first)) return "keys out of order";
+        int lh = PersistentAVLTree::height(node->left);
+        int rh = PersistentAVLTree::height(node->right);
+        if (node->height != 1 + std::max(lh, rh)) return "wrong height";
+        if (lh - rh > 1 || rh - lh > 1) return "unbalanced node";
+        if (node->size != 1 + PersistentAVLTree::size(node->left) + PersistentAVLTree::size(node->right)) {
+            return "wrong subtree size";
+        }
+        prev = node;
+        node = node->right.get();
+    }
+    return "";
+}
+
+/*
+---------------------------------------------------------
+End implementations for the Snapshot class.
+---------------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+PersistentAVLTree<Key, Value, Compare>::PersistentAVLTree() : comp_()
+{
+
+}
+
+template<class Key, class Value, class Compare>
+PersistentAVLTree<Key, Value, Compare>::PersistentAVLTree(const Compare& comp) : comp_(comp)
+{
+
+}
+
+/**
+* Inserts new_item, or replaces the value if the key is already there.
+* Readers holding a snapshot keep seeing the version before the insert.
+*/
+template<class Key, class Value, class Compare>
+void PersistentAVLTree<Key, Value, Compare>::insert(const std::pair<const Key, Value>& new_item)
+{
+    std::atomic_store(&root_, insert_node(root_, new_item));
+}
+
+/**
+* Removes key if it is there.
+*/
+template<class Key, class Value, class Compare>
+void PersistentAVLTree<Key, Value, Compare>::remove(const Key& key)
+{
+    std::atomic_store(&root_, remove_node(root_, key));
+}
+
+/**
+* Drops the latest version. Its nodes are freed once no snapshot uses them.
+*/
+template<class Key, class Value, class Compare>
+void PersistentAVLTree<Key, Value, Compare>::clear()
+{
+    std::atomic_store(&root_, NodePtr());
+}
+
+// the writer owns root_, so these read it without an atomic load
+template<class Key, class Value, class Compare>
+bool PersistentAVLTree<Key, Value, Compare>::empty() const
+{
+    return root_ == nullptr;
+}
+
+template<class Key, class Value, class Compare>
+std::size_t PersistentAVLTree<Key, Value, Compare>::size() const
+{
+    return size(root_);
+}
+
+/**
+* Returns the latest version. O(1): it only takes a reference to the root.
+*/
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::Snapshot
+PersistentAVLTree<Key, Value, Compare>::snapshot() const
+{
+    return Snapshot(std::atomic_load(&root_), comp_);
+}
+
+template<class Key, class Value, class Compare>
+std::string PersistentAVLTree<Key, Value, Compare>::validate() const
+{
+    return snapshot().validate();
+}
+
+/*
+-----------------------------------------------------------
+Begin helper functions for the PersistentAVLTree class.
+-----------------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+int8_t PersistentAVLTree<Key, Value, Compare>::height(const NodePtr& node)
+{
+    return node == nullptr ? 0 : node->height;
+}
+
+template<class Key, class Value, class Compare>
+std::size_t PersistentAVLTree<Key, Value, Compare>::size(const NodePtr& node)
+{
+    return node == nullptr ? 0 : node->size;
+}
+
+/**
+* Builds a node for item over left and right, whose heights differ by at
+* most 2, rotating if needed. Rotations build new nodes too, since the
+* old ones may be shared with other versions.
+*/
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::NodePtr
+PersistentAVLTree<Key, Value, Compare>::balance(
+    const std::pair<const Key, Value>& item, const NodePtr& left, const NodePtr& right)
+{
+    if (height(left) > height(right) + 1) {
+        if (height(left->left) >= height(left->right)) {
+            // single right rotation
+            return std::make_shared<const PNode>(left->item, left->left,
+                std::make_shared<const PNode>(item, left->right, right));
+        }
+        // left-right: left's right child comes up
+        const NodePtr& mid = left->right;
+        return std::make_shared<const PNode>(mid->item,
+            std::make_shared<const PNode>(left->item, left->left, mid->left),
+            std::make_shared<const PNode>(item, mid->right, right));
+    }
+    if (height(right) > height(left) + 1) {
+        if (height(right->right) >= height(right->left)) {
+            // single left rotation
+            return std::make_shared<const PNode>(right->item,
+                std::make_shared<const PNode>(item, left, right->left), right->right);
+        }
+        // right-left: right's left child comes up
+        const NodePtr& mid = right->left;
+        return std::make_shared<const PNode>(mid->item,
+            std::make_shared<const PNode>(item, left, mid->left),
+            std::make_shared<const PNode>(right->item, mid->right, right->right));
+    }
+    return std::make_shared<const PNode>(item, left, right);
+}
+
+// the new version of the subtree at node with new_item in it
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::NodePtr
+PersistentAVLTree<Key, Value, Compare>::insert_node(
+    const NodePtr& node, const std::pair<const Key, Value>& new_item) const
+{
+    if (node == nullptr) return std::make_shared<const PNode>(new_item, NodePtr(), NodePtr());
+    if (comp_(new_item.first, node->item.first)) {
+        return balance(node->item, insert_node(node->left, new_item), node->right);
+    }
+    if (comp_(node->item.first, new_item.first)) {
+        return balance(node->item, node->left, insert_node(node->right, new_item));
+    }
+    return std::make_shared<const PNode>(new_item, node->left, node->right);
+}
+
+// the new version of the subtree at node without key, or node itself
+// when key isn't there, so a missing key copies nothing
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::NodePtr
+PersistentAVLTree<Key, Value, Compare>::remove_node(const NodePtr& node, const Key& key) const
+{
+    if (node == nullptr) return node;
+    if (comp_(key, node->item.first)) {
+        NodePtr left = remove_node(node->left, key);
+        return left == node->left ? node : balance(node->item, left, node->right);
+    }
+    if (comp_(node->item.first, key)) {
+        NodePtr right = remove_node(node->right, key);
+        return right == node->right ? node : balance(node->item, node->left, right);
+    }
+    if (node->left == nullptr) return node->right;
+    if (node->right == nullptr) return node->left;
+
+    // two children: the successor takes the node's place
+    const PNode* successor;
+    NodePtr right = remove_min(node->right, successor);
+    return balance(successor->item, node->left, right);
+}
+
+// the subtree at node without its smallest entry, which is left in min;
+// min stays valid as long as node does
+template<class Key, class Value, class Compare>
+typename PersistentAVLTree<Key, Value, Compare>::NodePtr
+PersistentAVLTree<Key, Value, Compare>::remove_min(const NodePtr& node, const PNode*& min)
+{
+    if (node->left == nullptr) {
+        min = node.get();
+        return node->right;
+    }
+    return balance(node->item, remove_min(node->left, min), node->right);
+}
+
+/*
+---------------------------------------------------------
+End helper functions for the PersistentAVLTree class.
+---------------------------------------------------------
+*/
+
+#endif
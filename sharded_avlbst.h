@@ -0,0 +1,506 @@
+#ifndef SHARDED_AVLBST_H
+#define SHARDED_AVLBST_H
+
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <functional>
+#include <algorithm>
+#include "avlbst.h"
+
+/**
+* A thread-safe ordered map split by key range into shards, each an
+* AVLTree with its own lock, so writers to different ranges don't wait
+* on each other.
+*
+* Shard i holds the keys in [boundaries[i - 1], boundaries[i]), with the
+* first and last shard open ended. The boundaries sit behind a
+* reader/writer lock: every operation holds it shared while it finds
+* and locks its shard, and only moving a boundary takes it exclusively.
+*
+* When a shard grows past twice the average shard size (plus some
+* slack), a hot range is filling it, so it hands half the difference to
+* its smaller neighbour: the boundary between them moves and the
+* entries on the wrong side move with it. rebalance() does the same on
+* demand.
+*
+* Iteration and range scans go shard by shard, locking one at a time,
+* so they see each shard at a consistent moment but not the whole map
+* at one; the iterator holds a copy of its entry and finds the next one
+* when incremented, so writers never invalidate it.
+*/
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class ShardedAVLTree
+{
+public:
+    explicit ShardedAVLTree(const std::vector<Key>& boundaries, const Compare& comp = Compare());
+
+    void insert(const std::pair<const Key, Value>& new_item);
+    void remove(const Key& key);
+    bool find(const Key& key, Value& value) const;
+    bool contains(const Key& key) const;
+    bool empty() const;
+    std::size_t size() const;
+
+    template<typename Fn>
+    void for_each_in_range(const Key& lo, const Key& hi, Fn fn) const;
+    void rebalance();
+
+    std::size_t shardCount() const;
+    std::vector<std::size_t> shardSizes() const;
+    std::vector<Key> boundaries() const;
+    std::string validate() const;
+
+    /**
+    * Forward iterator over copies of the entries in key order.
+    */
+    class const_iterator
+    {
+    public:
+        const_iterator();
+
+        const std::pair<const Key, Value>& operator*() const;
+        const std::pair<const Key, Value>* operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+
+    protected:
+        friend class ShardedAVLTree<Key, Value, Compare>;
+        const_iterator(const ShardedAVLTree<Key, Value, Compare>* tree,
+                       const std::pair<const Key, Value>& item);
+        const ShardedAVLTree<Key, Value, Compare>* tree_;
+        std::shared_ptr<const std::pair<const Key, Value> > item_;  // null at the end
+    };
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator lower_bound(const Key& key) const;
+
+    // how much bigger than twice the average a shard may get before it
+    // gives keys to a neighbour
+    static const std::size_t REBALANCE_SLACK = 1024;
+
+protected:
+    struct Shard {
+        AVLTree<Key, Value, Compare> tree;
+        mutable std::mutex lock;
+
+        explicit Shard(const Compare& comp);
+    };
+
+    std::size_t shardOf(const Key& key) const;
+    bool seek(const Key& key, bool inclusive, const_iterator& it) const;
+    bool shardIsHot(std::size_t shard_size) const;
+    bool rebalance_nl();
+    void moveEntries(std::size_t from, std::size_t to, std::size_t count);
+
+    std::vector<std::unique_ptr<Shard> > shards_;
+    std::vector<Key> boundaries_;
+    mutable std::shared_mutex boundariesLock_;
+    std::atomic<std::size_t> size_;
+    std::atomic<bool> rebalancing_;
+    Compare comp_;
+
+private:
+    ShardedAVLTree(const ShardedAVLTree&);
+    ShardedAVLTree& operator=(const ShardedAVLTree&);
+};
+
+template<class Key, class Value, class Compare>
+ShardedAVLTree<Key, Value, Compare>::Shard::Shard(const Compare& comp) : tree(comp)
+{
+
+}
+
+/*
+-----------------------------------------------------------
+Begin implementations for the ShardedAVLTree::const_iterator class.
+-----------------------------------------------------------
+*/
+
+/**
+* A default constructor that initializes the iterator to the end.
+*/
+template<class Key, class Value, class Compare>
+ShardedAVLTree<Key, Value, Compare>::const_iterator::const_iterator() : tree_(nullptr)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+ShardedAVLTree<Key, Value, Compare>::const_iterator::const_iterator(
+    const ShardedAVLTree<Key, Value, Compare>* tree, const std::pair<const Key, Value>& item) :
+    tree_(tree), item_(std::make_shared<const std::pair<const Key, Value> >(item))
+{
+
+}
+
+template<class Key, class Value, class Compare>
+const std::pair<const Key, Value>& ShardedAVLTree<Key, Value, Compare>::const_iterator::operator*() const
+{
+    return *item_;
+}
+
+template<class Key, class Value, class Compare>
+const std::pair<const Key, Value>* ShardedAVLTree<Key, Value, Compare>::const_iterator::operator->() const
+{
+    return item_.get();
+}
+
+/**
+* Iterators are equal when both are at the end or at the same key.
+*/
+template<class Key, class Value, class Compare>
+bool ShardedAVLTree<Key, Value, Compare>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    if (item_ == nullptr || rhs.item_ == nullptr) return item_ == nullptr && rhs.item_ == nullptr;
+    return !tree_->comp_(item_->first, rhs.item_->first) && !tree_->comp_(rhs.item_->first, item_->first);
+}
+
+template<class Key, class Value, class Compare>
+bool ShardedAVLTree<Key, Value, Compare>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+* Moves to the first entry after the current key, as the map is now.
+*/
+template<class Key, class Value, class Compare>
+typename ShardedAVLTree<Key, Value, Compare>::const_iterator&
+ShardedAVLTree<Key, Value, Compare>::const_iterator::operator++()
+{
+    const_iterator next;
+    tree_->seek(item_->first, false, next);
+    item_.swap(next.item_);
+    return *this;
+}
+
+/*
+---------------------------------------------------------
+End implementations for the ShardedAVLTree::const_iterator class.
+---------------------------------------------------------
+*/
+
+/**
+* Makes boundaries.size() + 1 shards split at the given keys, which must
+* be sorted by comp with no repeats.
+*/
+template<class Key, class Value, class Compare>
+ShardedAVLTree<Key, Value, Compare>::ShardedAVLTree(const std::vector<Key>& boundaries, const Compare& comp) :
+    boundaries_(boundaries), size_(0), rebalancing_(false), comp_(comp)
+{
+    for (std::size_t i = 0; i <= boundaries.size(); i++) shards_.push_back(std::unique_ptr<Shard>(new Shard(comp)));
+}
+
+/**
+* Inserts new_item, or overwrites the value if the key is already there.
+* May move a boundary afterwards if the shard has become too big.
+*/
+template<class Key, class Value, class Compare>
+void ShardedAVLTree<Key, Value, Compare>::insert(const std::pair<const Key, Value>& new_item)
+{
+    bool hot;
+    {
+        std::shared_lock<std::shared_mutex> boundaries_guard(boundariesLock_);
+        Shard& shard = *shards_[shardOf(new_item.first)];
+        std::lock_guard<std::mutex> shard_guard(shard.lock);
+        std::size_t old_size = shard.tree.size();
+        shard.tree.insert(new_item);
+        if (shard.tree.size() != old_size) size_++;
+        hot = shardIsHot(shard.tree.size());
+    }
+
+    // one thread moves boundaries at a time, the others carry on
+    if (hot && !rebalancing_.exchange(true)) {
+        {
+            std::unique_lock<std::shared_mutex> boundaries_guard(boundariesLock_);
+            rebalance_nl();
+        }
+        rebalancing_ = false;
+    }
+}
+
+template<class Key, class Value, class Compare>
+void ShardedAVLTree<Key, Value, Compare>::remove(const Key& key)
+{
+    std::shared_lock<std::shared_mutex> boundaries_guard(boundariesLock_);
+    Shard& shard = *shards_[shardOf(key)];
+    std::lock_guard<std::mutex> shard_guard(shard.lock);
+    std::size_t old_size = shard.tree.size();
+    shard.tree.remove(key);
+    if (shard.tree.size() != old_size) size_--;
+}
+
+/**
+* Copies key's value into value and returns true, or returns false if
+* key isn't there.
+*/
+template<class Key, class Value, class Compare>
+bool ShardedAVLTree<Key, Value, Compare>::find(const Key& key, Value& value) const
+{
+    std::shared_lock<std::shared_mutex> boundaries_guard(boundariesLock_);
+    const Shard& shard = *shards_[shardOf(key)];
+    std::lock_guard<std::mutex> shard_guard(shard.lock);
+    typename AVLTree<Key, Value, Compare>::const_iterator it = shard.tree.find(key);
+    if (it == shard.tree.end()) return false;
+    value = it->second;
+    return true;
+}
+
+template<class Key, class Value, class Compare>
+bool ShardedAVLTree<Key, Value, Compare>::contains(const Key& key) const
+{
+    std::shared_lock<std::shared_mutex> boundaries_guard(boundariesLock_);
+    const Shard& shard = *shards_[shardOf(key)];
+    std::lock_guard<std::mutex> shard_guard(shard.lock);
+    return shard.tree.find(key) != shard.tree.end();
+}
+
+template<class Key, class Value, class Compare>
+bool ShardedAVLTree<Key, Value, Compare>::empty() const
+{
+    return size_.load() == 0;
+}
+
+template<class Key, class Value, class Compare>
+std::size_t ShardedAVLTree<Key, Value, Compare>::size() const
+{
+    return size_.load();
+}
+
+/**
+* Calls fn on every entry with lo <= key < hi, in key order, holding
+* each shard's lock while visiting it.
+*/
+template<class Key, class Value, class Compare>
+template<typename Fn>
+void ShardedAVLTree<Key, Value, Compare>::for_each_in_range(const Key& lo, const Key& hi, Fn fn) const
+{
+    std::shared_lock<std::shared_mutex> boundaries_guard(boundariesLock_);
+    for (std::size_t i = shardOf(lo); i < shards_.size(); i++) {
+        // shards past this one start at or after hi
+        if (i > 0 && !comp_(boundaries_[i - 1], hi)) break;
+        std::lock_guard<std::mutex> shard_guard(shards_[i]->lock);
+        shards_[i]->tree.for_each_in_range(lo, hi, fn);
+    }
+}
+
+/**
+* Moves boundaries until no shard is more than twice the average size
+* (plus REBALANCE_SLACK). Waits for every operation in flight.
+*/
+template<class Key, class Value, class Compare>
+void ShardedAVLTree<Key, Value, Compare>::rebalance()
+{
+    std::unique_lock<std::shared_mutex> boundaries_guard(boundariesLock_);
+    while (rebalance_nl()) { }
+}
+
+template<class Key, class Value, class Compare>
+std::size_t ShardedAVLTree<Key, Value, Compare>::shardCount() const
+{
+    return shards_.size();
+}
+
+template<class Key, class Value, class Compare>
+std::vector<std::size_t> ShardedAVLTree<Key, Value, Compare>::shardSizes() const
+{
+    std::shared_lock<std::shared_mutex> boundaries_guard(boundariesLock_);
+    std::vector<std::size_t> sizes;
+    for (std::size_t i = 0; i < shards_.size(); i++) {
+        std::lock_guard<std::mutex> shard_guard(shards_[i]->lock);
+        sizes.push_back(shards_[i]->tree.size());
+    }
+    return sizes;
+}
+
+template<class Key, class Value, class Compare>
+std::vector<Key> ShardedAVLTree<Key, Value, Compare>::boundaries() const
+{
+    std::shared_lock<std::shared_mutex> boundaries_guard(boundariesLock_);
+    return boundaries_;
+}
+
+/**
+* Checks every shard's tree and that every key is inside its shard's
+* range. Returns a description of the first problem, or an empty string.
+*/
+template<class Key, class Value, class Compare>
+std::string ShardedAVLTree<Key, Value, Compare>::validate() const
+{
+    std::unique_lock<std::shared_mutex> boundaries_guard(boundariesLock_);
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < shards_.size(); i++) {
+        const AVLTree<Key, Value, Compare>& tree = shards_[i]->tree;
+        std::string error = tree.validate();
+        if (!error.empty()) return error;
+        total += tree.size();
+        if (tree.empty()) continue;
+        if (i > 0 && comp_(tree.begin()->first, boundaries_[i - 1])) return "key below its shard";
+        typename AVLTree<Key, Value, Compare>::const_iterator last = tree.end();
+        --last;
+        if (i < boundaries_.size() && !comp_(last->first, boundaries_[i])) return "key above its shard";
+    }
+    if (total != size_.load()) return "size does not match the shards";
+    return "";
+}
+
+template<class Key, class Value, class Compare>
+typename ShardedAVLTree<Key, Value, Compare>::const_iterator
+ShardedAVLTree<Key, Value, Compare>::begin() const
+{
+    const_iterator it;
+    std::shared_lock<std::shared_mutex> boundaries_guard(boundariesLock_);
+    for (std::size_t i = 0; i < shards_.size(); i++) {
+        std::lock_guard<std::mutex> shard_guard(shards_[i]->lock);
+        if (!shards_[i]->tree.empty()) return const_iterator(this, *shards_[i]->tree.begin());
+    }
+    return it;
+}
+
+template<class Key, class Value, class Compare>
+typename ShardedAVLTree<Key, Value, Compare>::const_iterator
+ShardedAVLTree<Key, Value, Compare>::end() const
+{
+    return const_iterator();
+}
+
+/**
+* Returns an iterator to the first entry whose key is not less than key.
+*/
+template<class Key, class Value, class Compare>
+typename ShardedAVLTree<Key, Value, Compare>::const_iterator
+ShardedAVLTree<Key, Value, Compare>::lower_bound(const Key& key) const
+{
+    const_iterator it;
+    seek(key, true, it);
+    return it;
+}
+
+/*
+-----------------------------------------------------------
+Begin helper functions for the ShardedAVLTree class.
+-----------------------------------------------------------
+*/
+
+// the shard whose range holds key, boundaries must be locked
+template<class Key, class Value, class Compare>
+std::size_t ShardedAVLTree<Key, Value, Compare>::shardOf(const Key& key) const
+{
+    return std::upper_bound(boundaries_.begin(), boundaries_.end(), key, comp_) - boundaries_.begin();
+}
+
+/**
+* Points it at the first entry at or after key (inclusive) or after key,
+* looking in key's shard and then the ones after it. Returns false and
+* leaves it at the end if there is none.
+*/
+template<class Key, class Value, class Compare>
+bool ShardedAVLTree<Key, Value, Compare>::seek(const Key& key, bool inclusive, const_iterator& it) const
+{
+    std::shared_lock<std::shared_mutex> boundaries_guard(boundariesLock_);
+    for (std::size_t i = shardOf(key); i < shards_.size(); i++) {
+        const AVLTree<Key, Value, Compare>& tree = shards_[i]->tree;
+        std::lock_guard<std::mutex> shard_guard(shards_[i]->lock);
+        typename AVLTree<Key, Value, Compare>::const_iterator found =
+            inclusive ? tree.lower_bound(key) : tree.upper_bound(key);
+        if (found != tree.end()) {
+            it = const_iterator(this, *found);
+            return true;
+        }
+    }
+    return false;
+}
+
+// racy on purpose, the rebalance under the exclusive lock checks again
+template<class Key, class Value, class Compare>
+bool ShardedAVLTree<Key, Value, Compare>::shardIsHot(std::size_t shard_size) const
+{
+    return shard_size > 2 * (size_.load() / shards_.size()) + REBALANCE_SLACK;
+}
+
+/**
+* Takes the biggest hot shard that has a smaller neighbour and moves half
+* the difference between them across their boundary. Returns whether
+* anything moved; every move evens the sizes out, so calling this until it
+* returns false ends. boundaries must be locked exclusively, so no shard
+* is in use.
+*/
+template<class Key, class Value, class Compare>
+bool ShardedAVLTree<Key, Value, Compare>::rebalance_nl()
+{
+    std::vector<std::size_t> order;
+    for (std::size_t i = 0; i < shards_.size(); i++) order.push_back(i);
+    std::sort(order.begin(), order.end(), [this](std::size_t a, std::size_t b) {
+        return shards_[a]->tree.size() > shards_[b]->tree.size();
+    });
+
+    for (std::size_t k = 0; k < order.size(); k++) {
+        std::size_t hot = order[k];
+        std::size_t hot_size = shards_[hot]->tree.size();
+        if (!shardIsHot(hot_size)) return false;
+
+        std::size_t to = hot;
+        if (hot > 0) to = hot - 1;
+        if (hot + 1 < shards_.size() && (to == hot || shards_[hot + 1]->tree.size() < shards_[to]->tree.size())) {
+            to = hot + 1;
+        }
+        std::size_t count = to == hot ? 0 : (hot_size - shards_[to]->tree.size()) / 2;
+        if (count == 0) continue;
+
+        moveEntries(hot, to, count);
+        return true;
+    }
+    return false;
+}
+
+/**
+* Moves the count entries of shard from nearest to its neighbour to,
+* and puts the boundary between them just past the last one moved.
+*/
+template<class Key, class Value, class Compare>
+void ShardedAVLTree<Key, Value, Compare>::moveEntries(std::size_t from, std::size_t to, std::size_t count)
+{
+    AVLTree<Key, Value, Compare>& source = shards_[from]->tree;
+    AVLTree<Key, Value, Compare>& dest = shards_[to]->tree;
+    if (count == 0) return;
+
+    std::vector<std::pair<Key, Value> > moving;
+    moving.reserve(count);
+    if (to > from) {
+        // the largest keys go right
+        typename AVLTree<Key, Value, Compare>::iterator it = source.end();
+        for (std::size_t i = 0; i < count; i++) {
+            --it;
+            moving.push_back(*it);
+        }
+        boundaries_[from] = moving.back().first;
+    } else {
+        // the smallest keys go left
+        typename AVLTree<Key, Value, Compare>::iterator it = source.begin();
+        for (std::size_t i = 0; i < count; i++, ++it) moving.push_back(*it);
+        boundaries_[to] = it->first;
+    }
+
+    for (std::size_t i = 0; i < moving.size(); i++) {
+        source.remove(moving[i].first);
+        dest.insert(std::pair<const Key, Value>(std::move(moving[i].first), std::move(moving[i].second)));
+    }
+}
+
+/*
+---------------------------------------------------------
+End helper functions for the ShardedAVLTree class.
+---------------------------------------------------------
+*/
+
+#endif